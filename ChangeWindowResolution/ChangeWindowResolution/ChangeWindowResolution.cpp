@@ -1,41 +1,70 @@
-﻿#include <windows.h>
+﻿#define NOMINMAX
+#include <windows.h>
 #include <windowsx.h>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include <thread>
 #include <chrono>
 #include <fcntl.h>
 #include <io.h>
+#include <conio.h>
 #include <dwmapi.h>
+#include <commctrl.h>
 #include <TlHelp32.h>
-#include <Psapi.h>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <future>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <shared_mutex>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cwchar>
+#include <cstring>
+#include <random>
+#include <iterator>
+#include <type_traits>
+#include <charconv>
+
+#include "Core/ControlProtocol.h"
+#include "Core/DesktopBenchmark.h"
+#include "Core/Enforcement.h"
+#include "Core/EnforcementStats.h"
+#include "Core/FrameBatching.h"
+#include "Core/PollingGeometrySource.h"
+#include "Core/SizeClamps.h"
+#include "Core/TitleBarCache.h"
+#include "Core/TitleIndex.h"
+#include "Core/Trace.h"
+#include "Core/WinEventRouter.h"
+#include "Core/WindowRegistry.h"
+#include "Core/WindowSnapshot.h"
 
 #pragma comment(lib, "dwmapi.lib")
 #pragma comment(lib, "user32.lib")
-#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "comctl32.lib")
 
 // Constants
 constexpr int CUSTOM_TITLE_HEIGHT = 30;
 constexpr int TITLE_MAX_LENGTH = 256;
-constexpr int THREAD_REFRESH_MS = 5;
+constexpr int TITLE_FONT_SIZE = 12;  // Pixels at 96 DPI
+constexpr int PROCESS_CACHE_REFRESH_MS = 1000;
 constexpr COLORREF TITLE_BAR_COLOR = RGB(50, 50, 50);
 constexpr COLORREF TITLE_TEXT_COLOR = RGB(255, 255, 255);
 
 // Structures and global variables
-struct WindowInfo {
-    HWND hwnd;
-    std::wstring title;
-    DWORD processId;
-};
-
-struct ResizeData {
-    int width;
-    int height;
-    bool keepForcing;
+enum class EnforcementStrategy {
+    Events,  // React to window geometry change notifications
+    Polling  // Re-check every THREAD_REFRESH_MS
 };
 
 // RAII wrapper for DC handles
@@ -71,16 +100,80 @@ private:
     HBRUSH m_brush;
 };
 
-// Global state protected by mutex
-std::mutex g_stateMutex;
-std::map<HWND, WNDPROC> g_originalWndProcs;
-std::map<HWND, ResizeData> g_windowSizes;
-HHOOK g_messageHook = NULL;
-HHOOK g_cbtHook = NULL;
+// Statistics published in a named mapping for "--stats" in another process
+class SharedEnforcementStats : public EnforcementStats {
+public:
+    ~SharedEnforcementStats() { Close(); }
+
+    static std::wstring RegionName(DWORD processId) {
+        return L"Local\\FRW.Stats." + std::to_wstring(processId);
+    }
+
+    bool Open() {
+        if (Region()) {
+            return true;
+        }
+
+        m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            0, sizeof(StatsRegion), RegionName(GetCurrentProcessId()).c_str());
+        if (!m_mapping) {
+            return false;
+        }
+
+        // Fresh mappings are zero-filled, which is a valid empty region
+        void* view = MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(StatsRegion));
+        if (!view) {
+            Close();
+            return false;
+        }
+
+        Attach(static_cast<StatsRegion*>(view), GetCurrentProcessId());
+        return true;
+    }
+
+    void Close() {
+        if (StatsRegion* region = Detach()) {
+            UnmapViewOfFile(region);
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+    }
+
+private:
+    HANDLE m_mapping = NULL;
+};
+
+// Message hooks of one UI thread of this process, shared by its windows
+struct ThreadMessageHooks {
+    HHOOK messageHook = NULL;
+    HHOOK cbtHook = NULL;
+    std::set<HWND> windows;
+};
+
+// Global state
+std::mutex g_stateMutex;  // Guards hook installation
+WindowRegistry g_registry;
+SharedEnforcementStats g_stats;
+std::map<DWORD, ThreadMessageHooks> g_messageHooks;  // By hooked thread
 bool g_isDragging = false;
 POINT g_dragStart = { 0, 0 };
 
 // Helper Functions
+bool AppendWindow(WindowSnapshot& snapshot, HWND hwnd, uint32_t flags) {
+    int length = GetWindowTextLengthW(hwnd);
+    if (length <= 0) {
+        return false;
+    }
+
+    DWORD processId = 0;
+    GetWindowThreadProcessId(hwnd, &processId);
+    return snapshot.AppendTitled(hwnd, processId, flags, length, [hwnd](wchar_t* title, size_t size) {
+        return GetWindowTextW(hwnd, title, static_cast<int>(size));
+    });
+}
+
 void SetupConsoleForCyrillic() {
     SetConsoleCP(CP_UTF8);
     SetConsoleOutputCP(CP_UTF8);
@@ -89,537 +182,5008 @@ void SetupConsoleForCyrillic() {
     _setmode(_fileno(stderr), _O_U16TEXT);
 }
 
-void DebugLog(const std::wstring& message) {
-    std::wcout << L"[DEBUG] " << message << std::endl;
-}
+// Logging. Call sites pass the pieces of a message instead of a built
+// string; Log<Level> copies them into a fixed-size binary record in a
+// lock-free ring and returns. A drain thread renders the records to the
+// console, or appends them as they are to a file that --decode-log turns
+// back into text. A call below FRW_LOG_LEVEL writes nothing, but its
+// arguments are still evaluated, so pass values that are already at hand.
+enum LogLevel : uint8_t {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+};
 
-std::wstring GetProcessNameById(DWORD processId) {
-    wchar_t processName[MAX_PATH] = L"Неизвестно";
-    HANDLE hProcess = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, processId);
+#ifndef FRW_LOG_LEVEL
+#ifdef NDEBUG
+#define FRW_LOG_LEVEL LOG_INFO
+#else
+#define FRW_LOG_LEVEL LOG_DEBUG
+#endif
+#endif
+
+constexpr uint32_t LOG_FILE_MAGIC = 0x4C575246;  // "FRWL"
+constexpr uint32_t LOG_FILE_VERSION = 1;
+constexpr size_t LOG_SLOT_COUNT = 1024;  // Power of two
+constexpr size_t LOG_RECORD_MAX = 248;
+constexpr DWORD LOG_DRAIN_INTERVAL_MS = 10;
+
+enum LogArgumentTag : uint8_t {
+    LOG_ARG_INT = 1,   // int64_t
+    LOG_ARG_UINT = 2,  // uint64_t
+    LOG_ARG_TEXT = 3   // uint16_t length, then UTF-16 code units
+};
+
+// Records are packed without padding and read back with memcpy
+struct LogFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t ticksPerSecond;
+    uint64_t startTicks;
+};
 
-    if (hProcess) {
-        HMODULE hMod;
-        DWORD cbNeeded;
+struct LogRecordHeader {
+    uint16_t size;  // Whole record, header included
+    uint8_t level;
+    uint8_t reserved;
+    DWORD threadId;
+    uint64_t ticks;  // EnforcementStats::Now
+};
 
-        if (EnumProcessModules(hProcess, &hMod, sizeof(hMod), &cbNeeded)) {
-            GetModuleBaseNameW(hProcess, hMod, processName, sizeof(processName) / sizeof(wchar_t));
+// Bounded multi-producer, single-consumer ring of fixed-size slots. A slot's
+// sequence number tells whose turn it is, so producers only contend on one
+// atomic increment and never wait: a full ring rejects the record.
+class LogRing {
+public:
+    LogRing() {
+        for (size_t i = 0; i < LOG_SLOT_COUNT; ++i) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
         }
-        CloseHandle(hProcess);
     }
 
-    return processName;
-}
-
-void CenterWindowOnScreen(HWND hwnd, int width, int height) {
-    int screenWidth = GetSystemMetrics(SM_CXSCREEN);
-    int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+    uint8_t* Reserve(size_t& position) {
+        position = m_enqueue.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = m_slots[position & (LOG_SLOT_COUNT - 1)];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
 
-    int posX = (screenWidth - width) / 2;
-    int posY = (screenHeight - height) / 2;
+            if (difference == 0) {
+                if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    return slot.data;
+                }
+            }
+            else if (difference < 0) {
+                return nullptr;
+            }
+            else {
+                position = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-    SetWindowPos(hwnd, NULL, posX, posY, width, height, SWP_NOZORDER | SWP_NOACTIVATE);
-}
+    void Commit(size_t position) {
+        m_slots[position & (LOG_SLOT_COUNT - 1)].sequence.store(position + 1, std::memory_order_release);
+    }
 
-void DrawCustomTitleBar(HWND hwnd, HDC hdc) {
-    RECT windowRect;
-    GetWindowRect(hwnd, &windowRect);
+    // Consumer only; copies the oldest committed record out
+    bool Pop(uint8_t* record) {
+        Slot& slot = m_slots[m_dequeue & (LOG_SLOT_COUNT - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != m_dequeue + 1) {
+            return false;
+        }
 
-    // Create rectangle for our title bar
-    RECT titleRect = { 0, 0, windowRect.right - windowRect.left, CUSTOM_TITLE_HEIGHT };
+        memcpy(record, slot.data, LOG_RECORD_MAX);
+        slot.sequence.store(m_dequeue + LOG_SLOT_COUNT, std::memory_order_release);
+        m_dequeue++;
+        return true;
+    }
 
-    // Draw title bar background
-    BrushWrapper titleBrush(TITLE_BAR_COLOR);
-    FillRect(hdc, &titleRect, titleBrush);
+private:
+    struct alignas(64) Slot {
+        std::atomic<size_t> sequence;
+        uint8_t data[LOG_RECORD_MAX];
+    };
+
+    Slot m_slots[LOG_SLOT_COUNT];
+    alignas(64) std::atomic<size_t> m_enqueue{ 0 };
+    alignas(64) size_t m_dequeue = 0;
+};
 
-    // Draw window title
-    wchar_t title[TITLE_MAX_LENGTH];
-    GetWindowTextW(hwnd, title, TITLE_MAX_LENGTH);
+inline void EncodeLogArgument(uint8_t* record, size_t& size, std::wstring_view text) {
+    if (size + 3 > LOG_RECORD_MAX) {
+        return;
+    }
 
-    SetBkMode(hdc, TRANSPARENT);
-    SetTextColor(hdc, TITLE_TEXT_COLOR);
+    // Long texts are cut to what is left of the record
+    uint16_t length = static_cast<uint16_t>(std::min(text.size(), (LOG_RECORD_MAX - size - 3) / sizeof(wchar_t)));
+    record[size] = LOG_ARG_TEXT;
+    memcpy(record + size + 1, &length, sizeof(length));
+    memcpy(record + size + 3, text.data(), length * sizeof(wchar_t));
+    size += 3 + length * sizeof(wchar_t);
+}
 
-    titleRect.left += 10; // Left padding for text
-    DrawTextW(hdc, title, -1, &titleRect, DT_SINGLELINE | DT_VCENTER);
+inline void EncodeLogArgument(uint8_t* record, size_t& size, const wchar_t* text) {
+    EncodeLogArgument(record, size, std::wstring_view(text));
 }
 
-// Window enumeration functions
-void FindChildWindows(HWND parentHwnd, std::vector<WindowInfo>& childWindows) {
-    EnumChildWindows(parentHwnd, [](HWND hwnd, LPARAM lParam) -> BOOL {
-        auto windowList = reinterpret_cast<std::vector<WindowInfo>*>(lParam);
-        wchar_t title[TITLE_MAX_LENGTH] = { 0 };
+template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+void EncodeLogArgument(uint8_t* record, size_t& size, T value) {
+    if (size + 9 > LOG_RECORD_MAX) {
+        return;
+    }
 
-        if (IsWindowVisible(hwnd) && GetWindowTextLengthW(hwnd) > 0) {
-            GetWindowTextW(hwnd, title, TITLE_MAX_LENGTH);
+    if (std::is_signed<T>::value) {
+        int64_t wide = static_cast<int64_t>(value);
+        record[size] = LOG_ARG_INT;
+        memcpy(record + size + 1, &wide, sizeof(wide));
+    }
+    else {
+        uint64_t wide = static_cast<uint64_t>(value);
+        record[size] = LOG_ARG_UINT;
+        memcpy(record + size + 1, &wide, sizeof(wide));
+    }
+    size += 9;
+}
 
-            DWORD processId = 0;
-            GetWindowThreadProcessId(hwnd, &processId);
+// Renders one record's message; stops at anything malformed
+std::wstring DecodeLogMessage(const uint8_t* record, size_t size) {
+    std::wstring message;
+    size_t offset = sizeof(LogRecordHeader);
+    while (offset < size) {
+        uint8_t tag = record[offset++];
+        if ((tag == LOG_ARG_INT || tag == LOG_ARG_UINT) && offset + 8 <= size) {
+            uint64_t value;
+            memcpy(&value, record + offset, sizeof(value));
+            message += tag == LOG_ARG_INT ? std::to_wstring(static_cast<int64_t>(value)) : std::to_wstring(value);
+            offset += 8;
+        }
+        else if (tag == LOG_ARG_TEXT && offset + 2 <= size) {
+            uint16_t length;
+            memcpy(&length, record + offset, sizeof(length));
+            offset += 2;
+            if (offset + length * sizeof(wchar_t) > size) {
+                break;
+            }
 
-            windowList->push_back({ hwnd, title, processId });
+            size_t start = message.size();
+            message.resize(start + length);
+            memcpy(&message[start], record + offset, length * sizeof(wchar_t));
+            offset += length * sizeof(wchar_t);
         }
-        return TRUE;
-        }, (LPARAM)&childWindows);
+        else {
+            break;
+        }
+    }
+    return message;
 }
 
-// Hook callbacks
-LRESULT CALLBACK MessageProc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode >= 0) {
-        MSG* msg = (MSG*)lParam;
-
-        // Check if this is a window size-related message for a window we're tracking
-        std::lock_guard<std::mutex> lock(g_stateMutex);
-        auto it = g_windowSizes.find(msg->hwnd);
+const wchar_t* LogLevelName(uint8_t level) {
+    static const wchar_t* const NAMES[] = { L"DEBUG", L"INFO", L"WARN", L"ERROR" };
+    return level < std::size(NAMES) ? NAMES[level] : L"?";
+}
 
-        if (it != g_windowSizes.end() &&
-            (msg->message == WM_SIZE || msg->message == WM_SIZING ||
-                msg->message == WM_WINDOWPOSCHANGED || msg->message == WM_WINDOWPOSCHANGING ||
-                msg->message == WM_GETMINMAXINFO || msg->message == WM_NCCALCSIZE)) {
+class Logger {
+public:
+    ~Logger() { Stop(); }
 
-            auto& sizeData = it->second;
+    // Empty path: render to the console stream
+    bool Start(const std::wstring& path, std::wostream& console = std::wcout) {
+        if (m_thread.joinable()) {
+            return true;
+        }
 
-            // Handle specific messages
-            switch (msg->message) {
-            case WM_GETMINMAXINFO: {
-                MINMAXINFO* info = reinterpret_cast<MINMAXINFO*>(msg->lParam);
-                info->ptMinTrackSize.x = sizeData.width;
-                info->ptMinTrackSize.y = sizeData.height;
-                info->ptMaxTrackSize.x = sizeData.width;
-                info->ptMaxTrackSize.y = sizeData.height;
-                return 0;
+        m_console = &console;
+        if (!path.empty()) {
+            m_file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (m_file == INVALID_HANDLE_VALUE) {
+                m_file = NULL;
+                return false;
             }
 
-            case WM_NCCALCSIZE:
-                if (msg->wParam) {
-                    NCCALCSIZE_PARAMS* params = reinterpret_cast<NCCALCSIZE_PARAMS*>(msg->lParam);
-                    RECT& clientRect = params->rgrc[0];
+            LogFileHeader header = { LOG_FILE_MAGIC, LOG_FILE_VERSION, EnforcementStats::TicksPerSecond(), EnforcementStats::Now() };
+            DWORD written = 0;
+            WriteFile(m_file, &header, sizeof(header), &written, NULL);
+        }
 
-                    if ((clientRect.right - clientRect.left) != sizeData.width ||
-                        (clientRect.bottom - clientRect.top) != sizeData.height) {
+        m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_thread = std::thread(&Logger::Run, this);
+        return true;
+    }
 
-                        clientRect.right = clientRect.left + sizeData.width;
-                        clientRect.bottom = clientRect.top + sizeData.height;
-                    }
-                }
-                break;
+    // Writes out whatever is still queued
+    void Stop() {
+        if (m_thread.joinable()) {
+            SetEvent(m_stopEvent);
+            m_thread.join();
+            CloseHandle(m_stopEvent);
+            m_stopEvent = NULL;
+        }
+        if (m_file) {
+            CloseHandle(m_file);
+            m_file = NULL;
+        }
+    }
 
-            case WM_WINDOWPOSCHANGING: {
-                WINDOWPOS* pos = reinterpret_cast<WINDOWPOS*>(msg->lParam);
-                if (!(pos->flags & SWP_NOSIZE)) {
-                    pos->cx = sizeData.width;
-                    pos->cy = sizeData.height;
-                }
-                break;
-            }
+    template <typename... Args>
+    void Write(LogLevel level, const Args&... args) {
+        size_t position;
+        uint8_t* record = m_ring.Reserve(position);
+        if (!record) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
 
-            default: {
-                // Other size-related messages
-                RECT rect;
-                if (GetWindowRect(msg->hwnd, &rect)) {
-                    int currentWidth = rect.right - rect.left;
-                    int currentHeight = rect.bottom - rect.top;
+        size_t size = sizeof(LogRecordHeader);
+        (EncodeLogArgument(record, size, args), ...);
 
-                    if (currentWidth != sizeData.width || currentHeight != sizeData.height) {
-                        SetWindowPos(msg->hwnd, NULL, 0, 0, sizeData.width, sizeData.height,
-                            SWP_NOMOVE | SWP_NOZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
-                    }
-                }
-                break;
+        LogRecordHeader header = { static_cast<uint16_t>(size), level, 0, GetCurrentThreadId(), EnforcementStats::Now() };
+        memcpy(record, &header, sizeof(header));
+        m_ring.Commit(position);
+    }
+
+private:
+    // Polls instead of being woken, so writers never make a system call
+    void Run() {
+        while (WaitForSingleObject(m_stopEvent, LOG_DRAIN_INTERVAL_MS) == WAIT_TIMEOUT) {
+            Drain();
+        }
+        Drain();
+    }
+
+    void Drain() {
+        uint8_t record[LOG_RECORD_MAX];
+        std::vector<uint8_t> batch;
+        bool printed = false;
+
+        while (m_ring.Pop(record)) {
+            LogRecordHeader header;
+            memcpy(&header, record, sizeof(header));
+
+            if (m_file) {
+                batch.insert(batch.end(), record, record + header.size);
             }
+            else {
+                *m_console << L"[" << LogLevelName(header.level) << L"] " << DecodeLogMessage(record, header.size) << L"\n";
+                printed = true;
             }
         }
+
+        if (!batch.empty()) {
+            DWORD written = 0;
+            WriteFile(m_file, batch.data(), static_cast<DWORD>(batch.size()), &written, NULL);
+        }
+        if (printed) {
+            m_console->flush();
+        }
+
+        uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            Write(LOG_WARNING, L"Журнал переполнен, потеряно записей: ", dropped);
+        }
     }
 
-    return CallNextHookEx(g_messageHook, nCode, wParam, lParam);
+    LogRing m_ring;
+    std::atomic<uint64_t> m_dropped{ 0 };
+    std::wostream* m_console = &std::wcout;
+    HANDLE m_file = NULL;
+    HANDLE m_stopEvent = NULL;
+    std::thread m_thread;
+};
+
+Logger g_log;
+
+template <LogLevel Level, typename... Args>
+inline void Log(const Args&... args) {
+    if constexpr (Level >= FRW_LOG_LEVEL) {
+        g_log.Write(Level, args...);
+    }
 }
 
-LRESULT CALLBACK CBTProc(int nCode, WPARAM wParam, LPARAM lParam) {
-    if (nCode == HCBT_CREATEWND || nCode == HCBT_ACTIVATE) {
-        HWND hwnd = (HWND)wParam;
+// "--decode-log": prints a binary log file as text
+bool DecodeLogFile(const std::wstring& path) {
+    FILE* file = _wfopen(path.c_str(), L"rb");
+    if (!file) {
+        std::wcerr << L"Не удалось открыть журнал: " << path << std::endl;
+        return false;
+    }
 
-        std::lock_guard<std::mutex> lock(g_stateMutex);
-        auto it = g_windowSizes.find(hwnd);
+    LogFileHeader fileHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || fileHeader.magic != LOG_FILE_MAGIC ||
+        fileHeader.version != LOG_FILE_VERSION || fileHeader.ticksPerSecond <= 0) {
+        std::wcerr << L"Файл не является журналом FRW: " << path << std::endl;
+        fclose(file);
+        return false;
+    }
 
-        if (it != g_windowSizes.end()) {
-            auto& sizeData = it->second;
-            SetWindowPos(hwnd, NULL, 0, 0, sizeData.width, sizeData.height,
-                SWP_NOMOVE | SWP_NOZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
+    uint8_t record[LOG_RECORD_MAX];
+    LogRecordHeader header;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        // A record cut short by a crash ends the log
+        if (header.size < sizeof(header) || header.size > LOG_RECORD_MAX) {
+            break;
         }
+        size_t payload = header.size - sizeof(header);
+        if (payload && fread(record + sizeof(header), payload, 1, file) != 1) {
+            break;
+        }
+        memcpy(record, &header, sizeof(header));
+
+        double seconds = static_cast<double>(static_cast<int64_t>(header.ticks - fileHeader.startTicks)) / fileHeader.ticksPerSecond;
+        wchar_t prefix[64];
+        swprintf(prefix, std::size(prefix), L"%12.6f %6lu %-5ls ", seconds, static_cast<unsigned long>(header.threadId), LogLevelName(header.level));
+        std::wcout << prefix << DecodeLogMessage(record, header.size) << L"\n";
     }
 
-    return CallNextHookEx(g_cbtHook, nCode, wParam, lParam);
+    std::wcout.flush();
+    fclose(file);
+    return true;
 }
 
-// Custom window procedure
-LRESULT CALLBACK CustomWindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
-    std::lock_guard<std::mutex> lock(g_stateMutex);
-    auto origProcIt = g_originalWndProcs.find(hwnd);
+constexpr size_t TRACE_FLUSH_BYTES = 64 * 1024;
+
+// Records are encoded under one lock so that timestamps, taken inside it,
+// only ever grow. Everything is a no-op unless a trace was started.
+class TraceRecorder {
+public:
+    ~TraceRecorder() { Stop(); }
+
+    bool Enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    bool Start(const std::wstring& path) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_file) {
+            return true;
+        }
+
+        m_file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            m_file = NULL;
+            return false;
+        }
+
+        uint32_t header[2] = { TRACE_FILE_MAGIC, TRACE_FILE_VERSION };
+        DWORD written = 0;
+        WriteFile(m_file, header, sizeof(header), &written, NULL);
 
-    if (origProcIt == g_originalWndProcs.end()) {
-        return DefWindowProc(hwnd, msg, wParam, lParam);
+        m_last = std::chrono::steady_clock::now();
+        m_enabled.store(true, std::memory_order_relaxed);
+        return true;
     }
 
-    WNDPROC originalProc = origProcIt->second;
+    void Stop() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_enabled.store(false, std::memory_order_relaxed);
+        if (m_file) {
+            Flush();
+            CloseHandle(m_file);
+            m_file = NULL;
+        }
+    }
 
-    switch (msg) {
-    case WM_NCCALCSIZE: {
-        if (wParam) {
-            NCCALCSIZE_PARAMS* params = reinterpret_cast<NCCALCSIZE_PARAMS*>(lParam);
-            RECT currentClient = params->rgrc[0];
+    void Track(HWND hwnd, int width, int height) { Append(TRACE_TRACK, hwnd, width, height); }
+    void Message(HWND hwnd, UINT message) { Append(TRACE_MESSAGE, hwnd, message); }
+    void Check(HWND hwnd, int width, int height) { Append(TRACE_CHECK, hwnd, width, height); }
+    void Correction(HWND hwnd, int width, int height) { Append(TRACE_CORRECTION, hwnd, width, height); }
+    void Deferred(HWND hwnd) { Append(TRACE_DEFERRED, hwnd); }
+    void Style(HWND hwnd, LONG style) { Append(TRACE_STYLE, hwnd, style); }
+    void Release(HWND hwnd) { Append(TRACE_RELEASE, hwnd); }
+    void Gone(HWND hwnd) { Append(TRACE_GONE, hwnd); }
 
-            LRESULT result = CallWindowProc(originalProc, hwnd, msg, wParam, lParam);
+private:
+    template <typename... Values>
+    void Append(TraceEvent event, HWND hwnd, Values... values) {
+        if (!Enabled()) {
+            return;
+        }
 
-            // Adjust client area to account for our custom title bar
-            params->rgrc[0].top = currentClient.top + CUSTOM_TITLE_HEIGHT;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_file) {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        m_buffer.push_back(event);
+        PutVarint(m_buffer, std::chrono::duration_cast<std::chrono::microseconds>(now - m_last).count());
+        PutVarint(m_buffer, reinterpret_cast<uintptr_t>(hwnd));
+        (PutVarint(m_buffer, ZigZag(static_cast<int64_t>(values))), ...);
+        m_last = now;
+
+        if (m_buffer.size() >= TRACE_FLUSH_BYTES) {
+            Flush();
+        }
+    }
+
+    void Flush() {
+        if (!m_buffer.empty()) {
+            DWORD written = 0;
+            WriteFile(m_file, m_buffer.data(), static_cast<DWORD>(m_buffer.size()), &written, NULL);
+            m_buffer.clear();
+        }
+    }
+
+    std::atomic<bool> m_enabled{ false };
+    std::mutex m_mutex;
+    HANDLE m_file = NULL;
+    std::vector<uint8_t> m_buffer;
+    std::chrono::steady_clock::time_point m_last;
+};
+
+TraceRecorder g_trace;
+
+struct ProcessInfo {
+    DWORD processId;
+    DWORD parentProcessId;
+    ULONGLONG creationTime;  // FILETIME ticks, 0 if the process could not be opened
+    std::wstring name;
+};
+
+// Process metadata filled in bulk from one Toolhelp32 snapshot. Entries are
+// keyed by (PID, creation time). A refresh opens only PIDs that are new or
+// show up with a different parent or image; a lookup compares the cached
+// creation time with the live process, so a PID reused since the snapshot
+// is a miss rather than the name of the process that used to own it.
+class ProcessCache {
+public:
+    // Rebuilds the cache from a single process snapshot. Processes are
+    // opened without the lock held, so lookups never wait on OpenProcess.
+    bool Refresh() {
+        std::lock_guard<std::mutex> refreshing(m_refreshMutex);
+        return TakeSnapshot();
+    }
+
+    bool Find(DWORD processId, ProcessInfo& info) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto known = Lookup(processId);
+            if (!known) {
+                return false;
+            }
+            info = *known;
+        }
+
+        // A process that could not be opened has no creation time to check
+        if (info.creationTime == 0 || QueryCreationTime(processId) == info.creationTime) {
+            return true;
+        }
+
+        // The PID belongs to another process now; the next refresh opens it
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto current = m_current.find(processId);
+        if (current != m_current.end() && current->second == info.creationTime) {
+            m_current.erase(current);
+        }
+        return false;
+    }
+
+    std::vector<ProcessInfo> All() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<ProcessInfo> result;
+        result.reserve(m_processes.size());
+        for (const auto& pair : m_processes) {
+            result.push_back(pair.second);
+        }
+        return result;
+    }
+
+    std::wstring GetName(DWORD processId) {
+        ProcessInfo info;
+        if (Find(processId, info)) {
+            return info.name;
+        }
+
+        // Probably started after the last snapshot
+        if (RefreshIfStale() && Find(processId, info)) {
+            return info.name;
+        }
+
+        return QueryImageName(processId);
+    }
+
+    static ULONGLONG QueryCreationTime(DWORD processId) {
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+        if (!hProcess) {
+            return 0;
+        }
+
+        FILETIME creation, exit, kernel, user;
+        ULONGLONG result = 0;
+        if (GetProcessTimes(hProcess, &creation, &exit, &kernel, &user)) {
+            result = (static_cast<ULONGLONG>(creation.dwHighDateTime) << 32) | creation.dwLowDateTime;
+        }
+        CloseHandle(hProcess);
+        return result;
+    }
+
+    // Fallback for processes missing from the snapshot, and for callers that
+    // cannot wait for one. Limited query rights are granted even for most
+    // protected processes.
+    static std::wstring QueryImageName(DWORD processId) {
+        std::wstring name = L"Неизвестно";
+        HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+
+        if (hProcess) {
+            wchar_t path[MAX_PATH];
+            DWORD length = MAX_PATH;
+
+            if (QueryFullProcessImageNameW(hProcess, 0, path, &length)) {
+                std::wstring fullPath(path, length);
+                name = fullPath.substr(fullPath.find_last_of(L"\\/") + 1);
+            }
+            CloseHandle(hProcess);
+        }
+
+        return name;
+    }
+
+private:
+    struct ProcessKey {
+        DWORD processId;
+        ULONGLONG creationTime;
+
+        bool operator<(const ProcessKey& other) const {
+            return processId != other.processId ? processId < other.processId : creationTime < other.creationTime;
+        }
+    };
+
+    const ProcessInfo* Lookup(DWORD processId) const {
+        auto current = m_current.find(processId);
+        if (current == m_current.end()) {
+            return nullptr;
+        }
+        auto it = m_processes.find({ processId, current->second });
+        return it != m_processes.end() ? &it->second : nullptr;
+    }
+
+    std::chrono::steady_clock::time_point RefreshedAt() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_refreshedAt;
+    }
+
+    // Waits for a refresh that is already running, so lookups from many
+    // threads share one snapshot; otherwise takes a new one, but not more
+    // often than PROCESS_CACHE_REFRESH_MS
+    bool RefreshIfStale() {
+        auto before = RefreshedAt();
+        std::lock_guard<std::mutex> refreshing(m_refreshMutex);
+        if (RefreshedAt() != before) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() - before <= std::chrono::milliseconds(PROCESS_CACHE_REFRESH_MS)) {
+            return false;
+        }
+        return TakeSnapshot();
+    }
+
+    // Called with m_refreshMutex held
+    bool TakeSnapshot() {
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+        if (snapshot == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        std::vector<ProcessInfo> infos;
+        PROCESSENTRY32W entry = { sizeof(entry) };
+        for (BOOL ok = Process32FirstW(snapshot, &entry); ok; ok = Process32NextW(snapshot, &entry)) {
+            infos.push_back({ entry.th32ProcessID, entry.th32ParentProcessID, 0, entry.szExeFile });
+        }
+        CloseHandle(snapshot);
+
+        // Only processes missing from the previous snapshot, or in it with
+        // other metadata, are opened
+        std::vector<size_t> unknown;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (size_t i = 0; i < infos.size(); ++i) {
+                auto known = Lookup(infos[i].processId);
+                if (known && known->parentProcessId == infos[i].parentProcessId && known->name == infos[i].name) {
+                    infos[i].creationTime = known->creationTime;
+                }
+                else {
+                    unknown.push_back(i);
+                }
+            }
+        }
+        for (size_t i : unknown) {
+            infos[i].creationTime = QueryCreationTime(infos[i].processId);
+        }
+
+        std::map<ProcessKey, ProcessInfo> processes;
+        std::unordered_map<DWORD, ULONGLONG> current;
+        for (auto& info : infos) {
+            current[info.processId] = info.creationTime;
+            processes[{ info.processId, info.creationTime }] = std::move(info);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_processes.swap(processes);
+        m_current.swap(current);
+        m_refreshedAt = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    std::mutex m_mutex;
+    std::mutex m_refreshMutex;  // One snapshot at a time
+    std::map<ProcessKey, ProcessInfo> m_processes;
+    std::unordered_map<DWORD, ULONGLONG> m_current;  // PID -> creation time in the latest snapshot
+    std::chrono::steady_clock::time_point m_refreshedAt;
+};
+
+ProcessCache g_processCache;
+
+constexpr uint32_t JOURNAL_MAGIC = 0x4A575246;  // "FRWJ"
+constexpr uint32_t JOURNAL_LAYOUT_VERSION = 1;
+constexpr uint32_t JOURNAL_MAX_WINDOWS = 1024;  // As many as the ownership table; older files grow with zeros
+constexpr uint32_t JOURNAL_NO_RULE = UINT32_MAX;
+
+// One enforced window. hwnd is written last and cleared first, so a record
+// with a non-zero hwnd is always complete.
+struct JournalRecord {
+    uint64_t hwnd;
+    uint64_t processCreationTime;  // Tells a live owner from a reused PID
+    uint64_t originalProc;
+    DWORD processId;
+    int32_t width;
+    int32_t height;
+    LONG originalStyle;
+    LONG originalExStyle;
+    LONG enforcedStyle;
+    uint32_t ruleId;  // Index in the rules file, JOURNAL_NO_RULE if none
+    uint32_t reserved;
+    wchar_t className[64];
+};
+
+struct JournalFile {
+    uint32_t magic;
+    uint32_t layoutVersion;
+    DWORD ownerProcessId;
+    uint32_t reserved;
+    JournalRecord records[JOURNAL_MAX_WINDOWS];
+};
+
+// Enforced windows kept in a memory-mapped file, so an instance that was
+// killed leaves behind what it changed. The pages belong to the system
+// cache and outlive the process; the next instance reads them back
+// instead of enumerating windows. The file is opened exclusively, so only
+// one instance owns it at a time.
+class EnforcementJournal {
+public:
+    ~EnforcementJournal() { Close(); }
+
+    static std::wstring FilePath() {
+        wchar_t directory[MAX_PATH] = { 0 };
+        GetTempPathW(MAX_PATH, directory);
+        return std::wstring(directory) + L"FRW.journal";
+    }
+
+    bool Open() {
+        if (m_journal) {
+            return true;
+        }
+
+        m_file = CreateFileW(FilePath().c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            m_file = NULL;
+            return false;
+        }
+
+        // The mapping grows the file to full size; new bytes read as zero
+        m_mapping = CreateFileMappingW(m_file, NULL, PAGE_READWRITE, 0, sizeof(JournalFile), NULL);
+        m_journal = m_mapping ? static_cast<JournalFile*>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(JournalFile))) : nullptr;
+        if (!m_journal) {
+            Close();
+            return false;
+        }
+
+        if (m_journal->magic != JOURNAL_MAGIC || m_journal->layoutVersion != JOURNAL_LAYOUT_VERSION) {
+            memset(m_journal, 0, sizeof(JournalFile));
+            m_journal->layoutVersion = JOURNAL_LAYOUT_VERSION;
+            m_journal->magic = JOURNAL_MAGIC;
+        }
+        m_journal->ownerProcessId = GetCurrentProcessId();
+        return true;
+    }
+
+    void Close() {
+        if (m_journal) {
+            FlushViewOfFile(m_journal, 0);
+            UnmapViewOfFile(m_journal);
+            m_journal = nullptr;
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+        if (m_file) {
+            CloseHandle(m_file);
+            m_file = NULL;
+        }
+    }
+
+    // Records left by the previous owner
+    std::vector<JournalRecord> Records() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<JournalRecord> records;
+        if (m_journal) {
+            for (const auto& record : m_journal->records) {
+                if (record.hwnd) {
+                    records.push_back(record);
+                }
+            }
+        }
+        return records;
+    }
+
+    void Write(HWND hwnd, const WindowState& state, uint32_t ruleId) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        JournalRecord* record = Slot(hwnd);
+        if (!record) {
+            if (m_journal) {
+                Log<LOG_WARNING>(L"Журнал окон заполнен, окно не будет восстановлено после сбоя: ",
+                    reinterpret_cast<uintptr_t>(hwnd));
+            }
+            return;
+        }
+
+        record->hwnd = 0;
+        record->processId = 0;
+        GetWindowThreadProcessId(hwnd, &record->processId);
+        record->processCreationTime = ProcessCache::QueryCreationTime(record->processId);
+        record->originalProc = reinterpret_cast<uint64_t>(state.originalProc);
+        record->width = state.size.width;
+        record->height = state.size.height;
+        record->originalStyle = state.size.originalStyle;
+        record->originalExStyle = state.size.originalExStyle;
+        record->enforcedStyle = state.size.enforcedStyle;
+        record->ruleId = ruleId;
+        GetClassNameW(hwnd, record->className, static_cast<int>(std::size(record->className)));
+        record->hwnd = reinterpret_cast<uint64_t>(hwnd);
+        Flush(record);
+    }
+
+    void SetSize(HWND hwnd, int width, int height) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (JournalRecord* record = Find(hwnd)) {
+            record->width = width;
+            record->height = height;
+            Flush(record);
+        }
+    }
+
+    void Remove(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (JournalRecord* record = Find(hwnd)) {
+            record->hwnd = 0;
+            Flush(record);
+        }
+    }
+
+    // Called once every window has been restored
+    void Clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_journal) {
+            for (auto& record : m_journal->records) {
+                record.hwnd = 0;
+            }
+            FlushViewOfFile(m_journal, 0);
+        }
+    }
+
+    // True if the record still describes the same live window
+    static bool IsCurrent(const JournalRecord& record) {
+        HWND hwnd = reinterpret_cast<HWND>(record.hwnd);
+        DWORD processId = 0;
+        if (!IsWindow(hwnd) || !GetWindowThreadProcessId(hwnd, &processId) || processId != record.processId) {
+            return false;
+        }
+
+        wchar_t className[64] = { 0 };
+        GetClassNameW(hwnd, className, static_cast<int>(std::size(className)));
+        return wcscmp(className, record.className) == 0 &&
+            ProcessCache::QueryCreationTime(processId) == record.processCreationTime;
+    }
+
+private:
+    JournalRecord* Find(HWND hwnd) {
+        if (m_journal) {
+            for (auto& record : m_journal->records) {
+                if (record.hwnd == reinterpret_cast<uint64_t>(hwnd)) {
+                    return &record;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    JournalRecord* Slot(HWND hwnd) {
+        if (JournalRecord* record = Find(hwnd)) {
+            return record;
+        }
+        return Find(NULL);
+    }
+
+    // Pushes the record towards disk, so it also survives a system crash
+    void Flush(JournalRecord* record) {
+        FlushViewOfFile(record, sizeof(JournalRecord));
+    }
+
+    std::mutex m_mutex;
+    HANDLE m_file = NULL;
+    HANDLE m_mapping = NULL;
+    JournalFile* m_journal = nullptr;
+};
+
+EnforcementJournal g_journal;
+
+// What to do with a window another running instance already enforces
+enum class ConflictPolicy {
+    Defer,     // Leave it to the owner
+    TakeOver,  // Ask the owner to release it, then enforce it here
+    Chain      // Hand the requested size to the owner
+};
+
+ConflictPolicy g_conflictPolicy = ConflictPolicy::Defer;
+
+bool ParseConflictPolicy(const std::wstring& text, ConflictPolicy& policy) {
+    if (text == L"defer") {
+        policy = ConflictPolicy::Defer;
+        return true;
+    }
+    if (text == L"takeover") {
+        policy = ConflictPolicy::TakeOver;
+        return true;
+    }
+    if (text == L"chain") {
+        policy = ConflictPolicy::Chain;
+        return true;
+    }
+    return false;
+}
+
+// Defined below; the ownership heartbeat acts on requests from other instances
+bool ReleaseWindow(HWND hwnd);
+bool ResizeTrackedWindow(HWND hwnd, int width, int height);
+
+// Enforced windows of every running instance, in a named shared-memory
+// table, so that two instances never enforce (and subclass) the same
+// window. An entry is a lease the owner renews on every heartbeat; one
+// that is not renewed, or whose owner has exited, is free to claim. Other
+// instances talk to the owner through its entries: a takeover request makes
+// it release the window, a size request makes it retarget the window.
+constexpr uint32_t OWNERSHIP_MAGIC = 0x4F575246;  // "FRWO"
+constexpr uint32_t OWNERSHIP_LAYOUT_VERSION = 1;
+constexpr uint32_t OWNERSHIP_SLOTS = 1024;
+static_assert(JOURNAL_MAX_WINDOWS >= OWNERSHIP_SLOTS, "Every window an instance can own must fit in its journal");
+constexpr ULONGLONG OWNERSHIP_LEASE_MS = 2000;
+constexpr DWORD OWNERSHIP_HEARTBEAT_MS = 250;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Ownership entries must be lock-free to live in shared memory");
+
+struct OwnershipEntry {
+    std::atomic<uint64_t> hwnd;           // 0 for a free entry
+    std::atomic<uint32_t> ownerProcessId;
+    std::atomic<uint32_t> takeoverBy;     // Process asking the owner to let go
+    std::atomic<uint64_t> leaseExpires;   // GetTickCount64
+    std::atomic<uint64_t> size;           // width << 32 | height, as enforced
+    std::atomic<uint64_t> requestedSize;  // Same encoding, 0 if none
+};
+
+// Layout of the shared region; a new field means a new OWNERSHIP_LAYOUT_VERSION
+struct OwnershipRegion {
+    uint32_t magic;
+    uint32_t layoutVersion;
+    OwnershipEntry entries[OWNERSHIP_SLOTS];
+};
+
+class OwnershipTable {
+public:
+    ~OwnershipTable() { Close(); }
+
+    bool Open() {
+        if (m_region) {
+            return true;
+        }
+
+        // Claims and releases are serialized across instances; heartbeats
+        // only touch the renewing instance's own entries
+        m_lock = CreateMutexW(NULL, FALSE, L"Local\\FRW.Ownership.Lock");
+        m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(OwnershipRegion), L"Local\\FRW.Ownership");
+        m_region = m_lock && m_mapping ?
+            static_cast<OwnershipRegion*>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(OwnershipRegion))) : nullptr;
+        if (!m_region) {
+            Close();
+            return false;
+        }
+
+        {
+            CrossProcessLock lock(m_lock);
+            if (m_region->magic != OWNERSHIP_MAGIC || m_region->layoutVersion != OWNERSHIP_LAYOUT_VERSION) {
+                for (auto& entry : m_region->entries) {
+                    entry.hwnd.store(0, std::memory_order_relaxed);
+                    entry.takeoverBy.store(0, std::memory_order_relaxed);
+                    entry.requestedSize.store(0, std::memory_order_relaxed);
+                }
+                m_region->layoutVersion = OWNERSHIP_LAYOUT_VERSION;
+                m_region->magic = OWNERSHIP_MAGIC;
+            }
+        }
+
+        m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_thread = std::thread(&OwnershipTable::Run, this);
+        return true;
+    }
+
+    // Stops renewing leases and answering other instances; entries stay
+    // until released or closed
+    void Stop() {
+        if (m_thread.joinable()) {
+            SetEvent(m_stopEvent);
+            m_thread.join();
+        }
+        if (m_stopEvent) {
+            CloseHandle(m_stopEvent);
+            m_stopEvent = NULL;
+        }
+    }
+
+    // Entries still held are dropped; windows should be released first
+    void Close() {
+        Stop();
+        if (m_region) {
+            {
+                CrossProcessLock lock(m_lock);
+                for (auto& entry : m_region->entries) {
+                    if (entry.ownerProcessId.load(std::memory_order_relaxed) == GetCurrentProcessId()) {
+                        entry.hwnd.store(0, std::memory_order_release);
+                    }
+                }
+            }
+            UnmapViewOfFile(m_region);
+            m_region = nullptr;
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+            m_mapping = NULL;
+        }
+        if (m_lock) {
+            CloseHandle(m_lock);
+            m_lock = NULL;
+        }
+    }
+
+    // Returns 0 once the window is ours (claiming an own window only updates
+    // its size), otherwise the process that owns it. Without the table
+    // every window counts as ours.
+    DWORD Claim(HWND hwnd, int width, int height) {
+        if (!m_region) {
+            return 0;
+        }
+
+        CrossProcessLock lock(m_lock);
+        OwnershipEntry* entry = Find(hwnd);
+        if (entry && IsHeld(*entry)) {
+            DWORD owner = entry->ownerProcessId.load(std::memory_order_relaxed);
+            if (owner != GetCurrentProcessId()) {
+                return owner;
+            }
+
+            // Pending requests from other instances stay for the heartbeat
+            entry->size.store(PackSize(width, height), std::memory_order_relaxed);
+            return 0;
+        }
+        else if (!entry) {
+            entry = FindFree();
+            if (!entry) {
+                // A full table must not stop enforcement; the window just is not shared
+                return 0;
+            }
+        }
+
+        entry->ownerProcessId.store(GetCurrentProcessId(), std::memory_order_relaxed);
+        entry->takeoverBy.store(0, std::memory_order_relaxed);
+        entry->requestedSize.store(0, std::memory_order_relaxed);
+        entry->size.store(PackSize(width, height), std::memory_order_relaxed);
+        entry->leaseExpires.store(GetTickCount64() + OWNERSHIP_LEASE_MS, std::memory_order_relaxed);
+        entry->hwnd.store(reinterpret_cast<uint64_t>(hwnd), std::memory_order_release);
+        return 0;
+    }
+
+    // Another live process that holds the window, or 0
+    DWORD OtherOwner(HWND hwnd) {
+        if (!m_region) {
+            return 0;
+        }
+
+        CrossProcessLock lock(m_lock);
+        OwnershipEntry* entry = Find(hwnd);
+        if (!entry || !IsHeld(*entry)) {
+            return 0;
+        }
+        DWORD owner = entry->ownerProcessId.load(std::memory_order_relaxed);
+        return owner != GetCurrentProcessId() ? owner : 0;
+    }
+
+    void Release(HWND hwnd) {
+        if (!m_region) {
+            return;
+        }
+
+        CrossProcessLock lock(m_lock);
+        OwnershipEntry* entry = Find(hwnd);
+        if (entry && entry->ownerProcessId.load(std::memory_order_relaxed) == GetCurrentProcessId()) {
+            entry->hwnd.store(0, std::memory_order_release);
+        }
+    }
+
+    // Asks the owner to release the window; claim it once Claim returns 0
+    // or leave that to AwaitTakeover
+    bool RequestTakeover(HWND hwnd) {
+        if (!m_region) {
+            return false;
+        }
+
+        CrossProcessLock lock(m_lock);
+        OwnershipEntry* entry = Find(hwnd);
+        if (!entry) {
+            return false;
+        }
+        entry->takeoverBy.store(GetCurrentProcessId(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // Claims the window on a later heartbeat, once its owner has let go of
+    // it or lost the lease, and then calls claimed there. Callers do not
+    // wait for the owner.
+    void AwaitTakeover(HWND hwnd, int width, int height, std::function<void()> claimed) {
+        std::lock_guard<std::mutex> lock(m_takeoverMutex);
+        m_takeovers.push_back({ hwnd, width, height, GetTickCount64() + OWNERSHIP_LEASE_MS + OWNERSHIP_HEARTBEAT_MS,
+            std::move(claimed) });
+    }
+
+    // Asks the owner to enforce another size
+    bool RequestResize(HWND hwnd, int width, int height) {
+        if (!m_region) {
+            return false;
+        }
+
+        CrossProcessLock lock(m_lock);
+        OwnershipEntry* entry = Find(hwnd);
+        if (!entry || !IsHeld(*entry)) {
+            return false;
+        }
+        entry->requestedSize.store(PackSize(width, height), std::memory_order_relaxed);
+        return true;
+    }
+
+private:
+    struct PendingTakeover {
+        HWND hwnd;
+        int width;
+        int height;
+        ULONGLONG deadline;
+        std::function<void()> claimed;
+    };
+
+    // Named mutexes are abandoned, not leaked, when an owner dies
+    class CrossProcessLock {
+    public:
+        explicit CrossProcessLock(HANDLE mutex) : m_mutex(mutex) {
+            DWORD result = WaitForSingleObject(m_mutex, INFINITE);
+            m_owned = result == WAIT_OBJECT_0 || result == WAIT_ABANDONED;
+        }
+        ~CrossProcessLock() {
+            if (m_owned) {
+                ReleaseMutex(m_mutex);
+            }
+        }
+
+        CrossProcessLock(const CrossProcessLock&) = delete;
+        CrossProcessLock& operator=(const CrossProcessLock&) = delete;
+
+    private:
+        HANDLE m_mutex;
+        bool m_owned;
+    };
+
+    static uint64_t PackSize(int width, int height) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(width)) << 32) | static_cast<uint32_t>(height);
+    }
+
+    // An entry counts while its lease runs and its owner is alive
+    static bool IsHeld(const OwnershipEntry& entry) {
+        if (!entry.hwnd.load(std::memory_order_acquire) || GetTickCount64() > entry.leaseExpires.load(std::memory_order_relaxed)) {
+            return false;
+        }
+
+        DWORD owner = entry.ownerProcessId.load(std::memory_order_relaxed);
+        if (owner == GetCurrentProcessId()) {
+            return true;
+        }
+        HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, owner);
+        if (!process) {
+            return false;
+        }
+        bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+        CloseHandle(process);
+        return alive;
+    }
+
+    // Under the lock
+    OwnershipEntry* Find(HWND hwnd) {
+        for (auto& entry : m_region->entries) {
+            if (entry.hwnd.load(std::memory_order_relaxed) == reinterpret_cast<uint64_t>(hwnd)) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Under the lock; stale entries are reused
+    OwnershipEntry* FindFree() {
+        for (auto& entry : m_region->entries) {
+            if (!IsHeld(entry)) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Renews our leases and carries out requests from other instances
+    void Run() {
+        while (WaitForSingleObject(m_stopEvent, OWNERSHIP_HEARTBEAT_MS) == WAIT_TIMEOUT) {
+            std::vector<HWND> takeovers;
+            std::vector<std::pair<HWND, uint64_t>> resizes;
+            ULONGLONG expires = GetTickCount64() + OWNERSHIP_LEASE_MS;
+
+            {
+                CrossProcessLock lock(m_lock);
+                for (auto& entry : m_region->entries) {
+                    uint64_t hwnd = entry.hwnd.load(std::memory_order_acquire);
+                    if (!hwnd || entry.ownerProcessId.load(std::memory_order_relaxed) != GetCurrentProcessId()) {
+                        continue;
+                    }
+
+                    entry.leaseExpires.store(expires, std::memory_order_relaxed);
+                    if (entry.takeoverBy.load(std::memory_order_relaxed)) {
+                        takeovers.push_back(reinterpret_cast<HWND>(hwnd));
+                    }
+                    else if (uint64_t size = entry.requestedSize.exchange(0, std::memory_order_relaxed)) {
+                        resizes.emplace_back(reinterpret_cast<HWND>(hwnd), size);
+                    }
+                }
+            }
+
+            // Releasing restores the style and removes the subclass here,
+            // before the other instance installs its own
+            for (HWND hwnd : takeovers) {
+                Log<LOG_INFO>(L"Окно передано другому экземпляру программы: ", reinterpret_cast<uintptr_t>(hwnd));
+                if (!ReleaseWindow(hwnd)) {
+                    Release(hwnd);
+                }
+            }
+            for (const auto& resize : resizes) {
+                ResizeTrackedWindow(resize.first, static_cast<int>(resize.second >> 32), static_cast<int>(resize.second & 0xFFFFFFFF));
+            }
+
+            FinishTakeovers();
+        }
+    }
+
+    // Claims the windows other instances have let go of since the last
+    // heartbeat; the callbacks run without m_takeoverMutex, they enforce
+    void FinishTakeovers() {
+        std::vector<PendingTakeover> claimed;
+        {
+            std::lock_guard<std::mutex> lock(m_takeoverMutex);
+            ULONGLONG now = GetTickCount64();
+            m_takeovers.erase(std::remove_if(m_takeovers.begin(), m_takeovers.end(), [&](PendingTakeover& takeover) {
+                if (!IsWindow(takeover.hwnd)) {
+                    return true;
+                }
+                if (!Claim(takeover.hwnd, takeover.width, takeover.height)) {
+                    claimed.push_back(std::move(takeover));
+                    return true;
+                }
+                if (now < takeover.deadline) {
+                    return false;
+                }
+                Log<LOG_WARNING>(L"Не удалось забрать окно у другого экземпляра программы: ", reinterpret_cast<uintptr_t>(takeover.hwnd));
+                return true;
+            }), m_takeovers.end());
+        }
+
+        for (auto& takeover : claimed) {
+            takeover.claimed();
+        }
+    }
+
+    HANDLE m_lock = NULL;
+    HANDLE m_mapping = NULL;
+    HANDLE m_stopEvent = NULL;
+    OwnershipRegion* m_region = nullptr;
+    std::thread m_thread;
+
+    std::mutex m_takeoverMutex;
+    std::vector<PendingTakeover> m_takeovers;
+};
+
+OwnershipTable g_ownership;
+
+std::wstring GetProcessNameById(DWORD processId) {
+    return g_processCache.GetName(processId);
+}
+
+POINT CenteredPosition(int width, int height) {
+    int screenWidth = GetSystemMetrics(SM_CXSCREEN);
+    int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+
+    int posX = (screenWidth - width) / 2;
+    int posY = (screenHeight - height) / 2;
+
+    return { posX, posY };
+}
+
+class GdiTitleBarPainter : public TitleBarPainter {
+public:
+    std::wstring ReadTitle(HWND hwnd) override {
+        std::wstring title(GetWindowTextLengthW(hwnd) + 1, L'\0');
+        title.resize(std::max(GetWindowTextW(hwnd, &title[0], static_cast<int>(title.size())), 0));
+        return title;
+    }
+
+    int ReadWidth(HWND hwnd) override {
+        RECT windowRect;
+        return GetWindowRect(hwnd, &windowRect) ? windowRect.right - windowRect.left : 0;
+    }
+
+    UINT ReadDpi(HWND hwnd) override {
+        UINT dpi = GetDpiForWindow(hwnd);
+        return dpi ? dpi : USER_DEFAULT_SCREEN_DPI;
+    }
+
+    TitleBarBitmap Render(int width, UINT dpi, const std::wstring& title) override {
+        TitleBarBitmap bar;
+        HDC screen = GetDC(NULL);
+        bar.dc = CreateCompatibleDC(screen);
+        bar.bitmap = CreateCompatibleBitmap(screen, width, CUSTOM_TITLE_HEIGHT);
+        ReleaseDC(NULL, screen);
+        if (!bar.dc || !bar.bitmap) {
+            Release(bar);
+            return bar;
+        }
+        bar.previous = SelectObject(bar.dc, bar.bitmap);
+
+        RECT titleRect = { 0, 0, width, CUSTOM_TITLE_HEIGHT };
+        FillRect(bar.dc, &titleRect, m_background);
+
+        SetBkMode(bar.dc, TRANSPARENT);
+        SetTextColor(bar.dc, TITLE_TEXT_COLOR);
+
+        // Text follows the window's DPI; the bar height stays fixed
+        HFONT font = CreateFontW(-MulDiv(TITLE_FONT_SIZE, dpi, USER_DEFAULT_SCREEN_DPI), 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+            DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS, CLEARTYPE_QUALITY, DEFAULT_PITCH, L"Segoe UI");
+        HGDIOBJ previousFont = font ? SelectObject(bar.dc, font) : NULL;
+
+        titleRect.left += 10; // Left padding for text
+        DrawTextW(bar.dc, title.c_str(), static_cast<int>(title.size()), &titleRect, DT_SINGLELINE | DT_VCENTER);
+
+        if (font) {
+            SelectObject(bar.dc, previousFont);
+            DeleteObject(font);
+        }
+        return bar;
+    }
+
+    void Blit(HDC target, const TitleBarBitmap& bar, int width) override {
+        BitBlt(target, 0, 0, width, CUSTOM_TITLE_HEIGHT, bar.dc, 0, 0, SRCCOPY);
+    }
+
+    void Release(TitleBarBitmap& bar) override {
+        if (bar.dc && bar.previous) {
+            SelectObject(bar.dc, bar.previous);
+        }
+        if (bar.bitmap) {
+            DeleteObject(bar.bitmap);
+        }
+        if (bar.dc) {
+            DeleteDC(bar.dc);
+        }
+        bar = TitleBarBitmap();
+    }
+
+private:
+    BrushWrapper m_background{ TITLE_BAR_COLOR };
+};
+
+GdiTitleBarPainter g_titleBarPainter;
+TitleBarCache g_titleBars(g_titleBarPainter);
+
+// Window enumeration functions
+// Appends the visible, titled descendants of parentHwnd
+void FindChildWindows(HWND parentHwnd, WindowSnapshot& childWindows) {
+    EnumChildWindows(parentHwnd, [](HWND hwnd, LPARAM lParam) -> BOOL {
+        if (IsWindowVisible(hwnd)) {
+            AppendWindow(*reinterpret_cast<WindowSnapshot*>(lParam), hwnd, WINDOW_VISIBLE | WINDOW_CHILD);
+        }
+        return TRUE;
+        }, (LPARAM)&childWindows);
+}
+
+size_t CountChildWindows(HWND parentHwnd) {
+    size_t count = 0;
+    EnumChildWindows(parentHwnd, [](HWND hwnd, LPARAM lParam) -> BOOL {
+        if (IsWindowVisible(hwnd)) {
+            ++*reinterpret_cast<size_t*>(lParam);
+        }
+        return TRUE;
+        }, reinterpret_cast<LPARAM>(&count));
+    return count;
+}
+
+// Routes a correction through the enforcement engine (defined below)
+bool RequestCorrection(HWND hwnd);
+
+// Asks a subclassed window to drop the subclass on its own thread
+const UINT WM_FRW_UNSUBCLASS = RegisterWindowMessageW(L"FRW.Unsubclass");
+
+// Window thread only, once the subclass is removed and no message can reach
+// the context any more
+void DetachContext(HWND hwnd, WindowContext* context) {
+    g_registry.UpdateIfPresent(hwnd, [&](WindowState& state) {
+        if (state.context == context) {
+            state.context = nullptr;
+        }
+    });
+    delete context;
+}
+
+// Hook callbacks
+LRESULT CALLBACK MessageProc(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode >= 0 && IsMessageOfClass(reinterpret_cast<MSG*>(lParam)->message, MESSAGE_HOOK)) {
+        MSG* msg = (MSG*)lParam;
+
+        // Only size-related messages get here; look up whether we track the window
+        WindowState state;
+
+        if (g_registry.Find(msg->hwnd, state) && state.tracked) {
+
+            auto& sizeData = state.size;
+            g_stats.Count(state.statsRow, STAT_HOOK_MESSAGES);
+            g_trace.Message(msg->hwnd, msg->message);
+
+            // Handle specific messages
+            switch (msg->message) {
+            case WM_GETMINMAXINFO:
+                ClampMinMaxInfo(*reinterpret_cast<MINMAXINFO*>(msg->lParam), sizeData.width, sizeData.height);
+                g_stats.Count(state.statsRow, STAT_CLAMPS);
+                return 0;
+
+            case WM_NCCALCSIZE:
+                if (msg->wParam) {
+                    NCCALCSIZE_PARAMS* params = reinterpret_cast<NCCALCSIZE_PARAMS*>(msg->lParam);
+                    if (ClampClientRect(params->rgrc[0], sizeData.width, sizeData.height)) {
+                        g_stats.Count(state.statsRow, STAT_CLAMPS);
+                    }
+                }
+                break;
+
+            case WM_WINDOWPOSCHANGING:
+                if (ClampWindowPos(*reinterpret_cast<WINDOWPOS*>(msg->lParam), sizeData.width, sizeData.height)) {
+                    g_stats.Count(state.statsRow, STAT_CLAMPS);
+                }
+                break;
+
+            default:
+                // Other size-related messages; the engine decides whether
+                // this is a drift, an echo of its own correction or a fight
+                RequestCorrection(msg->hwnd);
+                break;
+            }
+        }
+    }
+
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+LRESULT CALLBACK CBTProc(int nCode, WPARAM wParam, LPARAM lParam) {
+    if (nCode == HCBT_CREATEWND || nCode == HCBT_ACTIVATE) {
+        HWND hwnd = (HWND)wParam;
+
+        WindowState state;
+
+        if (g_registry.Find(hwnd, state) && state.tracked) {
+            RequestCorrection(hwnd);
+        }
+    }
+
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+}
+
+// Hooks the messages of the window's thread, once per thread. Called with
+// g_stateMutex held.
+bool HookWindowThread(HWND hwnd, DWORD threadId) {
+    auto it = g_messageHooks.find(threadId);
+    if (it == g_messageHooks.end()) {
+        HHOOK messageHook = SetWindowsHookEx(WH_GETMESSAGE, MessageProc, NULL, threadId);
+        if (!messageHook) {
+            Log<LOG_WARNING>(L"Не удалось установить хук WH_GETMESSAGE");
+            return false;
+        }
+        HHOOK cbtHook = SetWindowsHookEx(WH_CBT, CBTProc, NULL, threadId);
+        if (!cbtHook) {
+            Log<LOG_WARNING>(L"Не удалось установить хук WH_CBT");
+            UnhookWindowsHookEx(messageHook);
+            return false;
+        }
+        it = g_messageHooks.emplace(threadId, ThreadMessageHooks{ messageHook, cbtHook, {} }).first;
+    }
+
+    it->second.windows.insert(hwnd);
+    return true;
+}
+
+// Unhooks the window's thread along with its last window. Called with
+// g_stateMutex held.
+void UnhookWindowThread(HWND hwnd) {
+    for (auto it = g_messageHooks.begin(); it != g_messageHooks.end(); ++it) {
+        if (!it->second.windows.erase(hwnd)) {
+            continue;
+        }
+        if (it->second.windows.empty()) {
+            UnhookWindowsHookEx(it->second.messageHook);
+            UnhookWindowsHookEx(it->second.cbtHook);
+            g_messageHooks.erase(it);
+        }
+        return;
+    }
+}
+
+// Custom window procedure, installed with SetWindowSubclass; refData is the
+// window's WindowContext
+LRESULT CALLBACK CustomWindowProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam, UINT_PTR, DWORD_PTR refData) {
+    if (!IsMessageOfClass(msg, MESSAGE_SUBCLASS)) {
+        if (msg == WM_FRW_UNSUBCLASS) {
+            RemoveWindowSubclass(hwnd, CustomWindowProc, 0);
+            DetachContext(hwnd, reinterpret_cast<WindowContext*>(refData));
+            return 1;
+        }
+        return DefSubclassProc(hwnd, msg, wParam, lParam);
+    }
+
+    // Read once: the context is freed at WM_NCDESTROY
+    WindowContext* context = reinterpret_cast<WindowContext*>(refData);
+    int targetWidth = 0;
+    int targetHeight = 0;
+    bool tracked = context->Target(targetWidth, targetHeight);
+    uint32_t statsRow = context->statsRow.load(std::memory_order_relaxed);
+    if (tracked) {
+        g_trace.Message(hwnd, msg);
+    }
+
+    switch (msg) {
+    case WM_NCCALCSIZE: {
+        if (wParam) {
+            NCCALCSIZE_PARAMS* params = reinterpret_cast<NCCALCSIZE_PARAMS*>(lParam);
+            RECT currentClient = params->rgrc[0];
+
+            LRESULT result = DefSubclassProc(hwnd, msg, wParam, lParam);
+
+            // Adjust client area to account for our custom title bar
+            params->rgrc[0].top = currentClient.top + CUSTOM_TITLE_HEIGHT;
+
+            if (tracked) {
+                RECT& rc = params->rgrc[0];
+                rc.right = rc.left + targetWidth;
+                rc.bottom = rc.top + targetHeight - CUSTOM_TITLE_HEIGHT;
+            }
+
+            return result;
+        }
+        break;
+    }
+
+    case WM_NCPAINT: {
+        LRESULT result = DefSubclassProc(hwnd, msg, wParam, lParam);
+
+        DCWrapper hdc(hwnd, (HRGN)wParam);
+        if (hdc) {
+            g_titleBars.Paint(hwnd, hdc);
+        }
+
+        return result;
+    }
+
+    case WM_SETTEXT: {
+        LRESULT result = DefSubclassProc(hwnd, msg, wParam, lParam);
+
+        // Repaint the frame so the cached bar picks up the new title
+        g_titleBars.InvalidateTitle(hwnd);
+        RedrawWindow(hwnd, NULL, NULL, RDW_FRAME | RDW_INVALIDATE);
+        return result;
+    }
+
+    case WM_WINDOWPOSCHANGED: {
+        const WINDOWPOS* pos = reinterpret_cast<const WINDOWPOS*>(lParam);
+        if (!(pos->flags & SWP_NOSIZE)) {
+            g_titleBars.SetWidth(hwnd, pos->cx);
+        }
+        break;
+    }
+
+    case WM_DPICHANGED:
+        g_titleBars.SetDpi(hwnd, LOWORD(wParam));
+        break;
+
+    case WM_NCDESTROY:
+        g_titleBars.Forget(hwnd);
+        RemoveWindowSubclass(hwnd, CustomWindowProc, 0);
+        DetachContext(hwnd, context);
+        break;
+
+    case WM_NCLBUTTONDOWN: {
+        POINT cursorPos;
+        if (GetCursorPos(&cursorPos)) {
+            RECT windowRect;
+            if (GetWindowRect(hwnd, &windowRect)) {
+                if (cursorPos.y >= windowRect.top && cursorPos.y <= windowRect.top + CUSTOM_TITLE_HEIGHT) {
+                    g_isDragging = true;
+                    g_dragStart = cursorPos;
+                    SetCapture(hwnd);
+                    return 0;
+                }
+            }
+        }
+        break;
+    }
+
+    case WM_MOUSEMOVE: {
+        if (g_isDragging) {
+            POINT cursorPos;
+            if (GetCursorPos(&cursorPos)) {
+                int deltaX = cursorPos.x - g_dragStart.x;
+                int deltaY = cursorPos.y - g_dragStart.y;
+
+                g_dragStart = cursorPos;
+
+                RECT windowRect;
+                if (GetWindowRect(hwnd, &windowRect)) {
+                    SetWindowPos(hwnd, NULL,
+                        windowRect.left + deltaX,
+                        windowRect.top + deltaY,
+                        0, 0, SWP_NOSIZE | SWP_NOZORDER);
+                }
+                return 0;
+            }
+        }
+        break;
+    }
+
+    case WM_LBUTTONUP: {
+        if (g_isDragging) {
+            g_isDragging = false;
+            ReleaseCapture();
+            return 0;
+        }
+        break;
+    }
+
+    case WM_NCHITTEST: {
+        LRESULT hit = DefSubclassProc(hwnd, msg, wParam, lParam);
+
+        if (hit == HTCLIENT) {
+            POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+            ScreenToClient(hwnd, &pt);
+
+            if (pt.y >= 0 && pt.y <= CUSTOM_TITLE_HEIGHT) {
+                return HTCAPTION;
+            }
+        }
+
+        return hit;
+    }
+    }
+
+    // Handle window size enforcement
+    if (tracked &&
+        (msg == WM_GETMINMAXINFO || msg == WM_SIZE || msg == WM_SIZING ||
+            msg == WM_WINDOWPOSCHANGING || msg == WM_WINDOWPOSCHANGED)) {
+
+        g_stats.Count(statsRow, STAT_HOOK_MESSAGES);
+
+        if (msg == WM_GETMINMAXINFO) {
+            ClampMinMaxInfo(*reinterpret_cast<MINMAXINFO*>(lParam), targetWidth, targetHeight);
+            g_stats.Count(statsRow, STAT_CLAMPS);
+            return 0;
+        }
+        else if (msg == WM_WINDOWPOSCHANGING) {
+            if (ClampWindowPos(*reinterpret_cast<WINDOWPOS*>(lParam), targetWidth, targetHeight)) {
+                g_stats.Count(statsRow, STAT_CLAMPS);
+            }
+        }
+    }
+
+    return DefSubclassProc(hwnd, msg, wParam, lParam);
+}
+
+class Win32WindowBackend : public WindowBackend {
+public:
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        return GetWindowRect(hwnd, &rect) != FALSE;
+    }
+
+    bool Exists(HWND hwnd) override {
+        return IsWindow(hwnd) != FALSE;
+    }
+
+    void ApplyStyle(HWND hwnd, LONG style) override {
+        SetWindowLong(hwnd, GWL_STYLE, style);
+    }
+
+    void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) override {
+        SetWindowPos(hwnd, NULL, current.left, current.top, width, height,
+            SWP_NOZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
+    }
+};
+
+// Waits for the compositor's next composition pass. Without composition
+// (or in a session where DwmFlush fails) falls back to a 60 Hz cadence.
+class DwmFrameClock : public FrameClock {
+public:
+    void WaitForFrame() override {
+        if (FAILED(DwmFlush())) {
+            Sleep(16);
+        }
+    }
+};
+
+// Message loop thread that owns WinEvent hooks. Out-of-context WinEvent
+// callbacks are delivered to the thread that installed the hook, so hooks
+// are installed, serviced and removed here.
+class WinEventThread {
+public:
+    ~WinEventThread() { Stop(); }
+
+    bool Start() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        std::promise<DWORD> started;
+        auto threadId = started.get_future();
+        m_thread = std::thread(&WinEventThread::Run, this, std::ref(started));
+        m_threadId = threadId.get();
+        return true;
+    }
+
+    void Stop() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        PostThreadMessage(m_threadId, WM_QUIT, 0, 0);
+        m_thread.join();
+        m_threadId = 0;
+    }
+
+    // Runs task on the hook thread and waits for it to finish
+    bool Invoke(const std::function<void()>& task) {
+        DWORD threadId = m_threadId;
+        if (!threadId) {
+            return false;
+        }
+        if (threadId == GetCurrentThreadId()) {
+            task();
+            return true;
+        }
+
+        std::packaged_task<void()> packaged(task);
+        auto done = packaged.get_future();
+        if (!PostThreadMessage(threadId, WM_FRW_INVOKE, 0, reinterpret_cast<LPARAM>(&packaged))) {
+            return false;
+        }
+        done.get();
+        return true;
+    }
+
+private:
+    static constexpr UINT WM_FRW_INVOKE = WM_APP + 1;
+
+    static bool RunInvoke(const MSG& msg) {
+        if (msg.hwnd != NULL || msg.message != WM_FRW_INVOKE) {
+            return false;
+        }
+        (*reinterpret_cast<std::packaged_task<void()>*>(msg.lParam))();
+        return true;
+    }
+
+    void Run(std::promise<DWORD>& started) {
+        // Force creation of the message queue before anyone posts to it
+        MSG msg;
+        PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
+        started.set_value(GetCurrentThreadId());
+
+        while (GetMessage(&msg, NULL, 0, 0) > 0) {
+            if (RunInvoke(msg)) {
+                continue;
+            }
+
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+
+        // Complete tasks posted after WM_QUIT so no caller is left waiting
+        while (PeekMessage(&msg, NULL, WM_FRW_INVOKE, WM_FRW_INVOKE, PM_REMOVE)) {
+            RunInvoke(msg);
+        }
+    }
+
+    std::mutex m_mutex;
+    std::thread m_thread;
+    std::atomic<DWORD> m_threadId{ 0 };
+};
+
+// Event-driven source: wakes only when a watched window moves or resizes
+class WinEventGeometrySource : public GeometryEventSource {
+public:
+    explicit WinEventGeometrySource(WinEventThread& hookThread) : m_hookThread(hookThread) {}
+
+    bool Start(GeometryEventSink* sink) override {
+        m_router.SetSink(sink);
+        s_instance = this;
+        return m_hookThread.Start();
+    }
+
+    void Stop() override {
+        m_hookThread.Invoke([this]() {
+            for (const auto& pair : m_threadHooks) {
+                UnhookWinEvent(pair.second.locationHook);
+                UnhookWinEvent(pair.second.destroyHook);
+            }
+            m_threadHooks.clear();
+            m_router.Clear();
+        });
+    }
+
+    bool Watch(HWND hwnd) override {
+        bool installed = false;
+        return m_hookThread.Invoke([&]() { installed = InstallHook(hwnd); }) && installed;
+    }
+
+    void Unwatch(HWND hwnd) override {
+        m_hookThread.Invoke([&]() { RemoveHook(hwnd); });
+    }
+
+private:
+    struct ThreadHook {
+        HWINEVENTHOOK locationHook;
+        HWINEVENTHOOK destroyHook;
+        int refCount;
+    };
+
+    // Runs on the hook thread, so the router needs no locking
+    static void CALLBACK WinEventProc(HWINEVENTHOOK, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD, DWORD) {
+        if (s_instance && s_instance->m_router.Dispatch(event, hwnd, idObject, idChild) == WinEventRouter::Outcome::Released) {
+            s_instance->RemoveHook(hwnd);
+        }
+    }
+
+    bool InstallHook(HWND hwnd) {
+        if (m_router.IsWatched(hwnd)) {
+            return true;
+        }
+
+        DWORD processId = 0;
+        DWORD threadId = GetWindowThreadProcessId(hwnd, &processId);
+        if (!threadId) {
+            return false;
+        }
+
+        // One pair of hooks per target UI thread, shared by all of its windows
+        auto it = m_threadHooks.find(threadId);
+        if (it == m_threadHooks.end()) {
+            HWINEVENTHOOK locationHook = SetWinEventHook(EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE,
+                NULL, WinEventProc, processId, threadId, WINEVENT_OUTOFCONTEXT);
+            HWINEVENTHOOK destroyHook = SetWinEventHook(EVENT_OBJECT_DESTROY, EVENT_OBJECT_DESTROY,
+                NULL, WinEventProc, processId, threadId, WINEVENT_OUTOFCONTEXT);
+            if (!locationHook || !destroyHook) {
+                for (HWINEVENTHOOK hook : { locationHook, destroyHook }) {
+                    if (hook) {
+                        UnhookWinEvent(hook);
+                    }
+                }
+                return false;
+            }
+            it = m_threadHooks.emplace(threadId, ThreadHook{ locationHook, destroyHook, 0 }).first;
+        }
+
+        it->second.refCount++;
+        m_router.Watch(hwnd, threadId);
+        return true;
+    }
+
+    void RemoveHook(HWND hwnd) {
+        DWORD threadId = 0;
+        if (!m_router.Unwatch(hwnd, threadId)) {
+            return;
+        }
+
+        auto hookIt = m_threadHooks.find(threadId);
+        if (hookIt != m_threadHooks.end() && --hookIt->second.refCount == 0) {
+            UnhookWinEvent(hookIt->second.locationHook);
+            UnhookWinEvent(hookIt->second.destroyHook);
+            m_threadHooks.erase(hookIt);
+        }
+    }
+
+    static WinEventGeometrySource* s_instance;
+
+    WinEventThread& m_hookThread;
+    WinEventRouter m_router;
+    std::map<DWORD, ThreadHook> m_threadHooks;
+};
+
+WinEventGeometrySource* WinEventGeometrySource::s_instance = nullptr;
+
+// Trace, log and the per-window state kept outside the engine
+class Win32EnforcementListener : public EnforcementListener {
+public:
+    void OnTracked(HWND hwnd, uint32_t statsRow, int width, int height) override {
+        DWORD processId = 0;
+        GetWindowThreadProcessId(hwnd, &processId);
+        wchar_t title[TITLE_MAX_LENGTH] = { 0 };
+        int length = GetWindowTextW(hwnd, title, TITLE_MAX_LENGTH);
+        g_stats.DescribeWindow(statsRow, processId, std::wstring_view(title, std::max(length, 0)));
+        g_trace.Track(hwnd, width, height);
+    }
+
+    void OnChecked(HWND hwnd, int width, int height) override {
+        g_trace.Check(hwnd, width, height);
+    }
+
+    void OnDeferred(HWND hwnd) override {
+        g_trace.Deferred(hwnd);
+    }
+
+    void OnCorrected(HWND hwnd, LONG style, int width, int height) override {
+        g_trace.Style(hwnd, style);
+        g_trace.Correction(hwnd, width, height);
+    }
+
+    void OnModeChanged(HWND, DampingMode mode) override {
+        static const wchar_t* const MESSAGES[] = {
+            L"Окно перестало сопротивляться, размер снова исправляется сразу",
+            L"Окно сопротивляется изменению размера, исправления замедлены",
+            L"Окно продолжает менять размер, остаются только ограничения в хуках"
+        };
+        Log<LOG_INFO>(MESSAGES[static_cast<uint32_t>(mode)]);
+    }
+
+    void OnDestroyed(HWND hwnd) override {
+        {
+            std::lock_guard<std::mutex> lock(g_stateMutex);
+            UnhookWindowThread(hwnd);
+        }
+        g_trace.Gone(hwnd);
+        g_journal.Remove(hwnd);
+        g_titleBars.Forget(hwnd);
+        g_ownership.Release(hwnd);
+    }
+};
+
+Win32WindowBackend g_windowBackend;
+DwmFrameClock g_frameClock;
+FrameBatchingBackend g_frameBackend(g_windowBackend, &g_stats);
+Win32EnforcementListener g_enforcementListener;
+EnforcementEngine g_enforcementEngine(g_registry, g_stats, g_frameBackend, &g_enforcementListener);
+
+bool RequestCorrection(HWND hwnd) {
+    return g_enforcementEngine.OnGeometryChanged(hwnd) == GeometryCheck::Corrected;
+}
+WinEventThread g_winEventThread;
+WinEventGeometrySource g_eventSource(g_winEventThread);
+PollingGeometrySource g_pollingSource;
+PollingGeometrySource g_retrySource;  // Re-checks damped windows in event mode
+EnforcementStrategy g_strategy = EnforcementStrategy::Events;
+
+// Collects style and geometry changes for several windows and commits them
+// in one deferred-positioning transaction per parent window (DeferWindowPos
+// requires a common parent), followed by a single repaint pass
+class WindowBatch {
+public:
+    void Add(HWND hwnd, int x, int y, int width, int height, LONG style) {
+        m_entries.push_back({ hwnd, GetAncestor(hwnd, GA_PARENT), x, y, width, height, style });
+    }
+
+    bool Empty() const { return m_entries.empty(); }
+
+    void Commit() {
+        // Styles first, so the one SWP_FRAMECHANGED below picks them up
+        for (const auto& entry : m_entries) {
+            SetWindowLong(entry.hwnd, GWL_STYLE, entry.style);
+        }
+
+        std::stable_sort(m_entries.begin(), m_entries.end(),
+            [](const Entry& a, const Entry& b) { return a.parent < b.parent; });
+
+        const UINT flags = SWP_NOZORDER | SWP_NOACTIVATE | SWP_FRAMECHANGED | SWP_NOREDRAW;
+        for (size_t first = 0; first < m_entries.size();) {
+            size_t last = first;
+            while (last < m_entries.size() && m_entries[last].parent == m_entries[first].parent) {
+                ++last;
+            }
+
+            HDWP hdwp = BeginDeferWindowPos(static_cast<int>(last - first));
+            for (size_t i = first; hdwp && i < last; ++i) {
+                const Entry& e = m_entries[i];
+                hdwp = DeferWindowPos(hdwp, e.hwnd, NULL, e.x, e.y, e.width, e.height, flags);
+            }
+
+            // A failed DeferWindowPos discards the whole group; apply it one by one
+            if (!hdwp || !EndDeferWindowPos(hdwp)) {
+                for (size_t i = first; i < last; ++i) {
+                    const Entry& e = m_entries[i];
+                    SetWindowPos(e.hwnd, NULL, e.x, e.y, e.width, e.height, flags);
+                }
+            }
+            first = last;
+        }
+
+        // Invalidate only; each window repaints once when it next paints
+        for (const auto& entry : m_entries) {
+            RedrawWindow(entry.hwnd, NULL, NULL, RDW_INVALIDATE | RDW_ERASE | RDW_FRAME | RDW_ALLCHILDREN);
+        }
+        m_entries.clear();
+    }
+
+private:
+    struct Entry {
+        HWND hwnd;
+        HWND parent;
+        int x;
+        int y;
+        int width;
+        int height;
+        LONG style;
+    };
+
+    std::vector<Entry> m_entries;
+};
+
+struct WindowSizeRequest {
+    HWND hwnd;
+    int width;
+    int height;
+    bool hasPosition;  // Otherwise the window is centered on screen
+    POINT position;
+    uint32_t ruleId = JOURNAL_NO_RULE;
+};
+
+// Registers the window with the enforcement engine and returns the style
+// it will be held at
+LONG TrackWindow(HWND hwnd, int width, int height) {
+    LONG style = GetWindowLong(hwnd, GWL_STYLE);
+    LONG exStyle = GetWindowLong(hwnd, GWL_EXSTYLE);
+
+    // Keep WS_CAPTION for title bar, remove resizing styles
+    LONG newStyle = style & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_MINIMIZEBOX);
+    newStyle |= WS_CAPTION;
+
+    g_enforcementEngine.Track(hwnd, width, height, style, exStyle, newStyle);
+    return newStyle;
+}
+
+// Hands a tracked window to a geometry source
+bool WatchWindow(HWND hwnd) {
+    g_frameBackend.Start(g_frameClock);
+
+    bool watching = false;
+    if (g_strategy == EnforcementStrategy::Events && g_eventSource.Start(&g_enforcementEngine)) {
+        watching = g_eventSource.Watch(hwnd);
+        if (watching && g_retrySource.Start(&g_enforcementEngine)) {
+            g_enforcementEngine.SetRetrySource(&g_retrySource);
+        }
+        if (!watching) {
+            Log<LOG_WARNING>(L"Не удалось подписаться на события окна, используется опрос");
+        }
+    }
+
+    if (!watching && g_pollingSource.Start(&g_enforcementEngine)) {
+        watching = g_pollingSource.Watch(hwnd);
+    }
+
+    // Catch any drift that happened before the source was attached
+    g_enforcementEngine.OnGeometryChanged(hwnd);
+
+    return watching;
+}
+
+// Subclasses the window and hooks its thread's messages. Both only work for
+// windows of this process: hooks without a DLL reach only our own threads,
+// and comctl32 sets a subclass only from the window's own thread. Returns
+// false if neither could be set up; such windows are enforced through
+// geometry events alone.
+bool SubclassWindow(HWND hwnd) {
+    DWORD processId = 0;
+    DWORD threadId = GetWindowThreadProcessId(hwnd, &processId);
+    if (!threadId || processId != GetCurrentProcessId()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(g_stateMutex);
+    bool hooked = HookWindowThread(hwnd, threadId);
+
+    // The context lives as long as the subclass
+    WindowState state;
+    if (g_registry.Find(hwnd, state) && state.context) {
+        return true;
+    }
+    if (threadId != GetCurrentThreadId()) {
+        return hooked;
+    }
+
+    WNDPROC oldWndProc = (WNDPROC)GetWindowLongPtr(hwnd, GWLP_WNDPROC);
+    WindowContext* context = new WindowContext();
+    if (!SetWindowSubclass(hwnd, CustomWindowProc, 0, reinterpret_cast<DWORD_PTR>(context))) {
+        delete context;
+        return hooked;
+    }
+    g_registry.Update(hwnd, [&](WindowState& current) {
+        current.originalProc = oldWndProc;
+        current.context = context;
+    });
+    return true;
+}
+
+// Removes our subclass on the window's own thread, the only one allowed to
+// and the only one where no message can still be using the context
+bool UnsubclassWindow(HWND hwnd) {
+    DWORD_PTR result = 0;
+    return SendMessageTimeoutW(hwnd, WM_FRW_UNSUBCLASS, 0, 0, SMTO_ABORTIFHUNG, 1000, &result) && result;
+}
+
+size_t ForceWindowSizes(const std::vector<WindowSizeRequest>& requests);
+
+// Claims the requested windows. Those another instance enforces are left to
+// it, taken over or handed the size, as g_conflictPolicy says; handedOff
+// counts the windows chained or waiting for a takeover.
+std::vector<WindowSizeRequest> ClaimWindows(const std::vector<WindowSizeRequest>& requests, size_t& handedOff) {
+    std::vector<WindowSizeRequest> claimed;
+
+    for (const auto& request : requests) {
+        if (!request.hwnd || !IsWindow(request.hwnd)) {
+            continue;
+        }
+
+        DWORD owner = g_ownership.Claim(request.hwnd, request.width, request.height);
+        if (!owner) {
+            claimed.push_back(request);
+            continue;
+        }
+
+        switch (g_conflictPolicy) {
+        case ConflictPolicy::Defer:
+            Log<LOG_WARNING>(L"Окно уже удерживает другой экземпляр программы, PID ", owner);
+            break;
+        case ConflictPolicy::Chain:
+            if (g_ownership.RequestResize(request.hwnd, request.width, request.height)) {
+                Log<LOG_INFO>(L"Размер окна передан экземпляру программы с PID ", owner);
+                handedOff++;
+            }
+            break;
+        case ConflictPolicy::TakeOver:
+            // The owner lets go on its next heartbeat, a hung or dead one
+            // loses the lease instead; our heartbeat then enforces
+            if (g_ownership.RequestTakeover(request.hwnd)) {
+                g_ownership.AwaitTakeover(request.hwnd, request.width, request.height, [request]() {
+                    ForceWindowSizes({ request });
+                });
+                Log<LOG_INFO>(L"Окно будет забрано у экземпляра программы с PID ", owner);
+                handedOff++;
+            }
+            break;
+        }
+    }
+
+    return claimed;
+}
+
+// Main public API
+// Enforces sizes for a set of windows; all initial geometry and style
+// changes are applied as one batch. Returns the number of windows enforced
+// here, chained to another instance or to be enforced once taken over.
+size_t ForceWindowSizes(const std::vector<WindowSizeRequest>& requests) {
+    WindowBatch batch;
+    std::vector<HWND> accepted;
+    size_t handedOff = 0;
+
+    for (const auto& request : ClaimWindows(requests, handedOff)) {
+        if (!request.hwnd || !IsWindow(request.hwnd)) {
+            continue;
+        }
+
+        if (!SubclassWindow(request.hwnd)) {
+            Log<LOG_DEBUG>(L"Окно не принадлежит этому процессу, размер удерживается по событиям геометрии");
+        }
+        LONG style = TrackWindow(request.hwnd, request.width, request.height);
+
+        POINT position = request.hasPosition ? request.position : CenteredPosition(request.width, request.height);
+        batch.Add(request.hwnd, position.x, position.y, request.width, request.height, style);
+        accepted.push_back(request.hwnd);
+
+        WindowState state;
+        if (g_registry.Find(request.hwnd, state)) {
+            g_journal.Write(request.hwnd, state, request.ruleId);
+        }
+    }
+
+    batch.Commit();
+
+    size_t watched = 0;
+    for (HWND hwnd : accepted) {
+        if (WatchWindow(hwnd)) {
+            watched++;
+        }
+    }
+    return watched + handedOff;
+}
+
+bool ForceWindowSize(HWND hwnd, int width, int height) {
+    if (!hwnd || !IsWindow(hwnd)) {
+        std::wcout << L"Некорректный дескриптор окна!" << std::endl;
+        return false;
+    }
+
+    return ForceWindowSizes({ { hwnd, width, height, false, {} } }) == 1;
+}
+
+// Stops enforcing one window and gives it back its style and window
+// procedure. Returns false if the window was not tracked.
+bool ReleaseWindow(HWND hwnd) {
+    WindowState state;
+    if (!g_registry.Find(hwnd, state) || !state.tracked) {
+        return false;
+    }
+
+    g_trace.Release(hwnd);
+    g_eventSource.Unwatch(hwnd);
+    g_pollingSource.Unwatch(hwnd);
+    g_enforcementEngine.Untrack(hwnd);
+    g_enforcementEngine.FreeStatsRow(hwnd);
+
+    // A window whose thread does not answer keeps the subclass, but it
+    // stops clamping
+    g_registry.UpdateIfPresent(hwnd, [](WindowState& current) {
+        if (current.context) {
+            current.context->SetTarget(0, 0);
+        }
+    });
+
+    // These wait on the window's thread, so they run without g_stateMutex:
+    // a hung window must not stall every other hook and release
+    if (IsWindow(hwnd)) {
+        SetWindowLong(hwnd, GWL_STYLE, state.size.originalStyle);
+        SetWindowLong(hwnd, GWL_EXSTYLE, state.size.originalExStyle);
+        if (state.context) {
+            UnsubclassWindow(hwnd);
+        }
+        SetWindowPos(hwnd, NULL, 0, 0, 0, 0,
+            SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_NOACTIVATE | SWP_FRAMECHANGED);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_stateMutex);
+        UnhookWindowThread(hwnd);
+        g_registry.Remove(hwnd);
+    }
+
+    g_journal.Remove(hwnd);
+    g_titleBars.Forget(hwnd);
+    g_ownership.Release(hwnd);
+    return true;
+}
+
+size_t ReleaseAllWindows() {
+    size_t released = 0;
+    for (const auto& pair : g_registry.Snapshot()) {
+        released += ReleaseWindow(pair.first) ? 1 : 0;
+    }
+    return released;
+}
+
+// Gives a tracked window a new target size and applies it right away
+bool ResizeTrackedWindow(HWND hwnd, int width, int height) {
+    if (!g_enforcementEngine.Retarget(hwnd, width, height)) {
+        return false;
+    }
+
+    g_journal.SetSize(hwnd, width, height);
+    g_ownership.Claim(hwnd, width, height);
+    g_enforcementEngine.OnGeometryChanged(hwnd);
+    return true;
+}
+
+// Picks up the windows an earlier instance left enforced. With restore
+// they get their original styles back, otherwise enforcement resumes with
+// the journaled target size. Records of windows that are gone, or whose
+// HWND now belongs to someone else, are dropped, and so are windows another
+// instance has enforced since. Returns the number of windows recovered.
+size_t RecoverJournal(bool restore) {
+    size_t recovered = 0;
+    for (const auto& record : g_journal.Records()) {
+        HWND hwnd = reinterpret_cast<HWND>(record.hwnd);
+        if (!EnforcementJournal::IsCurrent(record)) {
+            g_journal.Remove(hwnd);
+            continue;
+        }
+
+        if (restore) {
+            // A live instance took the window over after the lease ran
+            // out; its enforced style stays
+            if (g_ownership.OtherOwner(hwnd)) {
+                g_journal.Remove(hwnd);
+                continue;
+            }
+
+            // The saved window procedure only meant something in the dead
+            // process; a foreign window never took our subclass anyway
+            SetWindowLong(hwnd, GWL_STYLE, record.originalStyle);
+            SetWindowLong(hwnd, GWL_EXSTYLE, record.originalExStyle);
+            SetWindowPos(hwnd, NULL, 0, 0, 0, 0,
+                SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_NOACTIVATE | SWP_FRAMECHANGED);
+            g_journal.Remove(hwnd);
+        }
+        else {
+            if (g_ownership.Claim(hwnd, record.width, record.height)) {
+                g_journal.Remove(hwnd);
+                continue;
+            }
+
+            if (!SubclassWindow(hwnd)) {
+                Log<LOG_DEBUG>(L"Окно не принадлежит этому процессу, размер удерживается по событиям геометрии");
+            }
+            g_enforcementEngine.Track(hwnd, record.width, record.height,
+                record.originalStyle, record.originalExStyle, record.enforcedStyle);
+
+            WindowState state;
+            if (g_registry.Find(hwnd, state)) {
+                g_journal.Write(hwnd, state, record.ruleId);
+            }
+            WatchWindow(hwnd);
+        }
+        recovered++;
+    }
+    return recovered;
+}
+
+// Window enumeration
+BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam) {
+    if (IsWindowVisible(hwnd)) {
+        AppendWindow(*reinterpret_cast<WindowSnapshot*>(lParam), hwnd, WINDOW_VISIBLE);
+    }
+    return TRUE;
+}
+
+// Refills windowList in place, reusing its buffers
+void EnumerateWindows(WindowSnapshot& windowList) {
+    windowList.Clear();
+    EnumWindows(EnumWindowsProc, reinterpret_cast<LPARAM>(&windowList));
+}
+
+enum class WindowChangeKind {
+    Added,
+    Updated,
+    Removed
+};
+
+struct WindowChange {
+    uint64_t version;
+    WindowChangeKind kind;
+    WindowInfo window;
+};
+
+// Resident list of visible, titled top-level windows. Built with one
+// EnumWindows pass, then kept current from create/destroy/show/hide/name
+// change WinEvents. Every change bumps the version and is kept in a bounded
+// log so callers can catch up incrementally instead of re-enumerating.
+class WindowInventory {
+public:
+    explicit WindowInventory(WinEventThread& hookThread) : m_hookThread(hookThread) {}
+
+    bool Start() {
+        if (m_live || !m_hookThread.Start()) {
+            return m_live;
+        }
+
+        // Hooks and the initial walk run on the hook thread, so no event can
+        // be handled before the baseline exists
+        m_hookThread.Invoke([this]() {
+            s_instance = this;
+            m_hooks[0] = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_HIDE,
+                NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+            m_hooks[1] = SetWinEventHook(EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE,
+                NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+
+            std::unique_lock<std::shared_mutex> lock(m_mutex);
+            EnumerateWindows(m_windows);
+            RebuildIndex();
+            m_changes.clear();
+            m_version++;
+
+            m_live = m_hooks[0] && m_hooks[1];
+        });
+
+        if (!m_live) {
+            Log<LOG_WARNING>(L"Не удалось подписаться на события окон, список будет перечитываться");
+        }
+        return m_live;
+    }
+
+    void Stop() {
+        m_hookThread.Invoke([this]() {
+            for (auto& hook : m_hooks) {
+                if (hook) {
+                    UnhookWinEvent(hook);
+                    hook = NULL;
+                }
+            }
+            m_live = false;
+        });
+    }
+
+    uint64_t Version() const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_version;
+    }
+
+    // Immutable view of the inventory; rebuilt only when the version moved.
+    // Once every holder has released the previous view, its buffers are
+    // reused for the next one.
+    std::shared_ptr<const InventorySnapshot> Snapshot() {
+        if (m_live) {
+            std::shared_lock<std::shared_mutex> lock(m_mutex);
+            if (m_snapshot && m_snapshot->version == m_version) {
+                return m_snapshot;
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        if (!m_live) {
+            // Without events the only way to be current is a full walk
+            EnumerateWindows(ReusableSnapshot().windows);
+            m_snapshot->version = ++m_version;
+        }
+        else if (!m_snapshot || m_snapshot->version != m_version) {
+            m_windows.CopyLiveTo(ReusableSnapshot().windows);
+            m_snapshot->version = m_version;
+        }
+        return m_snapshot;
+    }
+
+    // Appends every change made after `version`. Returns false if the log no
+    // longer reaches back that far; the caller should take a new Snapshot.
+    bool ChangesSince(uint64_t version, std::vector<WindowChange>& changes) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        if (version > m_version || (version < m_version && (m_changes.empty() || m_changes.front().version > version + 1))) {
+            return false;
+        }
+
+        auto it = std::lower_bound(m_changes.begin(), m_changes.end(), version + 1,
+            [](const WindowChange& change, uint64_t v) { return change.version < v; });
+        changes.insert(changes.end(), it, m_changes.end());
+        return true;
+    }
+
+private:
+    static constexpr size_t CHANGE_LOG_CAPACITY = 16384;
+
+    static void CALLBACK WinEventProc(HWINEVENTHOOK, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD, DWORD) {
+        if (!hwnd || idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !s_instance) {
+            return;
+        }
+
+        if (event == EVENT_OBJECT_DESTROY) {
+            s_instance->Remove(hwnd);
+        }
+        else if (GetAncestor(hwnd, GA_PARENT) == GetDesktopWindow()) {
+            s_instance->Refresh(hwnd);
+        }
+    }
+
+    // Re-reads one window and records whether it appeared, changed or left.
+    // Runs on the hook thread only, which owns m_titleBuffer.
+    void Refresh(HWND hwnd) {
+        int length = IsWindowVisible(hwnd) ? GetWindowTextLengthW(hwnd) : 0;
+        if (length > 0) {
+            m_titleBuffer.resize(length + 1);
+            length = GetWindowTextW(hwnd, &m_titleBuffer[0], length + 1);
+        }
+        if (length <= 0) {
+            Remove(hwnd);
+            return;
+        }
+
+        std::wstring_view title(m_titleBuffer.data(), length);
+        DWORD processId = 0;
+        GetWindowThreadProcessId(hwnd, &processId);
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_index.find(hwnd);
+        if (it == m_index.end()) {
+            m_index[hwnd] = m_windows.Size();
+            m_windows.Append(hwnd, processId, WINDOW_VISIBLE, title);
+            m_liveTitleChars += title.size();
+            Record(WindowChangeKind::Added, m_windows.Size() - 1);
+            return;
+        }
+
+        size_t index = it->second;
+        if (m_windows.Title(index) != title || m_windows.ProcessId(index) != processId) {
+            m_liveTitleChars += title.size() - m_windows.Title(index).size();
+            m_windows.Update(index, processId, title);
+            Record(WindowChangeKind::Updated, index);
+            CompactIfSparse();
+        }
+    }
+
+    void Remove(HWND hwnd) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        auto it = m_index.find(hwnd);
+        if (it == m_index.end()) {
+            return;
+        }
+
+        Record(WindowChangeKind::Removed, it->second);
+        m_liveTitleChars -= m_windows.Title(it->second).size();
+        m_windows.MarkRemoved(it->second);
+        m_index.erase(it);
+        CompactIfSparse();
+    }
+
+    // Removed entries and replaced titles keep their space until they
+    // outweigh the live data
+    void CompactIfSparse() {
+        if (m_windows.Size() > 64 &&
+            (m_index.size() * 2 < m_windows.Size() || m_liveTitleChars * 2 < m_windows.TitleChars())) {
+            m_windows.CopyLiveTo(m_compacted);
+            std::swap(m_windows, m_compacted);
+            RebuildIndex();
+        }
+    }
+
+    void RebuildIndex() {
+        m_index.clear();
+        m_liveTitleChars = 0;
+        for (size_t i = 0; i < m_windows.Size(); ++i) {
+            m_index[m_windows.Hwnd(i)] = i;
+            m_liveTitleChars += m_windows.Title(i).size();
+        }
+    }
+
+    void Record(WindowChangeKind kind, size_t index) {
+        m_changes.push_back({ ++m_version, kind, m_windows.Info(index) });
+        if (m_changes.size() > CHANGE_LOG_CAPACITY) {
+            m_changes.pop_front();
+        }
+    }
+
+    InventorySnapshot& ReusableSnapshot() {
+        if (!m_snapshot || m_snapshot.use_count() > 1) {
+            m_snapshot = std::make_shared<InventorySnapshot>();
+        }
+        return *m_snapshot;
+    }
+
+    static WindowInventory* s_instance;
+
+    WinEventThread& m_hookThread;
+    HWINEVENTHOOK m_hooks[2] = { NULL, NULL };
+    std::atomic<bool> m_live{ false };
+    std::wstring m_titleBuffer;
+
+    mutable std::shared_mutex m_mutex;
+    WindowSnapshot m_windows;  // First-seen order, removed entries are flagged
+    WindowSnapshot m_compacted;
+    std::unordered_map<HWND, size_t> m_index;
+    size_t m_liveTitleChars = 0;
+    std::deque<WindowChange> m_changes;
+    uint64_t m_version = 0;
+    std::shared_ptr<InventorySnapshot> m_snapshot;
+};
+
+WindowInventory* WindowInventory::s_instance = nullptr;
+WindowInventory g_inventory(g_winEventThread);
+
+// Ranked title search over the current inventory; the index is rebuilt
+// only when the inventory version changes
+std::vector<TitleMatch> FindWindowsByTitle(const std::wstring& query) {
+    static std::mutex indexMutex;
+    static std::shared_ptr<const TitleIndex> index;
+
+    auto snapshot = g_inventory.Snapshot();
+    std::shared_ptr<const TitleIndex> current;
+    {
+        std::lock_guard<std::mutex> lock(indexMutex);
+        if (!index || index->Version() != snapshot->version) {
+            index = std::make_shared<TitleIndex>(*snapshot);
+        }
+        current = index;
+    }
+
+    return current->Search(query);
+}
+
+HWND FindWindowByPartialTitle(const std::wstring& partialTitle) {
+    for (const auto& match : FindWindowsByTitle(partialTitle)) {
+        if (match.kind != TitleMatchKind::Fuzzy) {
+            return match.hwnd;
+        }
+    }
+    return NULL;
+}
+
+// Sorted (key, value) pairs; equal_range gives all values for a key
+template <typename Key, typename Value>
+class FlatMultimap {
+public:
+    using Entry = std::pair<Key, Value>;
+
+    void Clear() { m_entries.clear(); }
+    void Add(Key key, Value value) { m_entries.emplace_back(key, value); }
+    void Seal() { std::sort(m_entries.begin(), m_entries.end()); }
+
+    std::pair<typename std::vector<Entry>::const_iterator, typename std::vector<Entry>::const_iterator> Range(Key key) const {
+        auto first = std::lower_bound(m_entries.begin(), m_entries.end(), key,
+            [](const Entry& entry, Key k) { return entry.first < k; });
+        auto last = first;
+        while (last != m_entries.end() && last->first == key) {
+            ++last;
+        }
+        return { first, last };
+    }
+
+private:
+    std::vector<Entry> m_entries;
+};
+
+// Windows and processes indexed in one pass: PID -> windows, parent window
+// -> child windows, owner -> owned windows and parent -> child processes.
+// Node numbers are positions in Windows(); top-level windows come first
+// in inventory order, each followed by its descendants.
+class WindowTree {
+public:
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    WindowTree(const InventorySnapshot& snapshot, const std::vector<ProcessInfo>& processes)
+        : m_version(snapshot.version), m_builtAt(std::chrono::steady_clock::now()) {
+        const WindowSnapshot& topLevel = snapshot.windows;
+        for (size_t i = 0; i < topLevel.Size(); ++i) {
+            m_windows.Append(topLevel.Hwnd(i), topLevel.ProcessId(i), topLevel.Flags(i), topLevel.Title(i));
+            FindChildWindows(topLevel.Hwnd(i), m_windows);
+        }
+
+        std::unordered_map<HWND, uint32_t> nodes;
+        nodes.reserve(m_windows.Size());
+        for (uint32_t node = 0; node < m_windows.Size(); ++node) {
+            nodes.emplace(m_windows.Hwnd(node), node);
+        }
+
+        auto nodeOf = [&](HWND hwnd) {
+            auto it = nodes.find(hwnd);
+            return it != nodes.end() ? it->second : NO_NODE;
+        };
+
+        m_parents.assign(m_windows.Size(), NO_NODE);
+        for (uint32_t node = 0; node < m_windows.Size(); ++node) {
+            HWND hwnd = m_windows.Hwnd(node);
+            m_processWindows.Add(m_windows.ProcessId(node), node);
+
+            // Untitled or hidden intermediate parents are not nodes; attach
+            // to the nearest ancestor that is
+            if (m_windows.Flags(node) & WINDOW_CHILD) {
+                HWND parent = GetAncestor(hwnd, GA_PARENT);
+                while (parent && nodeOf(parent) == NO_NODE && parent != GetDesktopWindow()) {
+                    parent = GetAncestor(parent, GA_PARENT);
+                }
+                m_parents[node] = parent ? nodeOf(parent) : NO_NODE;
+                if (m_parents[node] != NO_NODE) {
+                    m_childWindows.Add(m_parents[node], node);
+                }
+            }
+
+            uint32_t owner = nodeOf(GetWindow(hwnd, GW_OWNER));
+            if (owner != NO_NODE) {
+                m_ownedWindows.Add(owner, node);
+            }
+        }
+
+        // A parent PID is only trusted if that process is older than the
+        // child; otherwise the PID was reused after the real parent exited
+        std::unordered_map<DWORD, ULONGLONG> creationTimes;
+        for (const auto& process : processes) {
+            creationTimes[process.processId] = process.creationTime;
+        }
+        for (const auto& process : processes) {
+            auto parent = creationTimes.find(process.parentProcessId);
+            if (parent == creationTimes.end() || process.parentProcessId == process.processId) {
+                continue;
+            }
+            if (parent->second && process.creationTime && parent->second > process.creationTime) {
+                continue;
+            }
+            m_childProcesses.Add(process.parentProcessId, process.processId);
+        }
+
+        m_processWindows.Seal();
+        m_childWindows.Seal();
+        m_ownedWindows.Seal();
+        m_childProcesses.Seal();
+    }
+
+    uint64_t Version() const { return m_version; }
+    std::chrono::steady_clock::time_point BuiltAt() const { return m_builtAt; }
+    const WindowSnapshot& Windows() const { return m_windows; }
+    uint32_t Parent(uint32_t node) const { return m_parents[node]; }
+
+    void WindowsOfProcess(DWORD processId, std::vector<uint32_t>& nodes) const {
+        Collect(m_processWindows, processId, nodes);
+    }
+
+    void ChildWindows(uint32_t node, std::vector<uint32_t>& nodes) const {
+        Collect(m_childWindows, node, nodes);
+    }
+
+    void OwnedWindows(uint32_t node, std::vector<uint32_t>& nodes) const {
+        Collect(m_ownedWindows, node, nodes);
+    }
+
+    // processId followed by all of its descendant processes, breadth first
+    void ProcessTree(DWORD processId, std::vector<DWORD>& processIds) const {
+        size_t first = processIds.size();
+        processIds.push_back(processId);
+
+        for (size_t i = first; i < processIds.size(); ++i) {
+            auto range = m_childProcesses.Range(processIds[i]);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (std::find(processIds.begin() + first, processIds.end(), it->second) == processIds.end()) {
+                    processIds.push_back(it->second);
+                }
+            }
+        }
+    }
+
+private:
+    template <typename Key, typename Value>
+    static void Collect(const FlatMultimap<Key, Value>& map, Key key, std::vector<Value>& values) {
+        auto range = map.Range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            values.push_back(it->second);
+        }
+    }
+
+    uint64_t m_version;
+    std::chrono::steady_clock::time_point m_builtAt;
+    WindowSnapshot m_windows;
+    std::vector<uint32_t> m_parents;
+    FlatMultimap<DWORD, uint32_t> m_processWindows;
+    FlatMultimap<uint32_t, uint32_t> m_childWindows;
+    FlatMultimap<uint32_t, uint32_t> m_ownedWindows;
+    FlatMultimap<DWORD, DWORD> m_childProcesses;
+};
+
+// Tree for the current inventory. Child windows and processes are not
+// followed by events, so the tree is also rebuilt once it is older than
+// PROCESS_CACHE_REFRESH_MS.
+std::shared_ptr<const WindowTree> CurrentWindowTree() {
+    static std::mutex treeMutex;
+    static std::shared_ptr<const WindowTree> tree;
+
+    auto snapshot = g_inventory.Snapshot();
+    std::lock_guard<std::mutex> lock(treeMutex);
+
+    if (!tree || tree->Version() != snapshot->version ||
+        std::chrono::steady_clock::now() - tree->BuiltAt() > std::chrono::milliseconds(PROCESS_CACHE_REFRESH_MS)) {
+        g_processCache.Refresh();
+        tree = std::make_shared<WindowTree>(*snapshot, g_processCache.All());
+    }
+    return tree;
+}
+
+std::vector<WindowInfo> FindWindowsForProcess(DWORD processId, bool includeChildProcesses) {
+    auto tree = CurrentWindowTree();
+
+    std::vector<DWORD> processIds;
+    if (includeChildProcesses) {
+        tree->ProcessTree(processId, processIds);
+    }
+    else {
+        processIds.push_back(processId);
+    }
+
+    std::vector<uint32_t> nodes;
+    for (DWORD id : processIds) {
+        tree->WindowsOfProcess(id, nodes);
+    }
+
+    std::vector<WindowInfo> result;
+    result.reserve(nodes.size());
+    for (uint32_t node : nodes) {
+        result.push_back(tree->Windows().Info(node));
+    }
+    return result;
+}
+
+// Child processes (launchers, multi-process browsers) are included only
+// when asked for
+bool ForceWindowSizeForAllProcessWindows(DWORD processId, int width, int height, bool includeChildProcesses) {
+    auto windows = FindWindowsForProcess(processId, includeChildProcesses);
+
+    std::vector<WindowSizeRequest> requests;
+    for (const auto& window : windows) {
+        requests.push_back({ window.hwnd, width, height, false, {} });
+    }
+
+    if (ForceWindowSizes(requests) == 0) {
+        return false;
+    }
+
+    for (const auto& window : windows) {
+        Log<LOG_INFO>(L"Установлен размер для окна: ", window.title);
+    }
+    return true;
+}
+
+// Saved layout: one line per top-level window,
+// "x<TAB>y<TAB>width<TAB>height<TAB>process<TAB>title", UTF-8
+struct LayoutEntry {
+    int x;
+    int y;
+    int width;
+    int height;
+    std::wstring processName;
+    std::wstring title;
+};
+
+bool SaveLayout(const std::wstring& path) {
+    FILE* file = _wfopen(path.c_str(), L"w, ccs=UTF-8");
+    if (!file) {
+        return false;
+    }
+
+    auto snapshot = g_inventory.Snapshot();
+    const auto& windows = snapshot->windows;
+
+    for (size_t i = 0; i < windows.Size(); ++i) {
+        RECT rect;
+        if (!GetWindowRect(windows.Hwnd(i), &rect)) {
+            continue;
+        }
+
+        std::wstring title(windows.Title(i));
+        std::replace(title.begin(), title.end(), L'\n', L' ');
+
+        fwprintf(file, L"%ld\t%ld\t%ld\t%ld\t%ls\t%ls\n", rect.left, rect.top,
+            rect.right - rect.left, rect.bottom - rect.top,
+            GetProcessNameById(windows.ProcessId(i)).c_str(), title.c_str());
+    }
+
+    fclose(file);
+    return true;
+}
+
+std::vector<LayoutEntry> LoadLayout(const std::wstring& path) {
+    std::vector<LayoutEntry> entries;
+    FILE* file = _wfopen(path.c_str(), L"r, ccs=UTF-8");
+    if (!file) {
+        return entries;
+    }
+
+    std::vector<wchar_t> line(64 * 1024);
+    while (fgetws(line.data(), static_cast<int>(line.size()), file)) {
+        std::wstring text(line.data());
+        while (!text.empty() && (text.back() == L'\n' || text.back() == L'\r')) {
+            text.pop_back();
+        }
+
+        // Fields: four numbers, process name, then the rest of the line is the title
+        LayoutEntry entry = {};
+        std::vector<std::wstring> fields;
+        size_t start = 0;
+        while (fields.size() < 5) {
+            size_t tab = text.find(L'\t', start);
+            if (tab == std::wstring::npos) {
+                break;
+            }
+            fields.push_back(text.substr(start, tab - start));
+            start = tab + 1;
+        }
+        if (fields.size() < 5) {
+            continue;
+        }
+
+        entry.x = _wtoi(fields[0].c_str());
+        entry.y = _wtoi(fields[1].c_str());
+        entry.width = _wtoi(fields[2].c_str());
+        entry.height = _wtoi(fields[3].c_str());
+        entry.processName = fields[4];
+        entry.title = text.substr(start);
+
+        if (entry.width > 0 && entry.height > 0) {
+            entries.push_back(entry);
+        }
+    }
+
+    fclose(file);
+    return entries;
+}
+
+// Matches layout entries to current windows (process and title first, then
+// process alone) and enforces all of them in one batch
+size_t ApplyLayout(const std::vector<LayoutEntry>& entries) {
+    auto snapshot = g_inventory.Snapshot();
+    const auto& windows = snapshot->windows;
+
+    std::vector<std::wstring> processNames;
+    for (size_t i = 0; i < windows.Size(); ++i) {
+        processNames.push_back(FoldTitle(GetProcessNameById(windows.ProcessId(i))));
+    }
+
+    std::vector<bool> used(windows.Size(), false);
+    std::vector<WindowSizeRequest> requests;
+
+    for (const auto& entry : entries) {
+        std::wstring processName = FoldTitle(entry.processName);
+        size_t match = windows.Size();
+
+        for (int pass = 0; pass < 2 && match == windows.Size(); ++pass) {
+            for (size_t i = 0; i < windows.Size(); ++i) {
+                if (!used[i] && processNames[i] == processName && (pass == 1 || windows.Title(i) == entry.title)) {
+                    match = i;
+                    break;
+                }
+            }
+        }
+
+        if (match == windows.Size()) {
+            Log<LOG_WARNING>(L"Окно из раскладки не найдено: ", entry.title);
+            continue;
+        }
+
+        used[match] = true;
+        requests.push_back({ windows.Hwnd(match), entry.width, entry.height, true, { entry.x, entry.y } });
+    }
+
+    return ForceWindowSizes(requests);
+}
+
+// Rules file: one rule per line, "<width>x<height> <process> <class> [title]".
+// Process and class are globs (* and ?), the title is a regular expression
+// (. [] * + ? | () and \d \s \w) found anywhere in the title unless anchored
+// with ^ or $. Matching ignores case; the first matching rule wins.
+struct WindowRule {
+    int width;
+    int height;
+    std::wstring processGlob;
+    std::wstring classGlob;
+    std::wstring titlePattern;
+};
+
+// All rules compiled into one NFA over "process\1class\2title" and run as a
+// lazily built DFA, so checking a window is one pass over its key however
+// many rules there are. Not thread-safe: matching fills in the DFA cache.
+class RuleMatcher {
+public:
+    explicit RuleMatcher(const std::vector<WindowRule>& rules) {
+        m_charSets.push_back({ { { PROCESS_END, CLASS_END } }, true });  // ANY_CHAR
+
+        for (size_t i = 0; i < rules.size(); ++i) {
+            try {
+                m_ruleStarts.push_back(CompileRule(rules[i], static_cast<int>(i)));
+            }
+            catch (const std::exception&) {
+                Log<LOG_WARNING>(L"Ошибка в правиле ", i + 1, L": ", rules[i].titlePattern);
+                throw;
+            }
+        }
+        ResetCache();
+    }
+
+    // Returns the index of the first matching rule, or -1
+    int Match(const std::wstring& processName, const std::wstring& className, const std::wstring& title) {
+        int state = m_start;
+        auto feed = [&](const std::wstring& text) {
+            for (size_t i = 0; i < text.size() && !m_dfa[state].nodes.empty(); ++i) {
+                wchar_t c = text[i] < 0x20 ? L' ' : FoldCase(text[i]);
+                state = Step(state, c);
+            }
+        };
+
+        feed(processName);
+        state = Step(state, PROCESS_END);
+        feed(className);
+        state = Step(state, CLASS_END);
+        feed(title);
+        return m_dfa[state].rule;
+    }
+
+private:
+    static constexpr wchar_t PROCESS_END = 1;
+    static constexpr wchar_t CLASS_END = 2;
+    static constexpr int ANY_CHAR = 0;
+    static constexpr int NO_NODE = -1;
+    static constexpr size_t MAX_DFA_STATES = 4096;
+
+    struct CharSet {
+        std::vector<std::pair<wchar_t, wchar_t>> ranges;
+        bool negated;
+
+        bool Contains(wchar_t c) const {
+            for (const auto& range : ranges) {
+                if (c >= range.first && c <= range.second) {
+                    return !negated;
+                }
+            }
+            return negated;
+        }
+    };
+
+    enum class NodeKind {
+        Chars,
+        Split,
+        Match
+    };
+
+    struct Node {
+        NodeKind kind;
+        int out;
+        int out1;
+        int charSet;
+        int rule;
+    };
+
+    // Partially built automaton: entry node plus the exits still to connect
+    struct Fragment {
+        int start;
+        std::vector<std::pair<int, int>> exits;  // (node, 0 = out, 1 = out1)
+    };
+
+    struct DfaState {
+        std::vector<int> nodes;
+        int rule;
+        std::array<int, 128> ascii;
+        std::unordered_map<wchar_t, int> other;
+    };
+
+    int AddNode(NodeKind kind, int charSet = NO_NODE, int rule = -1) {
+        m_nodes.push_back({ kind, NO_NODE, NO_NODE, charSet, rule });
+        return static_cast<int>(m_nodes.size()) - 1;
+    }
+
+    void Connect(const Fragment& fragment, int target) {
+        for (const auto& exit : fragment.exits) {
+            (exit.second ? m_nodes[exit.first].out1 : m_nodes[exit.first].out) = target;
+        }
+    }
+
+    Fragment Empty() {
+        int node = AddNode(NodeKind::Split);
+        return { node, { { node, 0 } } };
+    }
+
+    Fragment Chars(int charSet) {
+        int node = AddNode(NodeKind::Chars, charSet);
+        return { node, { { node, 0 } } };
+    }
+
+    Fragment Literal(wchar_t c) {
+        m_charSets.push_back({ { { c, c } }, false });
+        return Chars(static_cast<int>(m_charSets.size()) - 1);
+    }
+
+    Fragment Concat(const Fragment& a, Fragment b) {
+        Connect(a, b.start);
+        return { a.start, std::move(b.exits) };
+    }
+
+    Fragment Alternate(const Fragment& a, const Fragment& b) {
+        int node = AddNode(NodeKind::Split);
+        m_nodes[node].out = a.start;
+        m_nodes[node].out1 = b.start;
+        Fragment result = { node, a.exits };
+        result.exits.insert(result.exits.end(), b.exits.begin(), b.exits.end());
+        return result;
+    }
+
+    Fragment Repeat(const Fragment& a, wchar_t op) {
+        int node = AddNode(NodeKind::Split);
+        m_nodes[node].out = a.start;
+        if (op == L'?') {
+            Fragment result = { node, a.exits };
+            result.exits.push_back({ node, 1 });
+            return result;
+        }
+
+        Connect(a, node);
+        return { op == L'*' ? node : a.start, { { node, 1 } } };
+    }
+
+    Fragment Glob(const std::wstring& pattern) {
+        Fragment result = Empty();
+        for (wchar_t c : FoldTitle(pattern)) {
+            if (c == L'*') {
+                result = Concat(result, Repeat(Chars(ANY_CHAR), L'*'));
+            }
+            else {
+                result = Concat(result, c == L'?' ? Chars(ANY_CHAR) : Literal(c));
+            }
+        }
+        return result;
+    }
+
+    int CompileRule(const WindowRule& rule, int index) {
+        Fragment result = Glob(rule.processGlob.empty() ? L"*" : rule.processGlob);
+        result = Concat(result, Literal(PROCESS_END));
+        result = Concat(result, Glob(rule.classGlob.empty() ? L"*" : rule.classGlob));
+        result = Concat(result, Literal(CLASS_END));
+
+        std::wstring pattern = FoldTitle(rule.titlePattern);
+        bool anchoredStart = !pattern.empty() && pattern.front() == L'^';
+        bool anchoredEnd = pattern.size() > 1 && pattern.back() == L'$' && pattern[pattern.size() - 2] != L'\\';
+        if (anchoredStart) {
+            pattern.erase(0, 1);
+        }
+        if (anchoredEnd) {
+            pattern.pop_back();
+        }
+
+        if (!anchoredStart) {
+            result = Concat(result, Repeat(Chars(ANY_CHAR), L'*'));
+        }
+        m_pattern = pattern;
+        m_position = 0;
+        result = Concat(result, ParseAlternation());
+        if (m_position != m_pattern.size()) {
+            throw std::runtime_error("Некорректное регулярное выражение в правиле");
+        }
+        if (!anchoredEnd) {
+            result = Concat(result, Repeat(Chars(ANY_CHAR), L'*'));
+        }
+
+        Connect(result, AddNode(NodeKind::Match, NO_NODE, index));
+        return result.start;
+    }
+
+    // Recursive descent over m_pattern: alternation > concatenation > repeat > atom
+    Fragment ParseAlternation() {
+        Fragment result = ParseConcat();
+        while (m_position < m_pattern.size() && m_pattern[m_position] == L'|') {
+            m_position++;
+            result = Alternate(result, ParseConcat());
+        }
+        return result;
+    }
+
+    Fragment ParseConcat() {
+        Fragment result = Empty();
+        while (m_position < m_pattern.size() && m_pattern[m_position] != L'|' && m_pattern[m_position] != L')') {
+            Fragment atom = ParseAtom();
+            while (m_position < m_pattern.size() && wcschr(L"*+?", m_pattern[m_position])) {
+                atom = Repeat(atom, m_pattern[m_position++]);
+            }
+            result = Concat(result, atom);
+        }
+        return result;
+    }
+
+    Fragment ParseAtom() {
+        wchar_t c = m_pattern[m_position++];
+        switch (c) {
+        case L'(': {
+            Fragment inner = ParseAlternation();
+            if (m_position >= m_pattern.size() || m_pattern[m_position] != L')') {
+                throw std::runtime_error("Незакрытая скобка в правиле");
+            }
+            m_position++;
+            return inner;
+        }
+        case L'.':
+            return Chars(ANY_CHAR);
+        case L'[':
+            return ParseClass();
+        case L'*':
+        case L'+':
+        case L'?':
+            throw std::runtime_error("Повтор без выражения в правиле");
+        case L'\\': {
+            CharSet set = { {}, false };
+            AddEscape(set);
+            m_charSets.push_back(set);
+            return Chars(static_cast<int>(m_charSets.size()) - 1);
+        }
+        default:
+            return Literal(c);
+        }
+    }
+
+    Fragment ParseClass() {
+        CharSet set = { {}, false };
+        if (m_position < m_pattern.size() && m_pattern[m_position] == L'^') {
+            set.negated = true;
+            m_position++;
+        }
+
+        bool first = true;
+        while (m_position < m_pattern.size() && (first || m_pattern[m_position] != L']')) {
+            first = false;
+            wchar_t low = m_pattern[m_position++];
+            if (low == L'\\') {
+                AddEscape(set);
+                continue;
+            }
+
+            wchar_t high = low;
+            if (m_position + 1 < m_pattern.size() && m_pattern[m_position] == L'-' && m_pattern[m_position + 1] != L']') {
+                high = m_pattern[m_position + 1];
+                m_position += 2;
+            }
+            set.ranges.push_back({ std::min(low, high), std::max(low, high) });
+        }
+
+        if (m_position >= m_pattern.size()) {
+            throw std::runtime_error("Незакрытый класс символов в правиле");
+        }
+        m_position++;
+
+        m_charSets.push_back(set);
+        return Chars(static_cast<int>(m_charSets.size()) - 1);
+    }
+
+    // Escapes are read from a folded pattern, so only lower-case forms exist
+    void AddEscape(CharSet& set) {
+        if (m_position >= m_pattern.size()) {
+            throw std::runtime_error("Незавершённая escape-последовательность в правиле");
+        }
+
+        wchar_t c = m_pattern[m_position++];
+        switch (c) {
+        case L'd':
+            set.ranges.push_back({ L'0', L'9' });
+            break;
+        case L's':
+            set.ranges.push_back({ L' ', L' ' });
+            break;
+        case L'w':
+            set.ranges.push_back({ L'0', L'9' });
+            set.ranges.push_back({ L'a', L'z' });
+            set.ranges.push_back({ L'_', L'_' });
+            set.ranges.push_back({ 0x0430, 0x044F });
+            break;
+        default:
+            set.ranges.push_back({ c, c });
+            break;
+        }
+    }
+
+    void AddClosure(int node, std::vector<int>& nodes, std::vector<bool>& seen) const {
+        std::vector<int> pending = { node };
+        while (!pending.empty()) {
+            int current = pending.back();
+            pending.pop_back();
+            if (current == NO_NODE || seen[current]) {
+                continue;
+            }
+            seen[current] = true;
+
+            const Node& n = m_nodes[current];
+            if (n.kind == NodeKind::Split) {
+                pending.push_back(n.out1);
+                pending.push_back(n.out);
+            }
+            else {
+                nodes.push_back(current);
+            }
+        }
+    }
+
+    int Intern(std::vector<int> nodes) {
+        std::sort(nodes.begin(), nodes.end());
+        auto it = m_dfaIds.find(nodes);
+        if (it != m_dfaIds.end()) {
+            return it->second;
+        }
+
+        DfaState state = { nodes, -1, {}, {} };
+        state.ascii.fill(NO_NODE);
+        for (int node : nodes) {
+            if (m_nodes[node].kind == NodeKind::Match && (state.rule < 0 || m_nodes[node].rule < state.rule)) {
+                state.rule = m_nodes[node].rule;
+            }
+        }
+
+        int id = static_cast<int>(m_dfa.size());
+        m_dfa.push_back(std::move(state));
+        m_dfaIds.emplace(std::move(nodes), id);
+        return id;
+    }
+
+    // Keeps memory bounded for titles that keep producing new states
+    void ResetCache() {
+        m_dfa.clear();
+        m_dfaIds.clear();
+
+        std::vector<int> nodes;
+        std::vector<bool> seen(m_nodes.size(), false);
+        for (int start : m_ruleStarts) {
+            AddClosure(start, nodes, seen);
+        }
+        m_start = Intern(std::move(nodes));
+    }
+
+    int Step(int state, wchar_t c) {
+        int cached = c < 128 ? m_dfa[state].ascii[c] : NO_NODE;
+        if (c >= 128) {
+            auto it = m_dfa[state].other.find(c);
+            if (it != m_dfa[state].other.end()) {
+                cached = it->second;
+            }
+        }
+        if (cached != NO_NODE) {
+            return cached;
+        }
+
+        std::vector<int> next;
+        std::vector<bool> seen(m_nodes.size(), false);
+        for (int node : m_dfa[state].nodes) {
+            const Node& n = m_nodes[node];
+            if (n.kind == NodeKind::Chars && m_charSets[n.charSet].Contains(c)) {
+                AddClosure(n.out, next, seen);
+            }
+        }
+
+        if (m_dfa.size() >= MAX_DFA_STATES) {
+            ResetCache();
+            return Intern(std::move(next));
+        }
+
+        int id = Intern(std::move(next));
+        if (c < 128) {
+            m_dfa[state].ascii[c] = id;
+        }
+        else {
+            m_dfa[state].other[c] = id;
+        }
+        return id;
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<CharSet> m_charSets;
+    std::vector<int> m_ruleStarts;
+
+    std::vector<DfaState> m_dfa;
+    std::map<std::vector<int>, int> m_dfaIds;
+    int m_start = 0;
+
+    // Parser state for the rule being compiled
+    std::wstring m_pattern;
+    size_t m_position = 0;
+};
+
+std::vector<WindowRule> LoadRules(const std::wstring& path) {
+    FILE* file = _wfopen(path.c_str(), L"r, ccs=UTF-8");
+    if (!file) {
+        throw std::runtime_error("Не удалось открыть файл правил");
+    }
+
+    std::vector<WindowRule> rules;
+    std::vector<wchar_t> line(64 * 1024);
+    int lineNumber = 0;
+
+    while (fgetws(line.data(), static_cast<int>(line.size()), file)) {
+        lineNumber++;
+        std::wstring text(line.data());
+        size_t end = text.find_last_not_of(L" \t\r\n");
+        size_t start = text.find_first_not_of(L" \t");
+        if (end == std::wstring::npos || text[start] == L'#') {
+            continue;
+        }
+        text = text.substr(start, end - start + 1);
+
+        // Size, process and class are single words; the rest is the title
+        std::wstring fields[3];
+        size_t position = 0;
+        for (auto& field : fields) {
+            size_t fieldEnd = std::min(text.find_first_of(L" \t", position), text.size());
+            field = text.substr(position, fieldEnd - position);
+            position = std::min(text.find_first_not_of(L" \t", fieldEnd), text.size());
+        }
+
+        WindowRule rule = {};
+        wchar_t separator = 0;
+        if (fields[2].empty() || swscanf(fields[0].c_str(), L"%d%lc%d", &rule.width, &separator, &rule.height) != 3 ||
+            (separator != L'x' && separator != L'X') || rule.width <= 0 || rule.height <= 0) {
+            fclose(file);
+            Log<LOG_WARNING>(L"Строка ", lineNumber, L": ", text);
+            throw std::runtime_error("Некорректная строка в файле правил");
+        }
+
+        rule.processGlob = fields[1];
+        rule.classGlob = fields[2];
+        rule.titlePattern = text.substr(position);
+        rules.push_back(std::move(rule));
+    }
+
+    fclose(file);
+    return rules;
+}
+
+// Resident mode: windows matching the rules file are sized as soon as they
+// are created (before their first paint when the title is already set),
+// shown or renamed. The file is reloaded when it changes on disk. The hook
+// thread is shared with geometry enforcement, so it only matches windows
+// whose process is already in the cache; a worker resolves the others,
+// matches the whole inventory after a (re)load and enforces.
+class RuleEngine {
+public:
+    explicit RuleEngine(WinEventThread& hookThread) : m_hookThread(hookThread) {}
+
+    ~RuleEngine() { Stop(); }
+
+    bool Start(const std::wstring& path) {
+        auto rules = LoadRules(path);
+        auto matcher = std::make_unique<RuleMatcher>(rules);
+        if (!m_hookThread.Start()) {
+            return false;
+        }
+
+        m_path = path;
+        m_lastWrite = LastWriteTime(path);
+
+        m_stopping = false;
+        Install(std::move(rules), std::move(matcher), false);
+        m_worker = std::thread(&RuleEngine::Work, this);
+
+        bool hooked = false;
+        m_hookThread.Invoke([&]() {
+            s_instance = this;
+            m_hooks[0] = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_SHOW,
+                NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+            m_hooks[1] = SetWinEventHook(EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE,
+                NULL, WinEventProc, 0, 0, WINEVENT_OUTOFCONTEXT);
+            hooked = m_hooks[0] && m_hooks[1];
+        });
+
+        if (!hooked) {
+            Log<LOG_WARNING>(L"Не удалось подписаться на создание окон, правила применены только к текущим окнам");
+        }
+
+        m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_watcher = std::thread(&RuleEngine::WatchFile, this);
+        return true;
+    }
+
+    void Stop() {
+        if (m_watcher.joinable()) {
+            SetEvent(m_stopEvent);
+            m_watcher.join();
+        }
+        if (m_stopEvent) {
+            CloseHandle(m_stopEvent);
+            m_stopEvent = NULL;
+        }
+
+        m_hookThread.Invoke([this]() {
+            for (auto& hook : m_hooks) {
+                if (hook) {
+                    UnhookWinEvent(hook);
+                    hook = NULL;
+                }
+            }
+        });
+
+        // Matches not enforced yet are dropped
+        if (m_worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(m_queueMutex);
+                m_stopping = true;
+                m_queue.clear();
+                m_unresolved.clear();
+                m_rematch = m_rematchReload = false;
+            }
+            m_queueReady.notify_one();
+            m_worker.join();
+        }
+
+        std::lock_guard<std::mutex> lock(m_rulesMutex);
+        m_matcher.reset();
+        m_applied.clear();
+    }
+
+    size_t RuleCount() const {
+        return m_ruleCount;
+    }
+
+private:
+    static constexpr DWORD RELOAD_DELAY_MS = 100;
+
+    // A window matched by a rule; retarget changes the size of a window
+    // the rules already enforce
+    struct Match {
+        WindowSizeRequest request;
+        bool retarget;
+    };
+
+    // What the rules look at, read without the rules lock held
+    struct Candidate {
+        HWND hwnd;
+        std::wstring processName;
+        std::wstring className;
+        std::wstring title;
+    };
+
+    static void CALLBACK WinEventProc(HWINEVENTHOOK, DWORD event, HWND hwnd, LONG idObject, LONG idChild, DWORD, DWORD) {
+        if (!hwnd || idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !s_instance) {
+            return;
+        }
+
+        if (event == EVENT_OBJECT_DESTROY) {
+            std::lock_guard<std::mutex> lock(s_instance->m_rulesMutex);
+            s_instance->m_applied.erase(hwnd);
+        }
+        else if (GetAncestor(hwnd, GA_PARENT) == GetDesktopWindow()) {
+            s_instance->Apply({ hwnd }, false, false);
+        }
+    }
+
+    // Swaps in a new rule set; the worker then applies it to the windows
+    // that already exist
+    void Install(std::vector<WindowRule> rules, std::unique_ptr<RuleMatcher> matcher, bool reload) {
+        {
+            std::lock_guard<std::mutex> lock(m_rulesMutex);
+            m_rules = std::move(rules);
+            m_matcher = std::move(matcher);
+            m_ruleCount = m_rules.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_queueMutex);
+            m_rematch = true;
+            m_rematchReload = m_rematchReload || reload;
+        }
+        m_queueReady.notify_one();
+    }
+
+    // Matching windows are queued for the worker. Each window is taken over
+    // at most once; only a reload matches it again, and a rule that now asks
+    // for another size retargets it. Without resolveNames (the hook thread)
+    // a process missing from the cache is left to the worker, which may
+    // have to take a new process snapshot.
+    void Apply(const std::vector<HWND>& windows, bool reload, bool resolveNames) {
+        std::vector<HWND> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_rulesMutex);
+            if (!m_matcher) {
+                return;
+            }
+            for (HWND hwnd : windows) {
+                bool applied = m_applied.count(hwnd) != 0;
+                WindowState state;
+                if ((applied && !reload) || hwnd == GetConsoleWindow() ||
+                    (!applied && g_registry.Find(hwnd, state) && state.tracked)) {
+                    continue;
+                }
+                pending.push_back(hwnd);
+            }
+        }
+
+        std::vector<Candidate> candidates;
+        std::vector<HWND> unresolved;
+        for (HWND hwnd : pending) {
+            DWORD processId = 0;
+            if (!GetWindowThreadProcessId(hwnd, &processId)) {
+                continue;
+            }
+
+            Candidate candidate = { hwnd };
+            ProcessInfo info;
+            if (resolveNames) {
+                candidate.processName = GetProcessNameById(processId);
+            }
+            else if (g_processCache.Find(processId, info)) {
+                candidate.processName = std::move(info.name);
+            }
+            else {
+                unresolved.push_back(hwnd);
+                continue;
+            }
+
+            wchar_t className[TITLE_MAX_LENGTH] = { 0 };
+            GetClassNameW(hwnd, className, TITLE_MAX_LENGTH);
+            candidate.className = className;
+
+            int length = GetWindowTextLengthW(hwnd);
+            candidate.title.resize(length + 1);
+            length = length > 0 ? GetWindowTextW(hwnd, &candidate.title[0], length + 1) : 0;
+            candidate.title.resize(std::max(length, 0));
+
+            candidates.push_back(std::move(candidate));
+        }
+
+        std::vector<Match> matches;
+        {
+            std::lock_guard<std::mutex> lock(m_rulesMutex);
+            for (const auto& candidate : candidates) {
+                if (!m_matcher) {
+                    break;
+                }
+
+                // Another thread may have taken the window over meanwhile
+                auto applied = m_applied.find(candidate.hwnd);
+                if (applied != m_applied.end() && !reload) {
+                    continue;
+                }
+
+                int rule = m_matcher->Match(candidate.processName, candidate.className, candidate.title);
+                if (rule < 0) {
+                    continue;
+                }
+
+                const WindowRule& match = m_rules[rule];
+                bool retarget = applied != m_applied.end();
+                if (retarget && applied->second.cx == match.width && applied->second.cy == match.height) {
+                    continue;
+                }
+
+                m_applied[candidate.hwnd] = { match.width, match.height };
+                matches.push_back({ { candidate.hwnd, match.width, match.height, false, {}, static_cast<uint32_t>(rule) }, retarget });
+            }
+        }
+
+        if (!matches.empty() || !unresolved.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(m_queueMutex);
+                m_queue.insert(m_queue.end(), matches.begin(), matches.end());
+                m_unresolved.insert(m_unresolved.end(), unresolved.begin(), unresolved.end());
+            }
+            m_queueReady.notify_one();
+        }
+    }
+
+    // Worker: matches what the hook thread could not, then enforces
+    // everything matched since its last round in one batch
+    void Work() {
+        std::vector<Match> matches;
+        std::vector<HWND> unresolved;
+        for (;;) {
+            bool rematch = false;
+            bool reload = false;
+            {
+                std::unique_lock<std::mutex> lock(m_queueMutex);
+                m_queueReady.wait(lock, [this]() {
+                    return m_stopping || m_rematch || !m_queue.empty() || !m_unresolved.empty();
+                });
+                if (m_stopping) {
+                    return;
+                }
+                unresolved.swap(m_unresolved);
+                std::swap(rematch, m_rematch);
+                std::swap(reload, m_rematchReload);
+            }
+
+            if (rematch) {
+                auto snapshot = g_inventory.Snapshot();
+                std::vector<HWND> windows;
+                for (size_t i = 0; i < snapshot->windows.Size(); ++i) {
+                    windows.push_back(snapshot->windows.Hwnd(i));
+                }
+                Apply(windows, reload, true);
+            }
+            if (!unresolved.empty()) {
+                Apply(unresolved, false, true);
+                unresolved.clear();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_queueMutex);
+                matches.swap(m_queue);
+            }
+            Enforce(matches);
+            matches.clear();
+        }
+    }
+
+    static void Enforce(const std::vector<Match>& matches) {
+        std::vector<WindowSizeRequest> requests;
+        for (const auto& match : matches) {
+            if (!match.retarget) {
+                requests.push_back(match.request);
+            }
+            else {
+                ResizeTrackedWindow(match.request.hwnd, match.request.width, match.request.height);
+            }
+        }
+        if (!requests.empty()) {
+            ForceWindowSizes(requests);
+        }
+    }
+
+    static FILETIME LastWriteTime(const std::wstring& path) {
+        WIN32_FILE_ATTRIBUTE_DATA data = {};
+        GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data);
+        return data.ftLastWriteTime;
+    }
+
+    void WatchFile() {
+        size_t slash = m_path.find_last_of(L"\\/");
+        std::wstring directory = slash == std::wstring::npos ? L"." : m_path.substr(0, slash + 1);
+
+        HANDLE change = FindFirstChangeNotificationW(directory.c_str(), FALSE,
+            FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE);
+        if (change == INVALID_HANDLE_VALUE) {
+            Log<LOG_WARNING>(L"Не удалось отслеживать изменения файла правил");
+            return;
+        }
+
+        HANDLE handles[2] = { m_stopEvent, change };
+        while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+            FindNextChangeNotification(change);
+
+            // Editors often save in several steps; let the file settle
+            if (WaitForSingleObject(m_stopEvent, RELOAD_DELAY_MS) != WAIT_TIMEOUT) {
+                break;
+            }
+            Reload();
+        }
+
+        FindCloseChangeNotification(change);
+    }
+
+    // A file that fails to parse keeps the previous rules in force
+    void Reload() {
+        FILETIME lastWrite = LastWriteTime(m_path);
+        if (CompareFileTime(&lastWrite, &m_lastWrite) == 0) {
+            return;
+        }
+        m_lastWrite = lastWrite;
+
+        try {
+            auto rules = LoadRules(m_path);
+            auto matcher = std::make_unique<RuleMatcher>(rules);
+            Install(std::move(rules), std::move(matcher), true);
+            Log<LOG_INFO>(L"Правила перечитаны: ", m_ruleCount.load());
+        }
+        catch (const std::exception&) {
+            Log<LOG_WARNING>(L"Не удалось перечитать правила, действуют прежние");
+        }
+    }
+
+    static RuleEngine* s_instance;
+
+    WinEventThread& m_hookThread;
+    HWINEVENTHOOK m_hooks[2] = { NULL, NULL };
+
+    // Matched under the lock by the hook thread and the worker
+    std::mutex m_rulesMutex;
+    std::vector<WindowRule> m_rules;
+    std::unique_ptr<RuleMatcher> m_matcher;
+    std::unordered_map<HWND, SIZE> m_applied;  // Size of the rule each window got
+    std::atomic<size_t> m_ruleCount{ 0 };
+
+    // Owned by the watcher thread
+    std::wstring m_path;
+    FILETIME m_lastWrite = {};
+    HANDLE m_stopEvent = NULL;
+    std::thread m_watcher;
+
+    // Work handed to the worker
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueReady;
+    std::vector<Match> m_queue;
+    std::vector<HWND> m_unresolved;  // Processes the hook thread did not find cached
+    bool m_rematch = false;          // Match the whole inventory against new rules
+    bool m_rematchReload = false;
+    bool m_stopping = false;
+    std::thread m_worker;
+};
+
+RuleEngine* RuleEngine::s_instance = nullptr;
+RuleEngine g_ruleEngine(g_winEventThread);
+
+const wchar_t* const CONTROL_PIPE_NAME = L"\\\\.\\pipe\\FRW.Control";
+constexpr DWORD CONTROL_BUFFER_SIZE = 64 * 1024;
+
+std::wstring Utf8ToWide(const std::string& text) {
+    if (text.empty()) {
+        return std::wstring();
+    }
+    int length = MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), NULL, 0);
+    std::wstring result(length, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &result[0], length);
+    return result;
+}
+
+std::string WideToUtf8(const std::wstring& text) {
+    if (text.empty()) {
+        return std::string();
+    }
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), NULL, 0, NULL, NULL);
+    std::string result(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), &result[0], length, NULL, NULL);
+    return result;
+}
+
+// Serves the control protocol (Core/ControlProtocol.h) over the pipe, one
+// request per pipe message
+class ControlServer : public ControlTarget {
+public:
+    ~ControlServer() { Stop(); }
+
+    bool Start() {
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        m_shutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (!m_stopEvent || !m_shutdownEvent) {
+            return false;
+        }
+
+        m_thread = std::thread(&ControlServer::Run, this);
+        return true;
+    }
+
+    void Stop() {
+        if (m_thread.joinable()) {
+            SetEvent(m_stopEvent);
+            m_thread.join();
+        }
+        for (HANDLE* handle : { &m_stopEvent, &m_shutdownEvent }) {
+            if (*handle) {
+                CloseHandle(*handle);
+                *handle = NULL;
+            }
+        }
+    }
+
+    // Signaled once a client asks the daemon to stop
+    HANDLE ShutdownEvent() const {
+        return m_shutdownEvent;
+    }
+
+private:
+    void Run() {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        std::string request;
+        std::vector<char> buffer(CONTROL_BUFFER_SIZE);
+
+        while (WaitForSingleObject(m_stopEvent, 0) == WAIT_TIMEOUT) {
+            HANDLE pipe = CreateNamedPipeW(CONTROL_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                PIPE_UNLIMITED_INSTANCES, CONTROL_BUFFER_SIZE, CONTROL_BUFFER_SIZE, 0, NULL);
+            if (pipe == INVALID_HANDLE_VALUE) {
+                Log<LOG_WARNING>(L"Не удалось создать канал управления");
+                break;
+            }
+
+            // One client at a time; it may send any number of requests
+            bool connected = ConnectNamedPipe(pipe, &overlapped) || GetLastError() == ERROR_PIPE_CONNECTED;
+            if (!connected && GetLastError() == ERROR_IO_PENDING) {
+                connected = Complete(pipe, overlapped);
+            }
+
+            while (connected) {
+                request.clear();
+                bool complete = false;
+                while (!complete) {
+                    DWORD read = 0;
+                    BOOL ok = ReadFile(pipe, buffer.data(), CONTROL_BUFFER_SIZE, &read, &overlapped);
+                    DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+                    if (error == ERROR_IO_PENDING) {
+                        ok = Complete(pipe, overlapped, &read);
+                        error = ok ? ERROR_SUCCESS : GetLastError();
+                    }
+                    if (!ok && error != ERROR_MORE_DATA) {
+                        break;
+                    }
+                    request.append(buffer.data(), read);
+                    complete = ok != FALSE;
+                }
+                if (!complete) {
+                    break;
+                }
+
+                std::string reply = WideToUtf8(ExecuteControlRequest(*this, Utf8ToWide(request)));
+                DWORD written = 0;
+                if (!WriteFile(pipe, reply.data(), static_cast<DWORD>(reply.size()), &written, &overlapped) &&
+                    (GetLastError() != ERROR_IO_PENDING || !Complete(pipe, overlapped, &written))) {
+                    break;
+                }
+            }
+
+            CancelIo(pipe);
+            DisconnectNamedPipe(pipe);
+            CloseHandle(pipe);
+        }
+
+        CloseHandle(overlapped.hEvent);
+    }
+
+    // Waits for a pending operation unless the server is being stopped
+    bool Complete(HANDLE pipe, OVERLAPPED& overlapped, DWORD* transferred = nullptr) {
+        HANDLE handles[2] = { m_stopEvent, overlapped.hEvent };
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+            CancelIo(pipe);
+            SetLastError(ERROR_OPERATION_ABORTED);
+            return false;
+        }
+
+        DWORD bytes = 0;
+        BOOL ok = GetOverlappedResult(pipe, &overlapped, &bytes, FALSE);
+        if (transferred) {
+            *transferred = bytes;
+        }
+        return ok != FALSE;
+    }
+
+    std::vector<HWND> Resolve(const std::wstring& target) override {
+        std::vector<HWND> windows;
+        bool tree = target.compare(0, 5, L"tree=") == 0;
+        if (tree || target.compare(0, 4, L"pid=") == 0) {
+            DWORD processId = wcstoul(target.c_str() + (tree ? 5 : 4), nullptr, 10);
+            for (const auto& window : FindWindowsForProcess(processId, tree)) {
+                windows.push_back(window.hwnd);
+            }
+        }
+        else if (HWND hwnd = ParseControlWindow(target); hwnd && IsWindow(hwnd)) {
+            windows.push_back(hwnd);
+        }
+        return windows;
+    }
+
+    void Force(const std::vector<ControlForce>& windows) override {
+        std::vector<WindowSizeRequest> requests;
+        for (const auto& window : windows) {
+            requests.push_back({ window.hwnd, window.width, window.height, false, {} });
+        }
+        ForceWindowSizes(requests);
+    }
+
+    bool Resize(HWND hwnd, int width, int height) override {
+        return ResizeTrackedWindow(hwnd, width, height);
+    }
+
+    bool Release(HWND hwnd) override {
+        return ReleaseWindow(hwnd);
+    }
+
+    size_t ReleaseAll() override {
+        return ReleaseAllWindows();
+    }
+
+    std::vector<std::wstring> List() override {
+        std::vector<std::wstring> lines;
+        for (const auto& pair : g_registry.Snapshot()) {
+            if (!pair.second.tracked) {
+                continue;
+            }
+            wchar_t title[TITLE_MAX_LENGTH] = { 0 };
+            GetWindowTextW(pair.first, title, TITLE_MAX_LENGTH);
+            DWORD processId = 0;
+            GetWindowThreadProcessId(pair.first, &processId);
+
+            lines.push_back(FormatControlWindow(pair.first) + L" " + std::to_wstring(pair.second.size.width) + L"x" +
+                std::to_wstring(pair.second.size.height) + L" " + std::to_wstring(processId) + L" " + title);
+        }
+        return lines;
+    }
+
+    const EnforcementStats& Stats() const override {
+        return g_stats;
+    }
+
+    void Shutdown() override {
+        SetEvent(m_shutdownEvent);
+    }
+
+    HANDLE m_stopEvent = NULL;
+    HANDLE m_shutdownEvent = NULL;
+    std::thread m_thread;
+};
+
+ControlServer g_controlServer;
+
+// Sends a request to the daemon and returns its reply; false when no daemon
+// is listening or the exchange broke off
+bool ExchangeControlRequest(const std::wstring& request, std::wstring& replyText) {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (int attempt = 0; attempt < 2 && pipe == INVALID_HANDLE_VALUE; ++attempt) {
+        pipe = CreateFileW(CONTROL_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE && (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(CONTROL_PIPE_NAME, 2000))) {
+            break;
+        }
+    }
+    if (pipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    SetNamedPipeHandleState(pipe, &mode, NULL, NULL);
+
+    std::string message = WideToUtf8(request);
+    DWORD written = 0;
+    bool ok = WriteFile(pipe, message.data(), static_cast<DWORD>(message.size()), &written, NULL) != FALSE;
+
+    std::string reply;
+    std::vector<char> buffer(CONTROL_BUFFER_SIZE);
+    while (ok) {
+        DWORD read = 0;
+        BOOL complete = ReadFile(pipe, buffer.data(), CONTROL_BUFFER_SIZE, &read, NULL);
+        if (!complete && GetLastError() != ERROR_MORE_DATA) {
+            ok = false;
+            break;
+        }
+        reply.append(buffer.data(), read);
+        if (complete) {
+            break;
+        }
+    }
+    CloseHandle(pipe);
+
+    replyText = Utf8ToWide(reply);
+    return ok;
+}
+
+bool SendControlRequest(const std::wstring& request) {
+    std::wstring reply;
+    bool ok = ExchangeControlRequest(request, reply);
+    if (!ok && reply.empty()) {
+        std::wcerr << L"Служба не запущена (канал управления недоступен)" << std::endl;
+        return false;
+    }
+
+    std::wcout << reply;
+    return ok;
+}
+
+// Fixed set of workers, each with its own task deque. A worker runs its own
+// tasks oldest first and, once it runs dry, steals the newest task of
+// another worker, so one slow task (a hung process, a window with thousands
+// of children) does not hold up the rest. Pending tasks finish before the
+// destructor returns.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t workerCount) : m_queues(std::max<size_t>(1, workerCount)) {
+        for (size_t i = 0; i < m_queues.size(); ++i) {
+            m_workers.emplace_back(&WorkStealingPool::Run, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Tasks are dealt round-robin, so consecutive tasks start in parallel
+    void Submit(std::function<void()> task) {
+        Queue& queue = m_queues[m_nextQueue++ % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending++;
+        }
+        m_wakeup.notify_one();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool Take(size_t self, std::function<void()>& task) {
+        for (size_t offset = 0; offset < m_queues.size(); ++offset) {
+            Queue& queue = m_queues[(self + offset) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+
+            if (offset == 0) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            else {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void Run(size_t self) {
+        std::function<void()> task;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeup.wait(lock, [this]() { return m_pending > 0 || m_stopping; });
+                if (m_pending == 0) {
+                    return;
+                }
+                m_pending--;
+            }
+
+            // Every reservation has a queued task behind it; another worker
+            // may just be holding the queue it sits in
+            while (!Take(self, task)) {
+                std::this_thread::yield();
+            }
+            task();
+        }
+    }
+
+    std::vector<Queue> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<size_t> m_nextQueue{ 0 };
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    size_t m_pending = 0;
+    bool m_stopping = false;
+};
+
+// Prints the window list as a pipeline: the enumerated rows are resolved
+// (process name, child windows) on a work-stealing pool and each row is
+// printed, in list order, as soon as it and every row above it are done.
+// The first rows appear without waiting for the slowest process.
+void PrintWindowList(const WindowSnapshot& windows) {
+    struct Row {
+        std::wstring processName;
+        size_t childCount = 0;
+    };
+
+    size_t count = windows.Size();
+    std::vector<Row> rows(count);
+    std::vector<uint8_t> ready(count, 0);
+    std::mutex mutex;
+    std::condition_variable rowDone;
+
+    // Names come from the process cache, which wmain is already refreshing;
+    // each process is looked up once per listing
+    std::unordered_map<DWORD, std::wstring> names;
+    auto processName = [&](DWORD processId) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = names.find(processId);
+            if (it != names.end()) {
+                return it->second;
+            }
+        }
+
+        std::wstring name = GetProcessNameById(processId);
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.emplace(processId, std::move(name)).first->second;
+    };
+
+    WorkStealingPool pool(std::min(8u, std::max(2u, std::thread::hardware_concurrency())));
+    for (size_t i = 0; i < count; ++i) {
+        pool.Submit([&, i]() {
+            Row row;
+            row.processName = processName(windows.ProcessId(i));
+            row.childCount = CountChildWindows(windows.Hwnd(i));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                rows[i] = std::move(row);
+                ready[i] = 1;
+            }
+            rowDone.notify_one();
+        });
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!ready[i]) {
+                // Show what is done before blocking on the next row
+                std::wcout.flush();
+                rowDone.wait(lock, [&]() { return ready[i] != 0; });
+            }
+        }
+
+        std::wstring_view title = windows.Title(i);
+        std::wcout << i + 1 << L"\t"
+            << title.substr(0, 40)
+            << (title.length() > 40 ? L"..." : L"") << L"\t"
+            << rows[i].processName << L" (" << windows.ProcessId(i) << L")\t"
+            << rows[i].childCount << L"\n";
+    }
+    std::wcout.flush();
+}
+
+// Buffered UTF-8 writer for the machine-readable listings. Rows are
+// formatted straight into a fixed buffer that goes to the handle with one
+// WriteFile when full, so nothing is allocated or flushed per row.
+class ListingWriter {
+public:
+    explicit ListingWriter(HANDLE output) : m_output(output) {}
+    ~ListingWriter() { Flush(); }
+
+    ListingWriter(const ListingWriter&) = delete;
+    ListingWriter& operator=(const ListingWriter&) = delete;
+
+    bool Failed() const { return m_failed; }
+
+    void Flush() {
+        if (m_used && !m_failed) {
+            DWORD written = 0;
+            m_failed = !WriteFile(m_output, m_buffer, static_cast<DWORD>(m_used), &written, NULL) || written != m_used;
+        }
+        m_used = 0;
+    }
+
+    ListingWriter& Raw(std::string_view text) {
+        if (sizeof(m_buffer) - m_used < text.size()) {
+            Flush();
+        }
+        if (text.size() <= sizeof(m_buffer)) {
+            memcpy(m_buffer + m_used, text.data(), text.size());
+            m_used += text.size();
+        }
+        return *this;
+    }
+
+    ListingWriter& Number(int64_t value) {
+        char digits[24];
+        auto result = std::to_chars(digits, std::end(digits), value);
+        return Raw(std::string_view(digits, result.ptr - digits));
+    }
+
+    ListingWriter& Hex(uint64_t value) {
+        char digits[24] = { '0', 'x' };
+        auto result = std::to_chars(digits + 2, std::end(digits), value, 16);
+        return Raw(std::string_view(digits, result.ptr - digits));
+    }
+
+    // JSON string literal, quotes included
+    ListingWriter& Json(std::wstring_view text) {
+        static const char HEX[] = "0123456789abcdef";
+        Put('"');
+        for (size_t i = 0; i < text.size(); ++i) {
+            wchar_t c = text[i];
+            if (c == L'"' || c == L'\\') {
+                Put('\\');
+                Put(static_cast<char>(c));
+            }
+            else if (c < 0x20) {
+                Raw("\\u00");
+                Put(HEX[c >> 4]);
+                Put(HEX[c & 0xF]);
+            }
+            else {
+                Utf8(text, i);
+            }
+        }
+        Put('"');
+        return *this;
+    }
+
+    // CSV field, quoted only when it has to be
+    ListingWriter& Csv(std::wstring_view text) {
+        bool quote = text.find_first_of(L",\"\r\n") != std::wstring_view::npos;
+        if (quote) {
+            Put('"');
+        }
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == L'"') {
+                Put('"');
+            }
+            Utf8(text, i);
+        }
+        if (quote) {
+            Put('"');
+        }
+        return *this;
+    }
+
+private:
+    void Put(char c) {
+        if (m_used == sizeof(m_buffer)) {
+            Flush();
+        }
+        m_buffer[m_used++] = c;
+    }
+
+    // Encodes text[i], consuming the low surrogate of a pair
+    void Utf8(std::wstring_view text, size_t& i) {
+        uint32_t c = text[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size() && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+        }
+        else if (c >= 0xD800 && c < 0xE000) {
+            c = 0xFFFD;
+        }
+
+        if (c < 0x80) {
+            Put(static_cast<char>(c));
+        }
+        else if (c < 0x800) {
+            Put(static_cast<char>(0xC0 | (c >> 6)));
+            Put(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+        else if (c < 0x10000) {
+            Put(static_cast<char>(0xE0 | (c >> 12)));
+            Put(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            Put(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+        else {
+            Put(static_cast<char>(0xF0 | (c >> 18)));
+            Put(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+            Put(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            Put(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+    }
+
+    HANDLE m_output;
+    char m_buffer[64 * 1024];
+    size_t m_used = 0;
+    bool m_failed = false;
+};
+
+enum class ListingFormat {
+    JsonLines,
+    Csv
+};
 
-            auto sizeIt = g_windowSizes.find(hwnd);
-            if (sizeIt != g_windowSizes.end()) {
-                auto& sizeData = sizeIt->second;
-                RECT& rc = params->rgrc[0];
-                rc.right = rc.left + sizeData.width;
-                rc.bottom = rc.top + sizeData.height - CUSTOM_TITLE_HEIGHT;
-            }
+bool ParseListingFormat(const std::wstring& text, ListingFormat& format) {
+    if (text == L"json") {
+        format = ListingFormat::JsonLines;
+        return true;
+    }
+    if (text == L"csv") {
+        format = ListingFormat::Csv;
+        return true;
+    }
+    return false;
+}
 
-            return result;
+// Windows whose size a running daemon holds, from its "list" reply
+std::unordered_map<HWND, SIZE> QueryEnforcedWindows() {
+    std::unordered_map<HWND, SIZE> enforced;
+    std::wstring reply;
+    if (!ExchangeControlRequest(L"list", reply) || reply.compare(0, 3, L"ok ") != 0) {
+        return enforced;
+    }
+
+    // Lines after the first: "<hwnd> <width>x<height> <pid> <title>"
+    for (size_t start = reply.find(L'\n'); start != std::wstring::npos; start = reply.find(L'\n', start)) {
+        const wchar_t* line = reply.c_str() + ++start;
+        wchar_t* end = nullptr;
+        unsigned long long hwnd = wcstoull(line, &end, 0);
+        int width = 0;
+        int height = 0;
+        if (hwnd && swscanf(end, L" %dx%d", &width, &height) == 2) {
+            enforced[reinterpret_cast<HWND>(static_cast<uintptr_t>(hwnd))] = { width, height };
         }
-        break;
     }
+    return enforced;
+}
 
-    case WM_NCPAINT: {
-        LRESULT result = CallWindowProc(originalProc, hwnd, msg, wParam, lParam);
+// "--list": one row per top-level window
+bool WriteWindowListing(ListingFormat format) {
+    g_inventory.Start();
+    g_processCache.Refresh();
 
-        DCWrapper hdc(hwnd, (HRGN)wParam);
-        if (hdc) {
-            DrawCustomTitleBar(hwnd, hdc);
-        }
+    auto snapshot = g_inventory.Snapshot();
+    const auto& windows = snapshot->windows;
+    auto enforced = QueryEnforcedWindows();
 
-        return result;
+    // Names are looked up once per process, not once per window
+    auto processes = g_processCache.All();
+    std::unordered_map<DWORD, std::wstring_view> processNames;
+    for (const auto& process : processes) {
+        processNames[process.processId] = process.name;
     }
 
-    case WM_NCLBUTTONDOWN: {
-        POINT cursorPos;
-        if (GetCursorPos(&cursorPos)) {
-            RECT windowRect;
-            if (GetWindowRect(hwnd, &windowRect)) {
-                if (cursorPos.y >= windowRect.top && cursorPos.y <= windowRect.top + CUSTOM_TITLE_HEIGHT) {
-                    g_isDragging = true;
-                    g_dragStart = cursorPos;
-                    SetCapture(hwnd);
-                    return 0;
-                }
+    ListingWriter out(GetStdHandle(STD_OUTPUT_HANDLE));
+    if (format == ListingFormat::Csv) {
+        out.Raw("hwnd,pid,process,class,title,x,y,width,height,visible,enforced,enforced_width,enforced_height\r\n");
+    }
+
+    for (size_t i = 0; i < windows.Size(); ++i) {
+        HWND hwnd = windows.Hwnd(i);
+        DWORD processId = windows.ProcessId(i);
+        auto name = processNames.find(processId);
+        std::wstring_view processName = name != processNames.end() ? name->second : std::wstring_view();
+
+        wchar_t className[TITLE_MAX_LENGTH];
+        int classLength = GetClassNameW(hwnd, className, TITLE_MAX_LENGTH);
+        std::wstring_view windowClass(className, std::max(0, classLength));
+
+        RECT rect = { 0, 0, 0, 0 };
+        GetWindowRect(hwnd, &rect);
+        bool visible = IsWindowVisible(hwnd) != FALSE;
+        auto target = enforced.find(hwnd);
+        bool isEnforced = target != enforced.end();
+
+        if (format == ListingFormat::JsonLines) {
+            out.Raw("{\"hwnd\":\"").Hex(reinterpret_cast<uintptr_t>(hwnd)).Raw("\",\"pid\":").Number(processId);
+            out.Raw(",\"process\":").Json(processName).Raw(",\"class\":").Json(windowClass);
+            out.Raw(",\"title\":").Json(windows.Title(i));
+            out.Raw(",\"x\":").Number(rect.left).Raw(",\"y\":").Number(rect.top);
+            out.Raw(",\"width\":").Number(rect.right - rect.left).Raw(",\"height\":").Number(rect.bottom - rect.top);
+            out.Raw(visible ? ",\"visible\":true" : ",\"visible\":false");
+            out.Raw(",\"enforced\":");
+            if (isEnforced) {
+                out.Raw("{\"width\":").Number(target->second.cx).Raw(",\"height\":").Number(target->second.cy).Raw("}");
+            }
+            else {
+                out.Raw("null");
+            }
+            out.Raw("}\n");
+        }
+        else {
+            out.Hex(reinterpret_cast<uintptr_t>(hwnd)).Raw(",").Number(processId).Raw(",");
+            out.Csv(processName).Raw(",").Csv(windowClass).Raw(",").Csv(windows.Title(i)).Raw(",");
+            out.Number(rect.left).Raw(",").Number(rect.top).Raw(",");
+            out.Number(rect.right - rect.left).Raw(",").Number(rect.bottom - rect.top).Raw(",");
+            out.Raw(visible ? "1," : "0,");
+            if (isEnforced) {
+                out.Raw("1,").Number(target->second.cx).Raw(",").Number(target->second.cy).Raw("\r\n");
+            }
+            else {
+                out.Raw("0,,\r\n");
             }
         }
-        break;
     }
 
-    case WM_MOUSEMOVE: {
-        if (g_isDragging) {
-            POINT cursorPos;
-            if (GetCursorPos(&cursorPos)) {
-                int deltaX = cursorPos.x - g_dragStart.x;
-                int deltaY = cursorPos.y - g_dragStart.y;
+    out.Flush();
+    return !out.Failed();
+}
 
-                g_dragStart = cursorPos;
+// "--list-processes": one row per process, with its top-level window count
+bool WriteProcessListing(ListingFormat format) {
+    g_inventory.Start();
+    g_processCache.Refresh();
 
-                RECT windowRect;
-                if (GetWindowRect(hwnd, &windowRect)) {
-                    SetWindowPos(hwnd, NULL,
-                        windowRect.left + deltaX,
-                        windowRect.top + deltaY,
-                        0, 0, SWP_NOSIZE | SWP_NOZORDER);
-                }
-                return 0;
-            }
-        }
-        break;
+    auto snapshot = g_inventory.Snapshot();
+    std::unordered_map<DWORD, size_t> windowCounts;
+    for (DWORD processId : snapshot->windows.ProcessIds()) {
+        windowCounts[processId]++;
     }
 
-    case WM_LBUTTONUP: {
-        if (g_isDragging) {
-            g_isDragging = false;
-            ReleaseCapture();
-            return 0;
-        }
-        break;
-    }
+    auto processes = g_processCache.All();
+    std::sort(processes.begin(), processes.end(),
+        [](const ProcessInfo& a, const ProcessInfo& b) { return a.processId < b.processId; });
 
-    case WM_NCHITTEST: {
-        LRESULT hit = CallWindowProc(originalProc, hwnd, msg, wParam, lParam);
+    ListingWriter out(GetStdHandle(STD_OUTPUT_HANDLE));
+    if (format == ListingFormat::Csv) {
+        out.Raw("pid,parent_pid,process,windows\r\n");
+    }
 
-        if (hit == HTCLIENT) {
-            POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
-            ScreenToClient(hwnd, &pt);
+    for (const auto& process : processes) {
+        auto count = windowCounts.find(process.processId);
+        int64_t windowCount = count != windowCounts.end() ? static_cast<int64_t>(count->second) : 0;
 
-            if (pt.y >= 0 && pt.y <= CUSTOM_TITLE_HEIGHT) {
-                return HTCAPTION;
-            }
+        if (format == ListingFormat::JsonLines) {
+            out.Raw("{\"pid\":").Number(process.processId).Raw(",\"parent_pid\":").Number(process.parentProcessId);
+            out.Raw(",\"process\":").Json(process.name).Raw(",\"windows\":").Number(windowCount).Raw("}\n");
+        }
+        else {
+            out.Number(process.processId).Raw(",").Number(process.parentProcessId).Raw(",");
+            out.Csv(process.name).Raw(",").Number(windowCount).Raw("\r\n");
         }
-
-        return hit;
-    }
     }
 
-    // Handle window size enforcement
-    auto sizeIt = g_windowSizes.find(hwnd);
-    if (sizeIt != g_windowSizes.end() &&
-        (msg == WM_GETMINMAXINFO || msg == WM_SIZE || msg == WM_SIZING ||
-            msg == WM_WINDOWPOSCHANGING || msg == WM_WINDOWPOSCHANGED)) {
-
-        auto& sizeData = sizeIt->second;
+    out.Flush();
+    return !out.Failed();
+}
 
-        if (msg == WM_GETMINMAXINFO) {
-            MINMAXINFO* info = reinterpret_cast<MINMAXINFO*>(lParam);
-            info->ptMinTrackSize.x = sizeData.width;
-            info->ptMinTrackSize.y = sizeData.height;
-            info->ptMaxTrackSize.x = sizeData.width;
-            info->ptMaxTrackSize.y = sizeData.height;
-            return 0;
+// Blocks until the event is signaled or a key is pressed in the console
+void WaitForShutdownOrKey(HANDLE shutdownEvent) {
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE handles[2] = { shutdownEvent, input };
+
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        // Focus and mouse records also signal the input handle; drain them
+        INPUT_RECORD record;
+        DWORD read = 0;
+        if (!ReadConsoleInputW(input, &record, 1, &read)) {
+            break;
         }
-        else if (msg == WM_WINDOWPOSCHANGING) {
-            WINDOWPOS* pos = reinterpret_cast<WINDOWPOS*>(lParam);
-            if (!(pos->flags & SWP_NOSIZE)) {
-                pos->cx = sizeData.width;
-                pos->cy = sizeData.height;
-            }
+        if (read && record.EventType == KEY_EVENT && record.Event.KeyEvent.bKeyDown) {
+            break;
         }
     }
-
-    return CallWindowProc(originalProc, hwnd, msg, wParam, lParam);
 }
 
-// Window size enforcement thread
-void ForceWindowSizeThread(HWND hwnd, int width, int height) {
-    // Use a local copy of data to minimize mutex contention
-    LONG style, exStyle, newStyle;
+// Clean up resources
+void CleanupResources() {
+    // Stop taking over new windows, then stop geometry sources so no
+    // correction races the restore below
+    g_controlServer.Stop();
+    g_ruleEngine.Stop();
+    g_eventSource.Stop();
+    g_pollingSource.Stop();
+    g_retrySource.Stop();
+    g_frameBackend.Stop();
+    g_inventory.Stop();
+    g_winEventThread.Stop();
+    g_ownership.Stop();
+
+    // Nothing can re-apply a size any more, so each window is restored once
+    ReleaseAllWindows();
 
-    {
-        std::lock_guard<std::mutex> lock(g_stateMutex);
-        g_windowSizes[hwnd] = { width, height, true };
+    std::lock_guard<std::mutex> lock(g_stateMutex);
 
-        // Get and modify styles
-        style = GetWindowLong(hwnd, GWL_STYLE);
-        exStyle = GetWindowLong(hwnd, GWL_EXSTYLE);
+    // Remove hooks
+    for (const auto& pair : g_messageHooks) {
+        UnhookWindowsHookEx(pair.second.messageHook);
+        UnhookWindowsHookEx(pair.second.cbtHook);
+    }
+    g_messageHooks.clear();
 
-        // Keep WS_CAPTION for title bar, remove resizing styles
-        newStyle = style & ~(WS_THICKFRAME | WS_MAXIMIZEBOX | WS_MINIMIZEBOX);
-        newStyle |= WS_CAPTION;
+    // Windows that were subclassed but never tracked
+    for (const auto& pair : g_registry.Snapshot()) {
+        if (pair.second.context && IsWindow(pair.first)) {
+            UnsubclassWindow(pair.first);
+        }
     }
 
-    // Apply new styles
-    SetWindowLong(hwnd, GWL_STYLE, newStyle);
-    SetWindowLong(hwnd, GWL_EXSTYLE, exStyle);
+    // Clear collections
+    g_registry.Clear();
+    g_titleBars.Clear();
+    g_ownership.Close();
 
-    // Update window appearance
-    SetWindowPos(hwnd, NULL, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE | SWP_NOZORDER | SWP_FRAMECHANGED);
+    // Last, so everything above still gets recorded
+    g_trace.Stop();
+    g_log.Stop();
+}
 
-    // Center window and set size
-    CenterWindowOnScreen(hwnd, width, height);
+// Lookup throughput of the registry against the previous mutex + std::map
+// under concurrent readers and a background writer
+void RunRegistryBenchmark() {
+    constexpr int WINDOW_COUNT = 256;
+    constexpr auto DURATION = std::chrono::seconds(1);
+    const unsigned readerCount = std::max(2u, std::thread::hardware_concurrency());
 
-    // Redraw window with new settings
-    RedrawWindow(hwnd, NULL, NULL, RDW_INVALIDATE | RDW_UPDATENOW | RDW_FRAME | RDW_ALLCHILDREN);
+    std::vector<HWND> windows;
+    for (int i = 0; i < WINDOW_COUNT; ++i) {
+        windows.push_back(reinterpret_cast<HWND>(static_cast<uintptr_t>(i + 1) * 8));
+    }
 
-    // Main enforcement loop
-    bool keepForcing = true;
-    while (keepForcing) {
-        RECT rect;
-        if (GetWindowRect(hwnd, &rect)) {
-            int currentWidth = rect.right - rect.left;
-            int currentHeight = rect.bottom - rect.top;
+    auto measure = [&](auto lookup, auto update) {
+        std::atomic<bool> running{ true };
+        std::atomic<uint64_t> totalLookups{ 0 };
+        std::vector<std::thread> threads;
+
+        for (unsigned t = 0; t < readerCount; ++t) {
+            threads.emplace_back([&, t]() {
+                uint64_t lookups = 0;
+                size_t index = t;
+                while (running.load(std::memory_order_relaxed)) {
+                    lookup(windows[index++ % windows.size()]);
+                    lookups++;
+                }
+                totalLookups += lookups;
+            });
+        }
 
-            if (currentWidth != width || currentHeight != height) {
-                SetWindowLong(hwnd, GWL_STYLE, newStyle);
-                SetWindowPos(hwnd, NULL, rect.left, rect.top, width, height,
-                    SWP_NOZORDER | SWP_NOACTIVATE | SWP_ASYNCWINDOWPOS);
+        threads.emplace_back([&]() {
+            size_t index = 0;
+            while (running.load(std::memory_order_relaxed)) {
+                update(windows[index++ % windows.size()]);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
+        });
+
+        std::this_thread::sleep_for(DURATION);
+        running = false;
+        for (auto& thread : threads) {
+            thread.join();
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(THREAD_REFRESH_MS));
+        return static_cast<double>(totalLookups) / std::chrono::duration<double>(DURATION).count();
+    };
 
-        // Check if we should stop enforcing
-        {
-            std::lock_guard<std::mutex> lock(g_stateMutex);
-            auto it = g_windowSizes.find(hwnd);
-            if (it == g_windowSizes.end() || !it->second.keepForcing) {
-                keepForcing = false;
-            }
-        }
+    std::mutex mapMutex;
+    std::map<HWND, WindowState> map;
+    WindowRegistry registry;
+    for (HWND hwnd : windows) {
+        map[hwnd].tracked = true;
+        registry.Update(hwnd, [](WindowState& state) { state.tracked = true; });
     }
 
-    // Restore original styles on exit
-    SetWindowLong(hwnd, GWL_STYLE, style);
-    SetWindowLong(hwnd, GWL_EXSTYLE, exStyle);
+    double mapRate = measure(
+        [&](HWND hwnd) {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            auto it = map.find(hwnd);
+            return it != map.end() && it->second.tracked;
+        },
+        [&](HWND hwnd) {
+            std::lock_guard<std::mutex> lock(mapMutex);
+            map[hwnd].size.width++;
+        });
+
+    double registryRate = measure(
+        [&](HWND hwnd) {
+            WindowState state;
+            return registry.Find(hwnd, state) && state.tracked;
+        },
+        [&](HWND hwnd) {
+            registry.Update(hwnd, [](WindowState& state) { state.size.width++; });
+        });
+
+    std::wcout << L"Потоков чтения: " << readerCount << L", окон: " << WINDOW_COUNT << std::endl;
+    std::wcout << L"mutex + std::map: " << mapRate / 1e6 << L" млн поисков/с" << std::endl;
+    std::wcout << L"WindowRegistry:   " << registryRate / 1e6 << L" млн поисков/с" << std::endl;
 }
 
-// Main public API
-bool ForceWindowSize(HWND hwnd, int width, int height) {
-    if (!hwnd || !IsWindow(hwnd)) {
-        std::wcout << L"Некорректный дескриптор окна!" << std::endl;
+// "--replay": the replay itself is in Core/Trace.h
+bool ReplayTraceFile(const std::wstring& path) {
+    FILE* file = _wfopen(path.c_str(), L"rb");
+    if (!file) {
+        std::wcerr << L"Не удалось открыть трассу: " << path << std::endl;
         return false;
     }
 
-    // Set up hooks and window proc
-    {
-        std::lock_guard<std::mutex> lock(g_stateMutex);
-
-        // Store original window procedure
-        WNDPROC oldWndProc = (WNDPROC)GetWindowLongPtr(hwnd, GWLP_WNDPROC);
-        g_originalWndProcs[hwnd] = oldWndProc;
-
-        // Set custom window procedure
-        SetWindowLongPtr(hwnd, GWLP_WNDPROC, (LONG_PTR)CustomWindowProc);
-
-        // Initialize hooks if not done yet
-        if (!g_messageHook) {
-            g_messageHook = SetWindowsHookEx(WH_GETMESSAGE, MessageProc, NULL, GetCurrentThreadId());
-            if (!g_messageHook) {
-                DebugLog(L"Не удалось установить хук WH_GETMESSAGE");
-            }
-        }
-
-        if (!g_cbtHook) {
-            g_cbtHook = SetWindowsHookEx(WH_CBT, CBTProc, NULL, GetCurrentThreadId());
-            if (!g_cbtHook) {
-                DebugLog(L"Не удалось установить хук WH_CBT");
-            }
-        }
+    std::vector<uint8_t> trace;
+    uint8_t chunk[64 * 1024];
+    for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+        trace.insert(trace.end(), chunk, chunk + read);
     }
+    fclose(file);
 
-    // Start enforcement thread
-    std::thread enforceThread(ForceWindowSizeThread, hwnd, width, height);
-    enforceThread.detach();
+    std::wstring report;
+    if (!ReplayTrace(trace, report)) {
+        std::wcerr << L"Файл не является трассой FRW: " << path << std::endl;
+        return false;
+    }
 
+    std::wcout << report;
     return true;
 }
 
-// Window enumeration
-BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam) {
-    if (!IsWindowVisible(hwnd) || GetWindowTextLengthW(hwnd) <= 0) {
-        return TRUE;
+// Upper bound of the bucket holding the given fraction of samples, in microseconds
+uint64_t HistogramPercentile(const uint64_t (&buckets)[STATS_BUCKETS], double fraction) {
+    uint64_t total = 0;
+    for (uint64_t count : buckets) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
     }
 
-    wchar_t title[TITLE_MAX_LENGTH] = { 0 };
-    GetWindowTextW(hwnd, title, TITLE_MAX_LENGTH);
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < STATS_BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen >= fraction * total) {
+            return 2ull << b;
+        }
+    }
+    return 2ull << (STATS_BUCKETS - 1);
+}
 
-    DWORD processId = 0;
-    GetWindowThreadProcessId(hwnd, &processId);
+// Finds another running instance of this program that publishes statistics
+DWORD FindStatsPublisher() {
+    g_processCache.Refresh();
+    std::wstring ownName = FoldTitle(GetProcessNameById(GetCurrentProcessId()));
 
-    auto windowList = reinterpret_cast<std::vector<WindowInfo>*>(lParam);
-    windowList->push_back({ hwnd, title, processId });
+    for (const auto& process : g_processCache.All()) {
+        if (process.processId == GetCurrentProcessId() || FoldTitle(process.name) != ownName) {
+            continue;
+        }
 
-    return TRUE;
+        HANDLE mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, SharedEnforcementStats::RegionName(process.processId).c_str());
+        if (mapping) {
+            CloseHandle(mapping);
+            return process.processId;
+        }
+    }
+    return 0;
 }
 
-std::vector<WindowInfo> EnumerateWindows() {
-    std::vector<WindowInfo> windowList;
-    EnumWindows(EnumWindowsProc, reinterpret_cast<LPARAM>(&windowList));
-    return windowList;
-}
+// "--stats": reads the statistics region of a running instance once a
+// second until a key is pressed or the instance exits
+void RunStatsViewer(DWORD processId) {
+    if (!processId) {
+        processId = FindStatsPublisher();
+    }
+    if (!processId) {
+        throw std::runtime_error("Не найден запущенный экземпляр программы со статистикой");
+    }
 
-HWND FindWindowByPartialTitle(const std::wstring& partialTitle) {
-    for (const auto& window : EnumerateWindows()) {
-        if (window.title.find(partialTitle) != std::wstring::npos) {
-            return window.hwnd;
+    HANDLE mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, SharedEnforcementStats::RegionName(processId).c_str());
+    if (!mapping) {
+        throw std::runtime_error("Не удалось открыть область статистики");
+    }
+
+    auto region = static_cast<const StatsRegion*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, sizeof(StatsRegion)));
+    if (!region || region->magic.load(std::memory_order_acquire) != STATS_MAGIC ||
+        region->layoutVersion != STATS_LAYOUT_VERSION) {
+        if (region) {
+            UnmapViewOfFile(region);
         }
+        CloseHandle(mapping);
+        throw std::runtime_error("Несовместимая версия области статистики");
     }
-    return NULL;
-}
 
-std::vector<WindowInfo> FindWindowsForProcess(DWORD processId) {
-    std::vector<WindowInfo> result;
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, processId);
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    const double ticksPerMicro = region->ticksPerSecond / 1e6;
+
+    std::wcout << L"Статистика процесса " << processId << L", любая клавиша — выход" << std::endl;
+    CONSOLE_SCREEN_BUFFER_INFO screen;
+    GetConsoleScreenBufferInfo(console, &screen);
+    COORD top = screen.dwCursorPosition;
 
-    for (const auto& window : EnumerateWindows()) {
-        if (window.processId == processId) {
-            result.push_back(window);
+    while (!_kbhit()) {
+        if (process && WaitForSingleObject(process, 0) == WAIT_OBJECT_0) {
+            std::wcout << L"\nПроцесс завершился" << std::endl;
+            break;
+        }
 
-            // Find child windows
-            std::vector<WindowInfo> childWindows;
-            FindChildWindows(window.hwnd, childWindows);
+        // Redraw in place; padding overwrites what the previous frame left
+        SetConsoleCursorPosition(console, top);
+        wchar_t line[512];
+        swprintf(line, std::size(line), L"Кадров с исправлениями: %llu, исправлений: %llu, в последнем кадре: %u, максимум: %u, объединено: %llu          ",
+            static_cast<unsigned long long>(region->frames.load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(region->frameCorrections.load(std::memory_order_relaxed)),
+            region->lastFrame.load(std::memory_order_relaxed), region->largestFrame.load(std::memory_order_relaxed),
+            static_cast<unsigned long long>(region->coalesced.load(std::memory_order_relaxed)));
+        std::wcout << line << std::endl;
+
+        swprintf(line, std::size(line), L"%-10ls %-24ls %-9ls %-8ls %8ls %8ls %8ls %8ls %8ls %6ls %9ls %8ls %10ls %10ls %12ls %12ls",
+            L"HWND", L"Окно", L"Размер", L"Режим", L"Провер.", L"Исправл.", L"Отлож.", L"Эхо", L"Огранич.", L"Стиль", L"Сообщ.", L"CPU,мс",
+            L"Дрейф50,мс", L"Дрейф99,мс", L"Задерж50,мкс", L"Задерж99,мкс");
+        std::wcout << line << std::endl;
+
+        uint32_t windowCount = std::min(region->windowCount.load(std::memory_order_acquire), STATS_MAX_WINDOWS);
+        uint32_t shown = 0;
+        for (uint32_t row = 0; row < windowCount; ++row) {
+            // Free rows wait for the next tracked window
+            if (!region->windows[row].hwnd) {
+                continue;
+            }
 
-            for (const auto& childWindow : childWindows) {
-                if (childWindow.processId == processId) {
-                    result.push_back(childWindow);
+            uint64_t counters[STAT_COUNTER_COUNT] = {};
+            uint64_t histograms[HIST_COUNT][STATS_BUCKETS] = {};
+            for (uint32_t slot = 0; slot < STATS_SLOTS; ++slot) {
+                const StatsCells& cells = region->cells[slot][row];
+                for (uint32_t c = 0; c < STAT_COUNTER_COUNT; ++c) {
+                    counters[c] += cells.counters[c].load(std::memory_order_relaxed);
+                }
+                for (uint32_t h = 0; h < HIST_COUNT; ++h) {
+                    for (uint32_t b = 0; b < STATS_BUCKETS; ++b) {
+                        histograms[h][b] += cells.histograms[h][b].load(std::memory_order_relaxed);
+                    }
                 }
             }
+
+            const StatsWindowRow& window = region->windows[row];
+            std::wstring title(window.title, wcsnlen(window.title, std::size(window.title)));
+            std::wstring size = std::to_wstring(window.width) + L"x" + std::to_wstring(window.height);
+
+            static const wchar_t* const MODES[] = { L"обычный", L"замедл.", L"огранич." };
+            uint32_t mode = std::min<uint32_t>(window.dampingMode.load(std::memory_order_relaxed), 2);
+
+            swprintf(line, std::size(line), L"%-10llx %-24.24ls %-9ls %-8ls %8llu %8llu %8llu %8llu %8llu %6llu %9llu %8.1f %10llu %10llu %12llu %12llu",
+                static_cast<unsigned long long>(window.hwnd), title.c_str(), size.c_str(), MODES[mode],
+                static_cast<unsigned long long>(counters[STAT_CHECKS]),
+                static_cast<unsigned long long>(counters[STAT_CORRECTIONS]),
+                static_cast<unsigned long long>(counters[STAT_DEFERRED]),
+                static_cast<unsigned long long>(counters[STAT_ECHOES]),
+                static_cast<unsigned long long>(counters[STAT_CLAMPS]),
+                static_cast<unsigned long long>(counters[STAT_STYLE_REAPPLIES]),
+                static_cast<unsigned long long>(counters[STAT_HOOK_MESSAGES]),
+                counters[STAT_ENFORCE_TICKS] / ticksPerMicro / 1000.0,
+                static_cast<unsigned long long>(HistogramPercentile(histograms[HIST_DRIFT], 0.50) / 1000),
+                static_cast<unsigned long long>(HistogramPercentile(histograms[HIST_DRIFT], 0.99) / 1000),
+                static_cast<unsigned long long>(HistogramPercentile(histograms[HIST_CORRECTION_LATENCY], 0.50)),
+                static_cast<unsigned long long>(HistogramPercentile(histograms[HIST_CORRECTION_LATENCY], 0.99)));
+            std::wcout << line << std::endl;
+            shown++;
+        }
+
+        const StatsCells& retired = region->retired;
+        swprintf(line, std::size(line), L"Отпущенные окна: проверок %llu, исправлений %llu, отложено %llu, эхо %llu, ограничений %llu          ",
+            static_cast<unsigned long long>(retired.counters[STAT_CHECKS].load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(retired.counters[STAT_CORRECTIONS].load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(retired.counters[STAT_DEFERRED].load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(retired.counters[STAT_ECHOES].load(std::memory_order_relaxed)),
+            static_cast<unsigned long long>(retired.counters[STAT_CLAMPS].load(std::memory_order_relaxed)));
+        std::wcout << line << std::endl;
+
+        // Blank out the lines of windows released since the last frame
+        for (; shown < windowCount; ++shown) {
+            std::wcout << std::wstring(160, L' ') << std::endl;
         }
+
+        Sleep(1000);
     }
 
-    return result;
+    if (_kbhit()) {
+        _getwch();
+    }
+    if (process) {
+        CloseHandle(process);
+    }
+    UnmapViewOfFile(region);
+    CloseHandle(mapping);
 }
 
-bool ForceWindowSizeForAllProcessWindows(DWORD processId, int width, int height) {
-    bool result = false;
-
-    for (const auto& window : FindWindowsForProcess(processId)) {
-        if (ForceWindowSize(window.hwnd, width, height)) {
-            result = true;
-            DebugLog(L"Установлен размер для окна: " + window.title);
+// Main application
+int wmain(int argc, wchar_t* argv[]) {
+    std::wstring saveLayoutPath;
+    std::wstring applyLayoutPath;
+    std::wstring rulesPath;
+    DesktopBenchmarkOptions benchmark;
+    std::wstring benchmarkPath;  // Console when empty
+    bool runBenchmark = false;
+    bool runDaemon = false;
+    bool restoreJournal = false;
+    std::wstring logPath;
+    std::wstring tracePath;
+    bool listWindows = false;
+    bool listProcesses = false;
+    ListingFormat listingFormat = ListingFormat::JsonLines;
+
+    for (int i = 1; i < argc; ++i) {
+        std::wstring arg = argv[i];
+        if (arg == L"--poll") {
+            g_strategy = EnforcementStrategy::Polling;
+        }
+        else if (arg == L"--bench-registry") {
+            SetupConsoleForCyrillic();
+            RunRegistryBenchmark();
+            return 0;
+        }
+        else if (arg == L"--save-layout" && i + 1 < argc) {
+            saveLayoutPath = argv[++i];
+        }
+        else if (arg == L"--apply-layout" && i + 1 < argc) {
+            applyLayoutPath = argv[++i];
+        }
+        else if (arg == L"--rules" && i + 1 < argc) {
+            rulesPath = argv[++i];
+        }
+        else if (arg == L"--stats") {
+            SetupConsoleForCyrillic();
+            DWORD processId = i + 1 < argc ? wcstoul(argv[i + 1], nullptr, 10) : 0;
+            try {
+                RunStatsViewer(processId);
+            }
+            catch (const std::exception& ex) {
+                std::wcerr << L"Ошибка: " << ex.what() << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+        else if (arg == L"--send" && i + 1 < argc) {
+            SetupConsoleForCyrillic();
+            std::wstring request;
+            while (++i < argc) {
+                request += std::wstring(argv[i]) + L" ";
+            }
+            return SendControlRequest(request) ? 0 : 1;
+        }
+        else if ((arg == L"--list" || arg == L"--list-processes") && i + 1 < argc) {
+            if (!ParseListingFormat(argv[++i], listingFormat)) {
+                SetupConsoleForCyrillic();
+                std::wcerr << L"Неизвестный формат списка: " << argv[i] << L" (json или csv)" << std::endl;
+                return 1;
+            }
+            (arg == L"--list" ? listWindows : listProcesses) = true;
+        }
+        else if (arg == L"--on-conflict" && i + 1 < argc) {
+            if (!ParseConflictPolicy(argv[++i], g_conflictPolicy)) {
+                SetupConsoleForCyrillic();
+                std::wcerr << L"Неизвестное действие при конфликте: " << argv[i] << L" (defer, takeover или chain)" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == L"--log" && i + 1 < argc) {
+            logPath = argv[++i];
+        }
+        else if (arg == L"--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        }
+        else if (arg == L"--replay" && i + 1 < argc) {
+            SetupConsoleForCyrillic();
+            return ReplayTraceFile(argv[i + 1]) ? 0 : 1;
+        }
+        else if (arg == L"--decode-log" && i + 1 < argc) {
+            SetupConsoleForCyrillic();
+            return DecodeLogFile(argv[i + 1]) ? 0 : 1;
+        }
+        else if (arg == L"--restore") {
+            restoreJournal = true;
+        }
+        else if (arg == L"--daemon") {
+            runDaemon = true;
+        }
+        else if (arg == L"--bench") {
+            runBenchmark = true;
+        }
+        else if (arg == L"--bench-windows" && i + 1 < argc) {
+            benchmark.windowCount = std::max(1, _wtoi(argv[++i]));
+        }
+        else if (arg == L"--bench-hostile" && i + 1 < argc) {
+            benchmark.hostileCount = std::max(0, _wtoi(argv[++i]));
+        }
+        else if (arg == L"--bench-seconds" && i + 1 < argc) {
+            benchmark.seconds = std::max(1, _wtoi(argv[++i]));
+        }
+        else if (arg == L"--bench-out" && i + 1 < argc) {
+            benchmarkPath = argv[++i];
         }
     }
 
-    return result;
-}
+    // Setup console for Unicode output
+    SetupConsoleForCyrillic();
 
-// Clean up resources
-void CleanupResources() {
-    std::lock_guard<std::mutex> lock(g_stateMutex);
+    // Listings own stdout; messages go to stderr
+    if (!g_log.Start(logPath, listWindows || listProcesses ? std::wcerr : std::wcout)) {
+        std::wcerr << L"Не удалось создать файл журнала: " << logPath << std::endl;
+        return 1;
+    }
+    if (!tracePath.empty() && !g_trace.Start(tracePath)) {
+        std::wcerr << L"Не удалось создать файл трассы: " << tracePath << std::endl;
+        return 1;
+    }
 
-    // Stop all enforcement threads
-    for (auto& pair : g_windowSizes) {
-        pair.second.keepForcing = false;
+    if (runBenchmark) {
+        std::wstring report = RunDesktopBenchmark(benchmark);
+        if (benchmarkPath.empty()) {
+            std::wcout << report;
+            return 0;
+        }
+
+        FILE* file = _wfopen(benchmarkPath.c_str(), L"w, ccs=UTF-8");
+        if (!file) {
+            std::wcerr << L"Не удалось открыть файл для результатов: " << benchmarkPath << std::endl;
+            return 1;
+        }
+        fputws(report.c_str(), file);
+        fclose(file);
+        return 0;
     }
 
-    // Remove hooks
-    if (g_messageHook) {
-        UnhookWindowsHookEx(g_messageHook);
-        g_messageHook = NULL;
+    if (!saveLayoutPath.empty()) {
+        g_inventory.Start();
+        g_processCache.Refresh();
+
+        bool saved = SaveLayout(saveLayoutPath);
+        std::wcout << (saved ? L"Раскладка окон сохранена: " : L"Не удалось сохранить раскладку: ")
+            << saveLayoutPath << std::endl;
+
+        CleanupResources();
+        return saved ? 0 : 1;
     }
 
-    if (g_cbtHook) {
-        UnhookWindowsHookEx(g_cbtHook);
-        g_cbtHook = NULL;
+    if (listWindows || listProcesses) {
+        bool written = listWindows ? WriteWindowListing(listingFormat) : WriteProcessListing(listingFormat);
+        CleanupResources();
+        return written ? 0 : 1;
     }
 
-    // Wait for threads to finish
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!g_stats.Open()) {
+        Log<LOG_WARNING>(L"Не удалось создать область статистики, --stats будет недоступен");
+    }
 
-    // Restore original window procedures
-    for (const auto& pair : g_originalWndProcs) {
-        HWND hwnd = pair.first;
-        WNDPROC proc = pair.second;
+    bool journalOpen = g_journal.Open();
 
-        if (IsWindow(hwnd)) {
-            SetWindowLongPtr(hwnd, GWLP_WNDPROC, (LONG_PTR)proc);
-        }
+    if (!g_ownership.Open()) {
+        Log<LOG_WARNING>(L"Не удалось открыть таблицу окон других экземпляров, они не будут согласованы");
     }
 
-    // Clear collections
-    g_originalWndProcs.clear();
-    g_windowSizes.clear();
-}
-
-// Main application
-int main() {
     try {
         // Increase process priority
         SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
 
-        // Setup console for Unicode output
-        SetupConsoleForCyrillic();
-
         std::wcout << L"Программа для принудительного изменения размера окна" << std::endl;
         std::wcout << L"-----------------------------------------------------" << std::endl;
 
+        if (!journalOpen) {
+            // Another instance owns the journal; its windows are not ours to touch
+            Log<LOG_WARNING>(L"Журнал окон занят другим экземпляром, восстановление после сбоя отключено");
+        }
+        else if (size_t recovered = RecoverJournal(restoreJournal)) {
+            std::wcout << (restoreJournal ? L"Восстановлено окон из журнала: " : L"Возобновлено удержание окон из журнала: ")
+                << recovered << std::endl;
+        }
+
+        if (restoreJournal) {
+            CleanupResources();
+            return journalOpen ? 0 : 1;
+        }
+
+        if (runDaemon) {
+            g_inventory.Start();
+            g_processCache.Refresh();
+
+            if (!g_controlServer.Start()) {
+                throw std::runtime_error("Не удалось запустить канал управления");
+            }
+            if (!rulesPath.empty() && !g_ruleEngine.Start(rulesPath)) {
+                throw std::runtime_error("Не удалось запустить применение правил");
+            }
+
+            std::wcout << L"Служба запущена, канал управления: " << CONTROL_PIPE_NAME << std::endl;
+            std::wcout << L"Для остановки нажмите любую клавишу или отправьте команду shutdown" << std::endl;
+            WaitForShutdownOrKey(g_controlServer.ShutdownEvent());
+
+            CleanupResources();
+            return 0;
+        }
+
+        if (!rulesPath.empty()) {
+            g_inventory.Start();
+            g_processCache.Refresh();
+
+            if (!g_ruleEngine.Start(rulesPath)) {
+                throw std::runtime_error("Не удалось запустить применение правил");
+            }
+
+            std::wcout << L"Загружено правил: " << g_ruleEngine.RuleCount() << std::endl;
+            std::wcout << L"Подходящие окна получают заданный размер при появлении, файл правил перечитывается при изменении." << std::endl;
+            std::wcout << L"Для выхода и восстановления исходного поведения окон нажмите любую клавишу..." << std::endl;
+            std::wcin.get();
+
+            CleanupResources();
+            return 0;
+        }
+
+        if (!applyLayoutPath.empty()) {
+            auto entries = LoadLayout(applyLayoutPath);
+            if (entries.empty()) {
+                throw std::runtime_error("Не удалось загрузить раскладку окон");
+            }
+
+            g_inventory.Start();
+            g_processCache.Refresh();
+
+            size_t applied = ApplyLayout(entries);
+            std::wcout << L"Применено окон из раскладки: " << applied << L" из " << entries.size() << std::endl;
+
+            if (applied > 0) {
+                std::wcout << L"\nПрограмма активно поддерживает указанный размер окон." << std::endl;
+                std::wcout << L"Для выхода и восстановления исходного поведения окон нажмите любую клавишу..." << std::endl;
+            }
+            else {
+                std::wcout << L"\nНажмите любую клавишу для выхода..." << std::endl;
+            }
+            std::wcin.get();
+
+            CleanupResources();
+            return 0;
+        }
+
         // List all available windows
         std::wcout << L"Список доступных окон:" << std::endl;
-        std::wcout << L"ID\tНазвание окна\tПроцесс" << std::endl;
+        std::wcout << L"ID\tНазвание окна\tПроцесс\tДочерних окон" << std::endl;
         std::wcout << L"-----------------------------------------------------" << std::endl;
 
-        auto windows = EnumerateWindows();
-        for (size_t i = 0; i < windows.size(); ++i) {
-            std::wstring processName = GetProcessNameById(windows[i].processId);
-            std::wcout << i + 1 << L"\t"
-                << windows[i].title.substr(0, 40)
-                << (windows[i].title.length() > 40 ? L"..." : L"") << L"\t"
-                << processName << L" (" << windows[i].processId << L")" << std::endl;
-        }
+        // The full process snapshot is only needed once a choice is made
+        auto processesRefreshed = std::async(std::launch::async, []() { g_processCache.Refresh(); });
+
+        g_inventory.Start();
+        auto snapshot = g_inventory.Snapshot();
+        const auto& windows = snapshot->windows;
+        PrintWindowList(windows);
 
         // Window or process selection
         int windowIndex;
@@ -629,14 +5193,15 @@ int main() {
         HWND targetWindow = NULL;
         DWORD targetProcessId = 0;
         bool forceAllWindows = false;
+        bool includeChildProcesses = false;
 
         if (windowIndex == -1) {
             // Process selection
             std::map<DWORD, std::wstring> processes;
 
-            for (const auto& window : windows) {
-                if (processes.find(window.processId) == processes.end()) {
-                    processes[window.processId] = GetProcessNameById(window.processId);
+            for (DWORD processId : windows.ProcessIds()) {
+                if (processes.find(processId) == processes.end()) {
+                    processes[processId] = GetProcessNameById(processId);
                 }
             }
 
@@ -646,7 +5211,7 @@ int main() {
 
             int i = 1;
             for (const auto& proc : processes) {
-                std::wcout << i << L"\t" << proc.second << L"\t" << proc.first << std::endl;
+                std::wcout << i << L"\t" << proc.second << L"\t" << proc.first << L"\n";
                 i++;
             }
 
@@ -661,6 +5226,11 @@ int main() {
                 forceAllWindows = true;
 
                 std::wcout << L"Выбран процесс: " << it->second << L" (PID: " << targetProcessId << L")" << std::endl;
+
+                int children = 0;
+                std::wcout << L"Включить окна дочерних процессов? (1 - да, 0 - нет): ";
+                std::wcin >> children;
+                includeChildProcesses = children == 1;
             }
             else {
                 throw std::runtime_error("Некорректный номер процесса");
@@ -673,16 +5243,38 @@ int main() {
             std::wcout << L"Введите часть заголовка окна для поиска: ";
             std::getline(std::wcin, searchTitle);
 
-            targetWindow = FindWindowByPartialTitle(searchTitle);
-            if (!targetWindow) {
+            auto matches = FindWindowsByTitle(searchTitle);
+            if (matches.empty()) {
                 throw std::runtime_error("Окно с заданным заголовком не найдено");
             }
 
+            if (matches.size() == 1) {
+                targetWindow = matches[0].hwnd;
+            }
+            else {
+                std::wcout << L"Найдено окон: " << matches.size() << std::endl;
+                for (size_t i = 0; i < matches.size(); ++i) {
+                    wchar_t title[TITLE_MAX_LENGTH] = { 0 };
+                    GetWindowTextW(matches[i].hwnd, title, TITLE_MAX_LENGTH);
+                    std::wcout << i + 1 << L"\t" << title
+                        << (matches[i].kind == TitleMatchKind::Fuzzy ? L"\t(похожее)" : L"") << std::endl;
+                }
+
+                int matchIndex;
+                std::wcout << L"\nВведите номер окна: ";
+                std::wcin >> matchIndex;
+
+                if (matchIndex < 1 || matchIndex > static_cast<int>(matches.size())) {
+                    throw std::runtime_error("Некорректный номер окна");
+                }
+                targetWindow = matches[matchIndex - 1].hwnd;
+            }
+
             GetWindowThreadProcessId(targetWindow, &targetProcessId);
         }
-        else if (windowIndex >= 1 && windowIndex <= static_cast<int>(windows.size())) {
-            targetWindow = windows[windowIndex - 1].hwnd;
-            targetProcessId = windows[windowIndex - 1].processId;
+        else if (windowIndex >= 1 && windowIndex <= static_cast<int>(windows.Size())) {
+            targetWindow = windows.Hwnd(windowIndex - 1);
+            targetProcessId = windows.ProcessId(windowIndex - 1);
         }
         else {
             throw std::runtime_error("Некорректный номер окна");
@@ -702,7 +5294,7 @@ int main() {
         bool success = false;
 
         if (forceAllWindows) {
-            success = ForceWindowSizeForAllProcessWindows(targetProcessId, newWidth, newHeight);
+            success = ForceWindowSizeForAllProcessWindows(targetProcessId, newWidth, newHeight, includeChildProcesses);
             if (success) {
                 std::wcout << L"Размер всех окон процесса изменен на " << newWidth << L"x" << newHeight << std::endl;
             }
@@ -735,8 +5327,6 @@ int main() {
             std::wcout << L"Для выхода и восстановления исходного поведения окна нажмите любую клавишу..." << std::endl;
             std::wcin.ignore();
             std::wcin.get();
-
-            CleanupResources();
         }
         else {
             std::wcout << L"\nНажмите любую клавишу для выхода..." << std::endl;
@@ -751,5 +5341,6 @@ int main() {
         std::wcin.get();
     }
 
+    CleanupResources();
     return 0;
 }
\ No newline at end of file
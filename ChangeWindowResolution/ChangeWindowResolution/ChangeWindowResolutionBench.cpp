@@ -0,0 +1,91 @@
+﻿// Benchmarks and replays of the portable core without a window system, for
+// comparing builds on machines that have no Windows desktop to run on
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Core/DesktopBenchmark.h"
+#include "Core/Trace.h"
+#include "Core/Utf8.h"
+
+// Reports are wide strings in the Windows build; the console here is UTF-8
+bool WriteReport(const std::wstring& report, const std::string& path) {
+    std::string utf8 = WideToUtf8(report);
+    if (path.empty()) {
+        fwrite(utf8.data(), 1, utf8.size(), stdout);
+        fflush(stdout);
+        return true;
+    }
+
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Не удалось открыть файл для результатов: " << path << std::endl;
+        return false;
+    }
+    fwrite(utf8.data(), 1, utf8.size(), file);
+    fclose(file);
+    return true;
+}
+
+// "--replay": traces recorded by the Windows build with "--trace"
+bool ReplayTraceFile(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << "Не удалось открыть трассу: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> trace;
+    uint8_t chunk[64 * 1024];
+    for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+        trace.insert(trace.end(), chunk, chunk + read);
+    }
+    fclose(file);
+
+    std::wstring report;
+    if (!ReplayTrace(trace, report)) {
+        std::cerr << "Файл не является трассой FRW: " << path << std::endl;
+        return false;
+    }
+    return WriteReport(report, std::string());
+}
+
+int main(int argc, char* argv[]) {
+    DesktopBenchmarkOptions benchmark;
+    std::string benchmarkPath;  // Console when empty
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bench") {
+            // The default action; accepted for command lines shared with Windows
+        }
+        else if (arg == "--bench-windows" && i + 1 < argc) {
+            benchmark.windowCount = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--bench-hostile" && i + 1 < argc) {
+            benchmark.hostileCount = std::max(0, atoi(argv[++i]));
+        }
+        else if (arg == "--bench-seconds" && i + 1 < argc) {
+            benchmark.seconds = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--bench-out" && i + 1 < argc) {
+            benchmarkPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            return ReplayTraceFile(argv[i + 1]) ? 0 : 1;
+        }
+        else {
+            std::cerr << "Неизвестный параметр: " << arg << std::endl;
+            std::cerr << "Использование: frw-bench [--bench] [--bench-windows N] [--bench-hostile N] "
+                "[--bench-seconds N] [--bench-out <файл>] | --replay <файл>" << std::endl;
+            return 1;
+        }
+    }
+
+    return WriteReport(RunDesktopBenchmark(benchmark), benchmarkPath) ? 0 : 1;
+}
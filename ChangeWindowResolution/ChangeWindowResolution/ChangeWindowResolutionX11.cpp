@@ -0,0 +1,296 @@
+﻿// Linux port of the enforcement core for X11 desktops, built on XCB:
+//   g++ -std=c++17 -O2 ChangeWindowResolutionX11.cpp -lxcb -pthread -o frw-x11
+// Windows come from the window manager's _NET_CLIENT_LIST and are mapped to
+// processes through _NET_WM_PID. A tracked window gets min = max size hints
+// (what WM_GETMINMAXINFO does on Windows); a ConfigureNotify that reports
+// another size goes to the enforcement engine of the Windows build, with its
+// damping of resize wars. All windows share one connection and one event
+// thread; requests are sent in batches and replies collected
+// afterwards, so N windows cost one round trip, not N.
+#include <xcb/xcb.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <iterator>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "X11Enforcer.h"
+
+// Helper Functions
+xcb_window_t ParseWindow(const char* text) {
+    char* end = nullptr;
+    unsigned long value = strtoul(text, &end, 0);
+    return end && *end == '\0' ? static_cast<xcb_window_t>(value) : static_cast<xcb_window_t>(XCB_WINDOW_NONE);
+}
+
+void PrintWindowList(const std::vector<X11WindowInfo>& windows) {
+    std::string lines;
+    char number[48];
+    for (size_t i = 0; i < windows.size(); ++i) {
+        const X11WindowInfo& window = windows[i];
+        snprintf(number, sizeof(number), "%zu\t0x%08x\t", i + 1, window.window);
+        lines += number;
+        lines += window.title.substr(0, 60);
+        lines += "\t";
+        lines += window.className;
+        lines += " (" + std::to_string(window.processId) + ")\n";
+    }
+    std::cout << lines << std::flush;
+}
+
+// Waits for Enter, then releases everything
+void HoldUntilEnter(X11Enforcer& enforcer) {
+    std::cout << "\nПрограмма активно поддерживает указанный размер окон." << std::endl;
+    std::cout << "Для выхода и восстановления исходного поведения окон нажмите Enter..." << std::endl;
+    std::string line;
+    std::getline(std::cin, line);
+
+    auto counters = enforcer.Counters();
+    std::cout << "Проверок: " << counters.checks << ", исправлений: " << counters.corrections
+        << ", оставлено ограничениям размера: " << counters.deferred << std::endl;
+    enforcer.ReleaseAll();
+}
+
+// "--bench": creates windows of its own on the display (an Xvfb server is
+// enough), enforces them and lets a second connection resize them as a
+// hostile application would. Output matches --bench of the Windows build.
+bool RunBenchmark(X11Enforcer& enforcer, int windowCount, int seconds) {
+    X11Connection application;
+    if (!application.Open()) {
+        return false;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    constexpr int WIDTH = 400;
+    constexpr int HEIGHT = 300;
+    xcb_connection_t* c = application.Get();
+
+    std::vector<xcb_window_t> windows(windowCount);
+    uint32_t eventMask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+    for (auto& window : windows) {
+        window = xcb_generate_id(c);
+        xcb_create_window(c, XCB_COPY_FROM_PARENT, window, application.Screen()->root, 0, 0, 640, 480, 0,
+            XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, &eventMask);
+        xcb_map_window(c, window);
+    }
+    // A round trip, so the windows exist before the enforcer asks about them
+    free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), nullptr));
+
+    std::vector<X11SizeRequest> requests;
+    for (xcb_window_t window : windows) {
+        requests.push_back({ window, WIDTH, HEIGHT });
+    }
+    auto forceStart = Clock::now();
+    size_t forced = enforcer.Force(requests);
+    double forceMs = std::chrono::duration<double, std::milli>(Clock::now() - forceStart).count();
+
+    // The application side sees its windows drift and come back
+    std::mutex mutex;
+    std::unordered_map<xcb_window_t, Clock::time_point> drifted;
+    std::vector<double> latencies;
+    std::atomic<bool> running{ true };
+    std::thread observer([&]() {
+        while (xcb_generic_event_t* event = xcb_wait_for_event(c)) {
+            if ((event->response_type & ~0x80) == XCB_CONFIGURE_NOTIFY) {
+                auto configure = reinterpret_cast<xcb_configure_notify_event_t*>(event);
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = drifted.find(configure->window);
+                if (it != drifted.end() && configure->width == WIDTH && configure->height == HEIGHT) {
+                    latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - it->second).count());
+                    drifted.erase(it);
+                }
+            }
+            else if ((event->response_type & ~0x80) == XCB_CLIENT_MESSAGE && !running) {
+                free(event);
+                break;
+            }
+            free(event);
+        }
+    });
+
+    std::mt19937 random(12345);
+    uint64_t drifts = 0;
+    auto start = Clock::now();
+    while (Clock::now() - start < std::chrono::seconds(seconds)) {
+        xcb_window_t window = windows[random() % windows.size()];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (drifted.count(window)) {
+                continue;
+            }
+            drifted[window] = Clock::now();
+        }
+
+        uint32_t size[2] = { 640, 480 };
+        xcb_configure_window(c, window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, size);
+        xcb_flush(c);
+        drifts++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Let the last corrections land, then stop the observer
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    running = false;
+    xcb_client_message_event_t message = {};
+    message.response_type = XCB_CLIENT_MESSAGE;
+    message.format = 32;
+    message.window = windows[0];
+    xcb_send_event(c, 0, windows[0], XCB_EVENT_MASK_STRUCTURE_NOTIFY, reinterpret_cast<const char*>(&message));
+    xcb_flush(c);
+    observer.join();
+
+    auto counters = enforcer.Counters();
+    enforcer.ReleaseAll();
+    for (xcb_window_t window : windows) {
+        xcb_destroy_window(c, window);
+    }
+    xcb_flush(c);
+
+    auto percentile = [&](double fraction) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        size_t index = std::min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()));
+        std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+        return latencies[index];
+    };
+
+    auto add = [](const char* metric, double value, const char* unit) {
+        printf("%s\t%.3f\t%s\n", metric, value, unit);
+    };
+    add("config.windows", static_cast<double>(windowCount), "count");
+    add("x11.force_batch", forceMs, "ms");
+    add("x11.forced", static_cast<double>(forced), "count");
+    add("x11.drifts", static_cast<double>(drifts), "count");
+    add("x11.checks", static_cast<double>(counters.checks), "count");
+    add("x11.corrections", static_cast<double>(counters.corrections), "count");
+    add("x11.uncorrected", static_cast<double>(drifted.size()), "count");
+    add("x11.p50", percentile(0.50), "us");
+    add("x11.p90", percentile(0.90), "us");
+    add("x11.p99", percentile(0.99), "us");
+    add("x11.max", percentile(1.0), "us");
+    fflush(stdout);
+    return true;
+}
+
+// Main application
+int main(int argc, char* argv[]) {
+    X11Connection connection;
+    if (!connection.Open()) {
+        std::cerr << "Не удалось подключиться к X-серверу (проверьте DISPLAY)" << std::endl;
+        return 1;
+    }
+
+    // The event thread runs only in the modes that enforce
+    X11Enforcer enforcer(connection);
+
+    std::vector<X11SizeRequest> requests;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--list") {
+            PrintWindowList(connection.EnumerateWindows());
+            return 0;
+        }
+        else if (arg == "--bench") {
+            int windowCount = i + 1 < argc ? std::max(1, atoi(argv[i + 1])) : 200;
+            int seconds = i + 2 < argc ? std::max(1, atoi(argv[i + 2])) : 5;
+            enforcer.Start();
+            return RunBenchmark(enforcer, windowCount, seconds) ? 0 : 1;
+        }
+        else if (arg == "--force" && i + 3 < argc) {
+            // --force <window|pid=PID> <width> <height>
+            std::string target = argv[++i];
+            int width = atoi(argv[++i]);
+            int height = atoi(argv[++i]);
+            if (width <= 0 || height <= 0) {
+                std::cerr << "Некорректный размер окна" << std::endl;
+                return 1;
+            }
+
+            if (target.compare(0, 4, "pid=") == 0) {
+                for (const auto& window : connection.FindWindowsForProcess(static_cast<uint32_t>(atoi(target.c_str() + 4)))) {
+                    requests.push_back({ window.window, width, height });
+                }
+            }
+            else if (xcb_window_t window = ParseWindow(target.c_str())) {
+                requests.push_back({ window, width, height });
+            }
+        }
+    }
+
+    if (!requests.empty()) {
+        enforcer.Start();
+        size_t forced = enforcer.Force(requests);
+        std::cout << "Установлен размер для окон: " << forced << " из " << requests.size() << std::endl;
+        if (forced) {
+            HoldUntilEnter(enforcer);
+        }
+        return forced ? 0 : 1;
+    }
+
+    // Interactive flow, as in the Windows build
+    std::cout << "Программа для принудительного изменения размера окна (X11)" << std::endl;
+    std::cout << "-----------------------------------------------------" << std::endl;
+    auto windows = connection.EnumerateWindows();
+    if (windows.empty()) {
+        std::cerr << "Оконный менеджер не сообщает список окон (_NET_CLIENT_LIST)" << std::endl;
+        return 1;
+    }
+    PrintWindowList(windows);
+
+    int windowIndex = 0;
+    std::cout << "\nВведите номер окна или -1 для выбора всех окон процесса: ";
+    std::cin >> windowIndex;
+
+    std::vector<xcb_window_t> targets;
+    if (windowIndex == -1) {
+        uint32_t processId = 0;
+        std::cout << "Введите PID процесса: ";
+        std::cin >> processId;
+        for (const auto& window : connection.FindWindowsForProcess(processId)) {
+            targets.push_back(window.window);
+        }
+    }
+    else if (windowIndex >= 1 && windowIndex <= static_cast<int>(windows.size())) {
+        targets.push_back(windows[windowIndex - 1].window);
+    }
+    if (targets.empty()) {
+        std::cerr << "Окна не выбраны" << std::endl;
+        return 1;
+    }
+
+    int width = 0;
+    int height = 0;
+    std::cout << "Введите новую ширину окна: ";
+    std::cin >> width;
+    std::cout << "Введите новую высоту окна: ";
+    std::cin >> height;
+    std::cin.ignore();
+    if (width <= 0 || height <= 0) {
+        std::cerr << "Некорректный размер окна" << std::endl;
+        return 1;
+    }
+
+    for (xcb_window_t window : targets) {
+        requests.push_back({ window, width, height });
+    }
+    enforcer.Start();
+    if (!enforcer.Force(requests)) {
+        std::cerr << "Не удалось изменить размер окна" << std::endl;
+        return 1;
+    }
+    HoldUntilEnter(enforcer);
+    return 0;
+}
@@ -0,0 +1,172 @@
+﻿#pragma once
+
+#include "EnforcementStats.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cwchar>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Control protocol. A request is one message of UTF-8 commands, one per
+// line (or separated by ';'); the reply is one message with, for every
+// command, a line "ok ..." or "error ...". "list" follows its "ok <count>"
+// with one line per window.
+//   force <hwnd|pid=N|tree=N> <width> <height>
+//                                         start enforcing; tree= adds the
+//                                         windows of child processes
+//   resize <hwnd> <width> <height>        change the size of a tracked window
+//   release <hwnd|all>                    stop enforcing and restore
+//   list                                  tracked windows
+//   stats                                 enforcement counters
+//   shutdown                              stop the daemon
+// Consecutive force commands of one request are applied as one batch.
+
+struct ControlForce {
+    HWND hwnd;
+    int width;
+    int height;
+};
+
+// What the commands act on: the desktop of the Windows daemon, or a
+// simulated one in the tests
+class ControlTarget {
+public:
+    virtual ~ControlTarget() = default;
+    // Windows named by a force command, "<hwnd>", "pid=N" or "tree=N"
+    virtual std::vector<HWND> Resolve(const std::wstring& target) = 0;
+    virtual void Force(const std::vector<ControlForce>& windows) = 0;
+    virtual bool Resize(HWND hwnd, int width, int height) = 0;
+    virtual bool Release(HWND hwnd) = 0;
+    virtual size_t ReleaseAll() = 0;
+    // One line per tracked window
+    virtual std::vector<std::wstring> List() = 0;
+    virtual const EnforcementStats& Stats() const = 0;
+    virtual void Shutdown() = 0;
+};
+
+inline HWND ParseControlWindow(const std::wstring& text) {
+    wchar_t* end = nullptr;
+    unsigned long long value = wcstoull(text.c_str(), &end, 0);
+    return end && *end == L'\0' ? reinterpret_cast<HWND>(static_cast<uintptr_t>(value)) : nullptr;
+}
+
+inline std::wstring FormatControlWindow(HWND hwnd) {
+    wchar_t text[32];
+    swprintf(text, std::size(text), L"0x%llx", static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(hwnd)));
+    return text;
+}
+
+inline std::wstring FormatControlStats(const EnforcementStats& stats) {
+    uint64_t totals[STAT_COUNTER_COUNT] = {};
+    stats.Totals(totals);
+    uint64_t frames = 0;
+    uint64_t frameCorrections = 0;
+    uint64_t coalesced = 0;
+    stats.FrameTotals(frames, frameCorrections, coalesced);
+
+    return L"checks=" + std::to_wstring(totals[STAT_CHECKS]) +
+        L" corrections=" + std::to_wstring(totals[STAT_CORRECTIONS]) +
+        L" deferred=" + std::to_wstring(totals[STAT_DEFERRED]) +
+        L" echoes=" + std::to_wstring(totals[STAT_ECHOES]) +
+        L" clamps=" + std::to_wstring(totals[STAT_CLAMPS]) +
+        L" messages=" + std::to_wstring(totals[STAT_HOOK_MESSAGES]) +
+        L" frames=" + std::to_wstring(frames) + L" frame_corrections=" + std::to_wstring(frameCorrections) +
+        L" coalesced=" + std::to_wstring(coalesced);
+}
+
+// Runs every command of a request and returns the reply
+inline std::wstring ExecuteControlRequest(ControlTarget& target, const std::wstring& request) {
+    std::wstring reply;
+    std::vector<ControlForce> pending;
+
+    auto flush = [&]() {
+        if (!pending.empty()) {
+            target.Force(pending);
+            pending.clear();
+        }
+    };
+    auto parseSize = [](const std::wstring& text) {
+        return static_cast<int>(wcstol(text.c_str(), nullptr, 10));
+    };
+
+    size_t start = 0;
+    while (start <= request.size()) {
+        size_t end = std::min(request.find_first_of(L"\n;", start), request.size());
+        std::wstring line = request.substr(start, end - start);
+        start = end + 1;
+
+        std::vector<std::wstring> args;
+        for (size_t pos = line.find_first_not_of(L" \t\r"); pos != std::wstring::npos;) {
+            size_t argEnd = std::min(line.find_first_of(L" \t\r", pos), line.size());
+            args.push_back(line.substr(pos, argEnd - pos));
+            pos = line.find_first_not_of(L" \t\r", argEnd);
+        }
+        if (args.empty()) {
+            continue;
+        }
+
+        const std::wstring& command = args[0];
+        if (command != L"force") {
+            flush();
+        }
+
+        if (command == L"force" && args.size() == 4) {
+            int width = parseSize(args[2]);
+            int height = parseSize(args[3]);
+            if (width <= 0 || height <= 0) {
+                reply += L"error недопустимый размер\n";
+                continue;
+            }
+
+            size_t before = pending.size();
+            for (HWND hwnd : target.Resolve(args[1])) {
+                pending.push_back({ hwnd, width, height });
+            }
+
+            size_t added = pending.size() - before;
+            reply += added ? L"ok " + std::to_wstring(added) + L"\n" : L"error окно не найдено\n";
+        }
+        else if (command == L"resize" && args.size() == 4) {
+            int width = parseSize(args[2]);
+            int height = parseSize(args[3]);
+            if (width <= 0 || height <= 0) {
+                reply += L"error недопустимый размер\n";
+            }
+            else if (!target.Resize(ParseControlWindow(args[1]), width, height)) {
+                reply += L"error окно не отслеживается\n";
+            }
+            else {
+                reply += L"ok\n";
+            }
+        }
+        else if (command == L"release" && args.size() == 2) {
+            bool all = args[1] == L"all";
+            size_t released = all ? target.ReleaseAll() : target.Release(ParseControlWindow(args[1])) ? 1 : 0;
+            reply += released || all ? L"ok " + std::to_wstring(released) + L"\n" : L"error окно не отслеживается\n";
+        }
+        else if (command == L"list" && args.size() == 1) {
+            std::vector<std::wstring> lines = target.List();
+            reply += L"ok " + std::to_wstring(lines.size()) + L"\n";
+            for (const auto& text : lines) {
+                reply += text + L"\n";
+            }
+        }
+        else if (command == L"stats" && args.size() == 1) {
+            reply += L"ok " + FormatControlStats(target.Stats()) + L"\n";
+        }
+        else if (command == L"shutdown" && args.size() == 1) {
+            target.Shutdown();
+            reply += L"ok\n";
+        }
+        else {
+            reply += L"error неизвестная команда: " + line + L"\n";
+        }
+    }
+
+    flush();
+    return reply;
+}
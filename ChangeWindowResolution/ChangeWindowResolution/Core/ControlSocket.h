@@ -0,0 +1,175 @@
+﻿#pragma once
+
+// Unix socket transport of the control protocol, for the Linux build; the
+// Windows daemon serves the same protocol over a named pipe. A
+// SOCK_SEQPACKET socket keeps message boundaries as the pipe's message mode
+// does, so one request is one packet and so is its reply.
+#ifndef _WIN32
+#include "ControlProtocol.h"
+#include "Utf8.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+// One whole packet. The buffer is sized from a peek at the packet's real
+// length, so a long message is never cut short.
+inline bool ReceiveControlMessage(int fd, std::string& message) {
+    char probe;
+    ssize_t size = recv(fd, &probe, 1, MSG_PEEK | MSG_TRUNC);
+    if (size <= 0) {
+        return false;
+    }
+
+    message.resize(static_cast<size_t>(size));
+    return recv(fd, &message[0], message.size(), 0) == size;
+}
+
+// A packet larger than the send buffer is refused with EMSGSIZE rather than
+// split; the buffer is raised to fit it once
+inline bool SendControlMessage(int fd, const std::string& message) {
+    ssize_t sent = send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+    if (sent < 0 && errno == EMSGSIZE) {
+        int size = static_cast<int>(std::min<size_t>(message.size() + 4096, INT32_MAX));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        sent = send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+    }
+    return sent == static_cast<ssize_t>(message.size());
+}
+
+inline bool FillControlAddress(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Serves one client at a time, like the pipe server; a client may send
+// any number of requests
+class UnixControlServer {
+public:
+    explicit UnixControlServer(ControlTarget& target) : m_target(target) {}
+    ~UnixControlServer() { Stop(); }
+
+    bool Start(const std::string& path) {
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        sockaddr_un address;
+        if (!FillControlAddress(path, address)) {
+            return false;
+        }
+
+        m_listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (m_listener < 0) {
+            return false;
+        }
+        unlink(path.c_str());
+        if (bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(m_listener, 8) != 0 || pipe(m_stopPipe) != 0) {
+            Close();
+            return false;
+        }
+
+        m_path = path;
+        m_thread = std::thread(&UnixControlServer::Run, this);
+        return true;
+    }
+
+    void Stop() {
+        if (m_thread.joinable()) {
+            char signal = 0;
+            (void)!write(m_stopPipe[1], &signal, 1);
+            m_thread.join();
+        }
+        Close();
+    }
+
+private:
+    void Close() {
+        for (int* fd : { &m_listener, &m_stopPipe[0], &m_stopPipe[1] }) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+        if (!m_path.empty()) {
+            unlink(m_path.c_str());
+            m_path.clear();
+        }
+    }
+
+    // Waits until fd is readable; false once the server is being stopped
+    bool WaitReadable(int fd) {
+        pollfd fds[2] = { { m_stopPipe[0], POLLIN, 0 }, { fd, POLLIN, 0 } };
+        while (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+        return (fds[0].revents & POLLIN) == 0;
+    }
+
+    void Run() {
+        std::string request;
+        while (WaitReadable(m_listener)) {
+            int client = accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+
+            while (WaitReadable(client) && ReceiveControlMessage(client, request)) {
+                std::string reply = WideToUtf8(ExecuteControlRequest(m_target, Utf8ToWide(request)));
+                if (!SendControlMessage(client, reply) &&
+                    (errno != EMSGSIZE || !SendControlMessage(client, WideToUtf8(L"error ответ слишком длинный\n")))) {
+                    break;
+                }
+            }
+            close(client);
+        }
+    }
+
+    ControlTarget& m_target;
+    std::string m_path;
+    int m_listener = -1;
+    int m_stopPipe[2] = { -1, -1 };
+    std::thread m_thread;
+};
+
+// Sends a request to the server at path and returns its reply; false when
+// no server is listening or the exchange broke off
+inline bool ExchangeUnixControlRequest(const std::string& path, const std::wstring& request, std::wstring& replyText) {
+    sockaddr_un address;
+    if (!FillControlAddress(path, address)) {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::string reply;
+    bool ok = connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+        SendControlMessage(fd, WideToUtf8(request)) && ReceiveControlMessage(fd, reply);
+    close(fd);
+    if (!ok) {
+        return false;
+    }
+
+    replyText = Utf8ToWide(reply);
+    return true;
+}
+#endif
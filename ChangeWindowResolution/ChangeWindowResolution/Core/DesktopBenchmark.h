@@ -0,0 +1,420 @@
+﻿#pragma once
+
+#include "Enforcement.h"
+#include "EnforcementStats.h"
+#include "FrameBatching.h"
+#include "Platform.h"
+#include "PollingGeometrySource.h"
+#include "TitleIndex.h"
+#include "WindowRegistry.h"
+#include "WindowSnapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cwchar>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+struct DesktopBenchmarkOptions {
+    int windowCount = 10000;
+    int hostileCount = 100;    // Windows that keep resizing themselves
+    int seconds = 5;           // Per enforcement strategy
+};
+
+// In-memory window system for benchmarks: windows, titles and geometry
+// without a display. Hostile windows drift on their own; corrections issued
+// through the WindowBackend interface record how long the drift lasted.
+class SimulatedDesktop : public WindowBackend {
+public:
+    SimulatedDesktop(int windowCount, int hostileCount) : m_windows(windowCount) {
+        static const wchar_t* const APPLICATIONS[] = {
+            L"Блокнот", L"Google Chrome", L"Visual Studio Code", L"Проводник",
+            L"Microsoft Word", L"Telegram", L"Steam", L"Диспетчер задач"
+        };
+
+        for (int i = 0; i < windowCount; ++i) {
+            SimulatedWindow& window = m_windows[i];
+            window.rect = { 0, 0, 800, 600 };
+            window.hostile = i < hostileCount;
+            window.title = L"Документ " + std::to_wstring(i) + L" - " + APPLICATIONS[i % std::size(APPLICATIONS)];
+            window.processId = 1000 + i / 8;
+        }
+    }
+
+    size_t Size() const { return m_windows.size(); }
+
+    HWND Hwnd(size_t i) const {
+        return reinterpret_cast<HWND>(HWND_BASE + i * HWND_STEP);
+    }
+
+    const std::wstring& Title(size_t i) const { return m_windows[i].title; }
+    DWORD ProcessId(size_t i) const { return m_windows[i].processId; }
+
+    // Called for every drift, as WinEvents would be for a real window
+    void SetObserver(std::function<void(HWND)> observer) {
+        m_observer = std::move(observer);
+    }
+
+    // A hostile window resizes itself away from whatever was enforced
+    void Drift(size_t i) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            SimulatedWindow& window = m_windows[i];
+            window.rect.right = window.rect.left + 640 + static_cast<LONG>(i % 97);
+            if (!window.drifted) {
+                window.drifted = true;
+                window.driftedAt = std::chrono::steady_clock::now();
+            }
+        }
+
+        if (m_observer) {
+            m_observer(Hwnd(i));
+        }
+    }
+
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t i = Index(hwnd);
+        if (i >= m_windows.size()) {
+            return false;
+        }
+        rect = m_windows[i].rect;
+        return true;
+    }
+
+    bool Exists(HWND hwnd) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return Index(hwnd) < m_windows.size();
+    }
+
+    void ApplyStyle(HWND, LONG) override {}
+
+    void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t i = Index(hwnd);
+        if (i >= m_windows.size()) {
+            return;
+        }
+
+        SimulatedWindow& window = m_windows[i];
+        window.rect = { current.left, current.top, current.left + width, current.top + height };
+        if (window.drifted) {
+            window.drifted = false;
+            m_latencies.push_back(std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - window.driftedAt).count());
+        }
+    }
+
+    // Time-to-correct samples in microseconds, and windows still drifted
+    std::vector<double> TakeLatencies(size_t& uncorrected) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uncorrected = 0;
+        for (auto& window : m_windows) {
+            uncorrected += window.drifted ? 1 : 0;
+            window.drifted = false;
+        }
+        return std::move(m_latencies);
+    }
+
+private:
+    static constexpr uintptr_t HWND_BASE = 0x10000;
+    static constexpr uintptr_t HWND_STEP = 4;
+
+    struct SimulatedWindow {
+        RECT rect;
+        bool hostile;
+        bool drifted = false;
+        std::chrono::steady_clock::time_point driftedAt;
+        std::wstring title;
+        DWORD processId;
+    };
+
+    size_t Index(HWND hwnd) const {
+        uintptr_t value = reinterpret_cast<uintptr_t>(hwnd);
+        return value < HWND_BASE ? SIZE_MAX : (value - HWND_BASE) / HWND_STEP;
+    }
+
+    std::mutex m_mutex;
+    std::vector<SimulatedWindow> m_windows;
+    std::vector<double> m_latencies;
+    std::function<void(HWND)> m_observer;
+};
+
+// Delivers simulated drift notifications from a separate thread, the way
+// out-of-context WinEvents arrive on the hook thread
+class SimulatedEventSource : public GeometryEventSource {
+public:
+    explicit SimulatedEventSource(SimulatedDesktop& desktop) : m_desktop(desktop) {}
+
+    ~SimulatedEventSource() { Stop(); }
+
+    bool Start(GeometryEventSink* sink) override {
+        m_sink = sink;
+        m_running = true;
+        m_desktop.SetObserver([this](HWND hwnd) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_watched.count(hwnd)) {
+                    return;
+                }
+                m_pending.push_back(hwnd);
+            }
+            m_wakeup.notify_one();
+        });
+        m_thread = std::thread(&SimulatedEventSource::Run, this);
+        return true;
+    }
+
+    void Stop() override {
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        m_desktop.SetObserver(nullptr);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_wakeup.notify_all();
+        m_thread.join();
+    }
+
+    bool Watch(HWND hwnd) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_watched.insert(hwnd);
+        return true;
+    }
+
+    void Unwatch(HWND hwnd) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_watched.erase(hwnd);
+    }
+
+private:
+    void Run() {
+        std::vector<HWND> batch;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_running) {
+            m_wakeup.wait(lock, [this]() { return !m_running || !m_pending.empty(); });
+            batch.swap(m_pending);
+
+            lock.unlock();
+            for (HWND hwnd : batch) {
+                m_sink->OnGeometryChanged(hwnd);
+            }
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+    SimulatedDesktop& m_desktop;
+    GeometryEventSink* m_sink = nullptr;
+    bool m_running = false;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::thread m_thread;
+    std::unordered_set<HWND> m_watched;
+    std::vector<HWND> m_pending;
+};
+
+inline double Percentile(std::vector<double>& samples, double fraction) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Benchmarks on a simulated desktop: snapshot filling, title search, the
+// per-message lookup in the hook path and enforcement time-to-correct.
+// Output is one "metric<TAB>value<TAB>unit" line per result so runs of
+// different builds can be diffed.
+inline std::wstring RunDesktopBenchmark(const DesktopBenchmarkOptions& options) {
+    using Clock = std::chrono::steady_clock;
+    std::wstring report;
+
+    auto add = [&](const wchar_t* metric, double value, const wchar_t* unit) {
+        wchar_t line[256];
+        swprintf(line, std::size(line), L"%ls\t%.3f\t%ls\n", metric, value, unit);
+        report += line;
+    };
+
+    // Runs body repeatedly for about a quarter of a second; returns calls per second
+    auto rate = [](auto body) {
+        constexpr auto DURATION = std::chrono::milliseconds(250);
+        uint64_t calls = 0;
+        auto start = Clock::now();
+        auto elapsed = Clock::duration::zero();
+        while (elapsed < DURATION) {
+            body();
+            calls++;
+            elapsed = Clock::now() - start;
+        }
+        return calls / std::chrono::duration<double>(elapsed).count();
+    };
+
+    SimulatedDesktop desktop(options.windowCount, std::min(options.hostileCount, options.windowCount));
+    add(L"config.windows", static_cast<double>(desktop.Size()), L"count");
+    add(L"config.hostile", std::min(options.hostileCount, options.windowCount), L"count");
+
+    // Enumeration: the inventory's per-window work without the system calls
+    InventorySnapshot snapshot = { 1, {} };
+    double fills = rate([&]() {
+        snapshot.windows.Clear();
+        for (size_t i = 0; i < desktop.Size(); ++i) {
+            snapshot.windows.Append(desktop.Hwnd(i), desktop.ProcessId(i), WINDOW_VISIBLE, desktop.Title(i));
+        }
+    });
+    add(L"enumerate.windows_per_s", fills * desktop.Size(), L"windows/s");
+
+    // Title search
+    std::unique_ptr<TitleIndex> index;
+    double builds = rate([&]() { index = std::make_unique<TitleIndex>(snapshot); });
+    add(L"search.index_build", 1000.0 / builds, L"ms");
+    add(L"search.short_query_per_s", rate([&]() { index->Search(L"до"); }), L"queries/s");
+    add(L"search.substring_query_per_s", rate([&]() { index->Search(L"кумент 42"); }), L"queries/s");
+    add(L"search.fuzzy_query_per_s", rate([&]() { index->Search(L"Телеграм"); }), L"queries/s");
+
+    // Counted but never published; the windows are not real
+    WindowRegistry registry;
+    EnforcementStats stats;
+    EnforcementEngine engine(registry, stats, desktop);
+    for (size_t i = 0; i < desktop.Size(); ++i) {
+        engine.Track(desktop.Hwnd(i), 800, 600, WS_OVERLAPPEDWINDOW, 0, WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU);
+    }
+
+    // Message paths: half of the windows looked up are tracked. Messages
+    // outside a class stop at the classification; size messages go on to
+    // the registry lookup of MessageProc or the context read of
+    // CustomWindowProc.
+    {
+        constexpr int MESSAGES = 1 << 20;
+        static const UINT UNRELATED[] = { WM_MOUSEMOVE, WM_PAINT, WM_TIMER, WM_PAINT };
+        static const UINT SIZE_MESSAGES[] = { WM_WINDOWPOSCHANGING, WM_GETMINMAXINFO, WM_NCCALCSIZE, WM_SIZE };
+
+        std::vector<WindowContext> contexts(desktop.Size());
+        for (size_t i = 0; i < contexts.size(); ++i) {
+            contexts[i].SetTarget(800, 600);
+        }
+
+        volatile size_t matched = 0;
+        auto time = [&](const UINT* messages, MessageClass messageClass, const auto& handle) {
+            auto start = Clock::now();
+            for (int i = 0; i < MESSAGES; ++i) {
+                size_t window = (i * 7919u) % (desktop.Size() * 2);
+                UINT message = messages[i & 3];
+                if (IsMessageOfClass(message, messageClass) && handle(window, desktop.Hwnd(window))) {
+                    matched = matched + 1;
+                }
+            }
+            return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / MESSAGES;
+        };
+
+        auto lookup = [&](size_t, HWND hwnd) {
+            WindowState state;
+            return registry.Find(hwnd, state) && state.tracked;
+        };
+        auto target = [&](size_t window, HWND) {
+            int width = 0;
+            int height = 0;
+            return window < contexts.size() && contexts[window].Target(width, height) &&
+                contexts[window].statsRow.load(std::memory_order_relaxed) != STATS_NO_ROW;
+        };
+
+        add(L"hook.message_classify", time(UNRELATED, MESSAGE_HOOK, lookup), L"ns/message");
+        add(L"hook.message_lookup", time(SIZE_MESSAGES, MESSAGE_HOOK, lookup), L"ns/message");
+        add(L"subclass.message_target", time(SIZE_MESSAGES, MESSAGE_SUBCLASS, target), L"ns/message");
+    }
+
+    // Enforcement: hostile windows drift for options.seconds per strategy
+    auto enforce = [&](EnforcementEngine& engine, GeometryEventSource& source, const wchar_t* name) {
+        source.Start(&engine);
+        for (size_t i = 0; i < desktop.Size(); ++i) {
+            source.Watch(desktop.Hwnd(i));
+        }
+        size_t uncorrected = 0;
+        desktop.TakeLatencies(uncorrected);
+
+        const size_t hostile = std::min<size_t>(options.hostileCount, desktop.Size());
+        const size_t driftsPerMs = std::max<size_t>(1, hostile / 100);
+        std::mt19937 random(12345);
+        uint64_t drifts = 0;
+
+        uint64_t cpuStart = ProcessCpuMicros();
+        auto start = Clock::now();
+        while (hostile && Clock::now() - start < std::chrono::seconds(options.seconds)) {
+            for (size_t i = 0; i < driftsPerMs; ++i) {
+                desktop.Drift(random() % hostile);
+                drifts++;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Let the last corrections land before measuring
+        std::this_thread::sleep_for(std::chrono::milliseconds(POLL_MAX_INTERVAL_MS));
+        double wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double cpuMicros = static_cast<double>(ProcessCpuMicros() - cpuStart);
+        source.Stop();
+
+        auto latencies = desktop.TakeLatencies(uncorrected);
+        std::wstring prefix = std::wstring(L"enforce.") + name + L".";
+        add((prefix + L"drifts").c_str(), static_cast<double>(drifts), L"count");
+        add((prefix + L"corrections").c_str(), static_cast<double>(latencies.size()), L"count");
+        add((prefix + L"uncorrected").c_str(), static_cast<double>(uncorrected), L"count");
+        add((prefix + L"p50").c_str(), Percentile(latencies, 0.50), L"us");
+        add((prefix + L"p90").c_str(), Percentile(latencies, 0.90), L"us");
+        add((prefix + L"p99").c_str(), Percentile(latencies, 0.99), L"us");
+        add((prefix + L"max").c_str(), Percentile(latencies, 1.0), L"us");
+        add((prefix + L"cpu_per_window").c_str(), cpuMicros / desktop.Size() / wallSeconds, L"us/s");
+    };
+
+    {
+        // Hostile windows get damped; deferred corrections are retried by polling
+        SimulatedEventSource events(desktop);
+        PollingGeometrySource retry;
+        retry.Start(&engine);
+        engine.SetRetrySource(&retry);
+        enforce(engine, events, L"events");
+        engine.SetRetrySource(nullptr);
+    }
+    {
+        PollingGeometrySource polling;
+        enforce(engine, polling, L"polling");
+    }
+    {
+        // Events again, with corrections applied once per 60 Hz frame
+        SimulatedFrameClock clock;
+        FrameBatchingBackend batching(desktop, &stats);
+        batching.Start(clock);
+        EnforcementEngine framed(registry, stats, batching);
+        SimulatedEventSource events(desktop);
+        PollingGeometrySource retry;
+        retry.Start(&framed);
+        framed.SetRetrySource(&retry);
+        enforce(framed, events, L"frames");
+        framed.SetRetrySource(nullptr);
+        retry.Stop();
+        batching.Stop();
+
+        uint64_t frames, flushed, coalesced;
+        uint32_t largestFrame;
+        batching.Counters(frames, flushed, coalesced, largestFrame);
+        add(L"enforce.frames.frames", static_cast<double>(frames), L"count");
+        add(L"enforce.frames.coalesced", static_cast<double>(coalesced), L"count");
+        add(L"enforce.frames.per_frame", frames ? static_cast<double>(flushed) / frames : 0.0, L"windows/frame");
+        add(L"enforce.frames.largest_frame", largestFrame, L"windows");
+    }
+
+    registry.Clear();
+    return report;
+}
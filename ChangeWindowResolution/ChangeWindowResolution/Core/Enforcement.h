@@ -0,0 +1,435 @@
+﻿#pragma once
+
+#include "EnforcementStats.h"
+#include "Platform.h"
+#include "WindowRegistry.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// Messages the hook procedures act on, classified at compile time so that
+// every other message is passed on without touching any window state
+enum MessageClass : uint8_t {
+    MESSAGE_HOOK = 1u << 0,     // Size clamps and drift checks in MessageProc
+    MESSAGE_SUBCLASS = 1u << 1  // Custom frame, dragging and clamps in CustomWindowProc
+};
+
+constexpr std::array<uint8_t, WM_USER> MakeMessageClasses() {
+    std::array<uint8_t, WM_USER> classes = {};
+    for (UINT msg : { WM_SIZE, WM_SIZING, WM_WINDOWPOSCHANGING, WM_WINDOWPOSCHANGED, WM_GETMINMAXINFO, WM_NCCALCSIZE }) {
+        classes[msg] |= MESSAGE_HOOK;
+    }
+    for (UINT msg : { WM_SIZE, WM_SIZING, WM_WINDOWPOSCHANGING, WM_WINDOWPOSCHANGED, WM_GETMINMAXINFO, WM_NCCALCSIZE,
+             WM_NCPAINT, WM_SETTEXT, WM_NCDESTROY, WM_NCLBUTTONDOWN, WM_MOUSEMOVE, WM_LBUTTONUP, WM_NCHITTEST,
+             WM_DPICHANGED }) {
+        classes[msg] |= MESSAGE_SUBCLASS;
+    }
+    return classes;
+}
+
+constexpr std::array<uint8_t, WM_USER> MESSAGE_CLASSES = MakeMessageClasses();
+
+constexpr bool IsMessageOfClass(UINT msg, MessageClass messageClass) {
+    return msg < MESSAGE_CLASSES.size() && (MESSAGE_CLASSES[msg] & messageClass) != 0;
+}
+
+static_assert(IsMessageOfClass(WM_GETMINMAXINFO, MESSAGE_HOOK) && IsMessageOfClass(WM_NCPAINT, MESSAGE_SUBCLASS),
+    "Size messages must reach the hook procedures");
+static_assert(!IsMessageOfClass(WM_PAINT, MESSAGE_HOOK) && !IsMessageOfClass(WM_TIMER, MESSAGE_SUBCLASS),
+    "Unrelated messages must take the fast path");
+
+
+// Window system calls used by the enforcement logic
+class WindowBackend {
+public:
+    virtual ~WindowBackend() = default;
+    virtual bool GetWindowBounds(HWND hwnd, RECT& rect) = 0;
+    virtual bool Exists(HWND hwnd) = 0;
+    virtual void ApplyStyle(HWND hwnd, LONG style) = 0;
+    virtual void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) = 0;
+    // Drops anything still queued for a window that is no longer enforced
+    virtual void Cancel(HWND) {}
+    // True while a correction for the window is queued but not applied yet
+    virtual bool HasPending(HWND) { return false; }
+    // Clock for damping decisions; replays substitute the recorded time
+    virtual std::chrono::steady_clock::time_point Now() { return std::chrono::steady_clock::now(); }
+};
+
+
+// Outcome of re-checking one window
+enum class GeometryCheck {
+    AtSize,     // Nothing to correct, or the correction was deferred
+    Corrected,  // The window had drifted and a correction was issued
+    Gone        // The window no longer exists and its state was freed
+};
+
+// Receives geometry change notifications for tracked windows
+class GeometryEventSink {
+public:
+    virtual ~GeometryEventSink() = default;
+    virtual GeometryCheck OnGeometryChanged(HWND hwnd) = 0;
+    // Frees everything kept for a window that has been destroyed
+    virtual void OnWindowDestroyed(HWND hwnd) = 0;
+};
+
+// Produces geometry change notifications. Implementations decide when a
+// window is worth re-checking; the sink decides whether it has drifted.
+class GeometryEventSource {
+public:
+    virtual ~GeometryEventSource() = default;
+    virtual bool Start(GeometryEventSink* sink) = 0;
+    virtual void Stop() = 0;
+    virtual bool Watch(HWND hwnd) = 0;
+    virtual void Unwatch(HWND hwnd) = 0;
+};
+
+// Damping of resize wars. FRW remembers each correction it issues, so the
+// geometry notification its own SetWindowPos produces is recognized as an
+// echo. A drift seen shortly after a correction counts as the application
+// fighting back; repeated fights first slow corrections down exponentially,
+// then stop them altogether and leave only the min/max clamps in the hooks.
+// Escalation needs a run of fights, de-escalation a calm period, so a window
+// does not flap between modes.
+class CorrectionDamper {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Decision {
+        bool correct;
+        bool modeChanged;
+        DampingMode mode;
+    };
+
+    // Called when a tracked window is found off size
+    Decision BeforeCorrection(HWND hwnd, Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Damping& d = m_windows[hwnd];
+        DampingMode previous = d.mode;
+
+        if (!d.fightCounted && d.lastCorrection != Clock::time_point() && now - d.lastCorrection < FIGHT_WINDOW) {
+            d.fights++;
+            d.lastFight = now;
+            d.fightCounted = true;
+        }
+        d.echoPending = false;
+
+        switch (d.mode) {
+        case DampingMode::Immediate:
+            if (d.fights >= BACKOFF_AFTER_FIGHTS) {
+                Enter(d, DampingMode::Backoff, now);
+                d.delay = MIN_DELAY;
+            }
+            break;
+        case DampingMode::Backoff:
+            if (d.fights >= CLAMP_AFTER_FIGHTS) {
+                Enter(d, DampingMode::ClampOnly, now);
+            }
+            break;
+        case DampingMode::ClampOnly:
+            // Probe again now and then at the slowest rate
+            if (now - d.modeSince >= CLAMP_HOLD) {
+                Enter(d, DampingMode::Backoff, now);
+                d.delay = MAX_DELAY;
+                d.fights = BACKOFF_AFTER_FIGHTS;
+            }
+            break;
+        }
+
+        bool correct = d.mode == DampingMode::Immediate ||
+            (d.mode == DampingMode::Backoff && now >= d.nextAllowed);
+        if (correct) {
+            if (d.mode == DampingMode::Backoff) {
+                d.nextAllowed = now + d.delay;
+                d.delay = std::min(d.delay * 2, MAX_DELAY);
+            }
+            d.lastCorrection = now;
+            d.echoPending = true;
+            d.fightCounted = false;
+        }
+
+        return { correct, d.mode != previous, d.mode };
+    }
+
+    // Called when a tracked window is found at size. Returns true if this
+    // is the echo of FRW's own correction.
+    bool AtSize(HWND hwnd, Clock::time_point now, Decision& decision) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_windows.find(hwnd);
+        if (it == m_windows.end()) {
+            decision = { false, false, DampingMode::Immediate };
+            return false;
+        }
+
+        Damping& d = it->second;
+        bool echo = d.echoPending && now - d.lastCorrection < ECHO_WINDOW;
+        d.echoPending = false;
+
+        DampingMode previous = d.mode;
+        if (now - d.lastFight >= CALM_PERIOD) {
+            d.fights = 0;
+            if (d.mode != DampingMode::Immediate) {
+                Enter(d, DampingMode::Immediate, now);
+            }
+        }
+
+        decision = { false, d.mode != previous, d.mode };
+        return echo;
+    }
+
+    void Forget(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_windows.erase(hwnd);
+    }
+
+private:
+    static constexpr auto FIGHT_WINDOW = std::chrono::milliseconds(250);
+    static constexpr auto ECHO_WINDOW = std::chrono::milliseconds(100);
+    static constexpr auto MIN_DELAY = std::chrono::milliseconds(50);
+    static constexpr auto MAX_DELAY = std::chrono::milliseconds(2000);
+    static constexpr auto CALM_PERIOD = std::chrono::milliseconds(3000);
+    static constexpr auto CLAMP_HOLD = std::chrono::milliseconds(10000);
+    static constexpr int BACKOFF_AFTER_FIGHTS = 5;
+    static constexpr int CLAMP_AFTER_FIGHTS = 20;
+
+    struct Damping {
+        DampingMode mode = DampingMode::Immediate;
+        int fights = 0;
+        bool fightCounted = false;  // One fight per correction at most
+        bool echoPending = false;
+        std::chrono::milliseconds delay = MIN_DELAY;
+        Clock::time_point lastCorrection;
+        Clock::time_point lastFight;
+        Clock::time_point nextAllowed;
+        Clock::time_point modeSince;
+    };
+
+    static void Enter(Damping& d, DampingMode mode, Clock::time_point now) {
+        d.mode = mode;
+        d.modeSince = now;
+    }
+
+    std::mutex m_mutex;
+    std::unordered_map<HWND, Damping> m_windows;
+};
+
+// What the engine does besides counting, for the trace, the log and state
+// kept outside the engine. Every call is optional.
+class EnforcementListener {
+public:
+    virtual ~EnforcementListener() = default;
+    // Tracking started or the target size changed
+    virtual void OnTracked(HWND, uint32_t /*statsRow*/, int /*width*/, int /*height*/) {}
+    virtual void OnChecked(HWND, int /*width*/, int /*height*/) {}
+    virtual void OnDeferred(HWND) {}
+    virtual void OnCorrected(HWND, LONG /*style*/, int /*width*/, int /*height*/) {}
+    virtual void OnModeChanged(HWND, DampingMode) {}
+    // The engine has already dropped the window
+    virtual void OnDestroyed(HWND) {}
+};
+
+// Drift detection and correction ("drifted -> correct")
+class EnforcementEngine : public GeometryEventSink {
+public:
+    EnforcementEngine(WindowRegistry& registry, EnforcementStats& stats, WindowBackend& backend,
+        EnforcementListener* listener = nullptr)
+        : m_registry(registry), m_stats(stats), m_backend(backend), m_listener(listener) {}
+
+    // Source that re-checks windows whose correction was deferred; needed
+    // when the primary source only reports changes
+    void SetRetrySource(GeometryEventSource* source) {
+        m_retrySource = source;
+    }
+
+    // Drops per-window enforcement history once a window is released
+    void Untrack(HWND hwnd) {
+        m_damper.Forget(hwnd);
+        m_backend.Cancel(hwnd);
+        if (m_retrySource) {
+            m_retrySource->Unwatch(hwnd);
+        }
+    }
+
+    // Gives the window's stats row back for reuse; hooks still running for
+    // the window stop counting into it
+    void FreeStatsRow(HWND hwnd) {
+        uint32_t statsRow = STATS_NO_ROW;
+        m_registry.UpdateIfPresent(hwnd, [&](WindowState& state) {
+            statsRow = state.statsRow;
+            state.statsRow = STATS_NO_ROW;
+            if (state.context) {
+                state.context->statsRow.store(STATS_NO_ROW, std::memory_order_relaxed);
+            }
+        });
+        m_stats.RemoveWindow(statsRow);
+    }
+
+    // Registers the window and remembers its styles for restoring later. A
+    // window forced again already has the enforced style, so the styles
+    // saved the first time are kept and only the size changes.
+    void Track(HWND hwnd, int width, int height, LONG style, LONG exStyle, LONG enforcedStyle) {
+        uint32_t statsRow = STATS_NO_ROW;
+        m_registry.Update(hwnd, [&](WindowState& state) {
+            if (state.tracked) {
+                state.size.width = width;
+                state.size.height = height;
+                state.size.keepForcing = true;
+            }
+            else {
+                state.tracked = true;
+                state.size = { width, height, true, style, exStyle, enforcedStyle };
+            }
+            if (state.statsRow == STATS_NO_ROW) {
+                state.statsRow = m_stats.AddWindow(hwnd, width, height);
+            }
+            if (state.context) {
+                state.context->statsRow.store(state.statsRow, std::memory_order_relaxed);
+                state.context->SetTarget(width, height);
+            }
+            statsRow = state.statsRow;
+        });
+        if (m_listener) {
+            m_listener->OnTracked(hwnd, statsRow, width, height);
+        }
+    }
+
+    // Changes the enforced size in place. Damping starts over, since the
+    // correction that follows is ours and not a fight.
+    bool Retarget(HWND hwnd, int width, int height) {
+        WindowState state;
+        if (!m_registry.Find(hwnd, state) || !state.tracked) {
+            return false;
+        }
+
+        Untrack(hwnd);
+        m_stats.SetMode(state.statsRow, DampingMode::Immediate);
+        m_registry.Update(hwnd, [&](WindowState& current) {
+            current.size.width = width;
+            current.size.height = height;
+            if (current.context) {
+                current.context->SetTarget(width, height);
+            }
+        });
+        if (m_listener) {
+            m_listener->OnTracked(hwnd, state.statsRow, width, height);
+        }
+        return true;
+    }
+
+    GeometryCheck OnGeometryChanged(HWND hwnd) override {
+        WindowState state;
+        if (!m_registry.Find(hwnd, state) || !state.tracked || !state.size.keepForcing) {
+            return GeometryCheck::AtSize;
+        }
+        const ResizeData& sizeData = state.size;
+
+        uint64_t start = EnforcementStats::Now();
+        m_stats.Count(state.statsRow, STAT_CHECKS);
+
+        // The queued correction answers this check already; looking at the
+        // bounds now would either queue it again or take the window, still
+        // off size, for the echo that only comes once it is applied
+        if (m_backend.HasPending(hwnd)) {
+            m_stats.Count(state.statsRow, STAT_ENFORCE_TICKS, EnforcementStats::Now() - start);
+            return GeometryCheck::AtSize;
+        }
+
+        RECT rect;
+        if (!m_backend.GetWindowBounds(hwnd, rect)) {
+            if (m_backend.Exists(hwnd)) {
+                return GeometryCheck::AtSize;
+            }
+            OnWindowDestroyed(hwnd);
+            return GeometryCheck::Gone;
+        }
+
+        int currentWidth = rect.right - rect.left;
+        int currentHeight = rect.bottom - rect.top;
+        if (m_listener) {
+            m_listener->OnChecked(hwnd, currentWidth, currentHeight);
+        }
+
+        auto now = m_backend.Now();
+        if (currentWidth == sizeData.width && currentHeight == sizeData.height) {
+            CorrectionDamper::Decision decision;
+            if (m_damper.AtSize(hwnd, now, decision)) {
+                m_stats.Count(state.statsRow, STAT_ECHOES);
+            }
+            if (decision.modeChanged) {
+                OnModeChanged(hwnd, state.statsRow, decision.mode);
+            }
+
+            uint64_t end = EnforcementStats::Now();
+            m_stats.DriftEnded(state.statsRow, end);
+            m_stats.Count(state.statsRow, STAT_ENFORCE_TICKS, end - start);
+            return GeometryCheck::AtSize;
+        }
+
+        m_stats.DriftSeen(state.statsRow, start);
+
+        auto decision = m_damper.BeforeCorrection(hwnd, now);
+        if (decision.modeChanged) {
+            OnModeChanged(hwnd, state.statsRow, decision.mode);
+        }
+        if (!decision.correct) {
+            if (m_listener) {
+                m_listener->OnDeferred(hwnd);
+            }
+            m_stats.Count(state.statsRow, STAT_DEFERRED);
+            m_stats.Count(state.statsRow, STAT_ENFORCE_TICKS, EnforcementStats::Now() - start);
+            return GeometryCheck::AtSize;
+        }
+
+        m_backend.ApplyStyle(hwnd, sizeData.enforcedStyle);
+        m_backend.ResizeWindow(hwnd, rect, sizeData.width, sizeData.height);
+        if (m_listener) {
+            m_listener->OnCorrected(hwnd, sizeData.enforcedStyle, sizeData.width, sizeData.height);
+        }
+
+        uint64_t end = EnforcementStats::Now();
+        m_stats.Count(state.statsRow, STAT_STYLE_REAPPLIES);
+        m_stats.Count(state.statsRow, STAT_CORRECTIONS);
+        m_stats.Record(state.statsRow, HIST_CORRECTION_LATENCY, end - start);
+        m_stats.Count(state.statsRow, STAT_ENFORCE_TICKS, end - start);
+        return GeometryCheck::Corrected;
+    }
+
+    // Nothing is restored; the window and its styles are gone
+    void OnWindowDestroyed(HWND hwnd) override {
+        Untrack(hwnd);
+        FreeStatsRow(hwnd);
+        m_registry.Remove(hwnd);
+        if (m_listener) {
+            m_listener->OnDestroyed(hwnd);
+        }
+    }
+
+private:
+    void OnModeChanged(HWND hwnd, uint32_t statsRow, DampingMode mode) {
+        m_stats.SetMode(statsRow, mode);
+        if (m_listener) {
+            m_listener->OnModeChanged(hwnd, mode);
+        }
+
+        // Deferred corrections are not re-notified by change-driven sources
+        if (m_retrySource) {
+            if (mode == DampingMode::Immediate) {
+                m_retrySource->Unwatch(hwnd);
+            }
+            else {
+                m_retrySource->Watch(hwnd);
+            }
+        }
+    }
+
+    WindowRegistry& m_registry;
+    EnforcementStats& m_stats;
+    WindowBackend& m_backend;
+    EnforcementListener* m_listener;
+    CorrectionDamper m_damper;
+    GeometryEventSource* m_retrySource = nullptr;
+};
+
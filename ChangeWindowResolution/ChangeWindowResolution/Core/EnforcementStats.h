@@ -0,0 +1,308 @@
+﻿#pragma once
+
+#include "Platform.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+// Enforcement telemetry. The Windows build publishes it in a named
+// shared-memory region that "--stats" reads from another process; the
+// benchmark and test builds keep it in plain memory. Every thread writes
+// only to its own slot, so updates are uncontended relaxed atomic adds and
+// the message hooks take no locks; the viewer sums the slots without
+// pausing anyone.
+enum StatCounter : uint32_t {
+    STAT_CHECKS,           // Geometry checks by the enforcement engine
+    STAT_CORRECTIONS,      // SetWindowPos calls issued to undo a drift
+    STAT_CLAMPS,           // Size messages rewritten in the hooks
+    STAT_STYLE_REAPPLIES,  // Enforced style set again
+    STAT_HOOK_MESSAGES,    // Messages for the window seen by the hooks
+    STAT_ENFORCE_TICKS,    // Time spent in the engine for the window
+    STAT_DEFERRED,         // Corrections held back by damping
+    STAT_ECHOES,           // Notifications caused by FRW's own corrections
+    STAT_COUNTER_COUNT
+};
+
+enum StatHistogram : uint32_t {
+    HIST_DRIFT,               // From detecting a drift to seeing the size restored
+    HIST_CORRECTION_LATENCY,  // From detecting a drift to the correction being issued
+    HIST_COUNT
+};
+
+// How the engine currently reacts to a window that keeps resizing itself
+enum class DampingMode : uint32_t {
+    Immediate,  // Correct every drift right away
+    Backoff,    // Correct with exponentially growing delays
+    ClampOnly   // Only clamp size messages in the hooks
+};
+
+constexpr uint32_t STATS_MAGIC = 0x53575246;  // "FRWS"
+constexpr uint32_t STATS_LAYOUT_VERSION = 4;
+constexpr uint32_t STATS_SLOTS = 16;
+constexpr uint32_t STATS_MAX_WINDOWS = 256;
+constexpr uint32_t STATS_BUCKETS = 24;  // Bucket b holds [2^b, 2^(b+1)) microseconds
+constexpr uint32_t STATS_NO_ROW = UINT32_MAX;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Stats counters must be lock-free to live in shared memory");
+
+struct StatsWindowRow {
+    std::atomic<uint64_t> driftStartedAt;  // Now() ticks, 0 while the window is at size
+    std::atomic<uint32_t> dampingMode;     // DampingMode
+    uint64_t hwnd;                         // 0 once the window is released
+    DWORD processId;
+    int32_t width;
+    int32_t height;
+    wchar_t title[64];
+};
+
+struct StatsCells {
+    std::atomic<uint64_t> counters[STAT_COUNTER_COUNT];
+    std::atomic<uint64_t> histograms[HIST_COUNT][STATS_BUCKETS];
+};
+
+// Layout of the shared region; a new field means a new STATS_LAYOUT_VERSION
+struct StatsRegion {
+    std::atomic<uint32_t> magic;  // Written last, once the header is valid
+    uint32_t layoutVersion;
+    DWORD processId;
+    uint32_t reserved;
+    int64_t ticksPerSecond;
+    std::atomic<uint32_t> windowCount;
+    std::atomic<uint32_t> nextSlot;
+    std::atomic<uint64_t> frames;            // Frames that applied corrections
+    std::atomic<uint64_t> frameCorrections;  // Corrections applied at frame boundaries
+    std::atomic<uint64_t> coalesced;         // Checks and corrections absorbed by a pending one
+    std::atomic<uint32_t> lastFrame;         // Corrections in the latest frame
+    std::atomic<uint32_t> largestFrame;
+    StatsWindowRow windows[STATS_MAX_WINDOWS];
+    StatsCells cells[STATS_SLOTS][STATS_MAX_WINDOWS];
+    StatsCells retired;  // What released windows counted before their rows were reused
+};
+
+class EnforcementStats {
+public:
+    // Clock every duration in the region is measured with
+    static uint64_t Now() {
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
+
+    static int64_t TicksPerSecond() {
+        return std::chrono::steady_clock::period::den / std::chrono::steady_clock::period::num;
+    }
+
+    // Starts publishing into region, which is zero-filled or was published
+    // into before. Without a region every update is a no-op.
+    void Attach(StatsRegion* region, DWORD processId) {
+        region->layoutVersion = STATS_LAYOUT_VERSION;
+        region->processId = processId;
+        region->ticksPerSecond = TicksPerSecond();
+        region->magic.store(STATS_MAGIC, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(m_rowMutex);
+        m_freeRows.clear();
+        uint32_t windowCount = std::min(region->windowCount.load(std::memory_order_relaxed), STATS_MAX_WINDOWS);
+        for (uint32_t row = 0; row < windowCount; ++row) {
+            if (!region->windows[row].hwnd) {
+                m_freeRows.push_back(row);
+            }
+        }
+        m_region = region;
+    }
+
+    // Hands the region back to whoever provided it
+    StatsRegion* Detach() {
+        std::lock_guard<std::mutex> lock(m_rowMutex);
+        StatsRegion* region = m_region;
+        m_region = nullptr;
+        m_freeRows.clear();
+        return region;
+    }
+
+    const StatsRegion* Region() const { return m_region; }
+
+    // Returns the row for a newly tracked window, or STATS_NO_ROW when the
+    // region is closed or full. Rows of released windows are reused first.
+    uint32_t AddWindow(HWND hwnd, int width, int height) {
+        std::lock_guard<std::mutex> lock(m_rowMutex);
+        if (!m_region) {
+            return STATS_NO_ROW;
+        }
+
+        uint32_t row = m_region->windowCount.load(std::memory_order_relaxed);
+        bool reused = !m_freeRows.empty();
+        if (reused) {
+            row = m_freeRows.back();
+            m_freeRows.pop_back();
+            Retire(row);
+        }
+        else if (row >= STATS_MAX_WINDOWS) {
+            return STATS_NO_ROW;
+        }
+
+        StatsWindowRow& window = m_region->windows[row];
+        window.driftStartedAt.store(0, std::memory_order_relaxed);
+        window.dampingMode.store(static_cast<uint32_t>(DampingMode::Immediate), std::memory_order_relaxed);
+        window.processId = 0;
+        window.width = width;
+        window.height = height;
+        window.title[0] = L'\0';
+        window.hwnd = reinterpret_cast<uint64_t>(hwnd);
+
+        // Readers only look at rows below windowCount
+        if (!reused) {
+            m_region->windowCount.store(row + 1, std::memory_order_release);
+        }
+        return row;
+    }
+
+    // Frees the row of a window that is no longer enforced. Its counts
+    // stay in the row until the row is reused, then move to the retired
+    // cells, so totals never go down.
+    void RemoveWindow(uint32_t row) {
+        std::lock_guard<std::mutex> lock(m_rowMutex);
+        if (!m_region || row >= STATS_MAX_WINDOWS || !m_region->windows[row].hwnd) {
+            return;
+        }
+        m_region->windows[row].hwnd = 0;
+        m_freeRows.push_back(row);
+    }
+
+    // What the viewer shows for a row besides its size
+    void DescribeWindow(uint32_t row, DWORD processId, std::wstring_view title) {
+        if (m_region && row < STATS_MAX_WINDOWS) {
+            StatsWindowRow& window = m_region->windows[row];
+            size_t length = std::min(title.size(), std::size(window.title) - 1);
+            std::copy_n(title.data(), length, window.title);
+            window.title[length] = L'\0';
+            window.processId = processId;
+        }
+    }
+
+    void Count(uint32_t row, StatCounter counter, uint64_t amount = 1) {
+        if (StatsCells* cells = Cells(row)) {
+            cells->counters[counter].fetch_add(amount, std::memory_order_relaxed);
+        }
+    }
+
+    void Record(uint32_t row, StatHistogram histogram, uint64_t ticks) {
+        if (StatsCells* cells = Cells(row)) {
+            cells->histograms[histogram][Bucket(ticks)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void SetMode(uint32_t row, DampingMode mode) {
+        if (m_region && row < STATS_MAX_WINDOWS) {
+            m_region->windows[row].dampingMode.store(static_cast<uint32_t>(mode), std::memory_order_relaxed);
+        }
+    }
+
+    // Sums every counter over all windows and slots, released ones included
+    void Totals(uint64_t (&totals)[STAT_COUNTER_COUNT]) const {
+        if (!m_region) {
+            return;
+        }
+
+        for (uint32_t c = 0; c < STAT_COUNTER_COUNT; ++c) {
+            totals[c] += m_region->retired.counters[c].load(std::memory_order_relaxed);
+        }
+        uint32_t windowCount = std::min(m_region->windowCount.load(std::memory_order_acquire), STATS_MAX_WINDOWS);
+        for (uint32_t slot = 0; slot < STATS_SLOTS; ++slot) {
+            for (uint32_t row = 0; row < windowCount; ++row) {
+                for (uint32_t c = 0; c < STAT_COUNTER_COUNT; ++c) {
+                    totals[c] += m_region->cells[slot][row].counters[c].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    // Written by the frame batching thread only
+    void FrameFlushed(uint32_t corrections) {
+        if (m_region) {
+            m_region->frames.fetch_add(1, std::memory_order_relaxed);
+            m_region->frameCorrections.fetch_add(corrections, std::memory_order_relaxed);
+            m_region->lastFrame.store(corrections, std::memory_order_relaxed);
+            if (corrections > m_region->largestFrame.load(std::memory_order_relaxed)) {
+                m_region->largestFrame.store(corrections, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void Coalesced() {
+        if (m_region) {
+            m_region->coalesced.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void FrameTotals(uint64_t& frames, uint64_t& corrections, uint64_t& coalesced) const {
+        frames = m_region ? m_region->frames.load(std::memory_order_relaxed) : 0;
+        corrections = m_region ? m_region->frameCorrections.load(std::memory_order_relaxed) : 0;
+        coalesced = m_region ? m_region->coalesced.load(std::memory_order_relaxed) : 0;
+    }
+
+    // The first check that finds the window off size starts the drift
+    void DriftSeen(uint32_t row, uint64_t now) {
+        if (m_region && row < STATS_MAX_WINDOWS) {
+            uint64_t expected = 0;
+            m_region->windows[row].driftStartedAt.compare_exchange_strong(expected, now, std::memory_order_relaxed);
+        }
+    }
+
+    // The first check that finds the window back at size ends it
+    void DriftEnded(uint32_t row, uint64_t now) {
+        if (m_region && row < STATS_MAX_WINDOWS) {
+            uint64_t startedAt = m_region->windows[row].driftStartedAt.exchange(0, std::memory_order_relaxed);
+            if (startedAt) {
+                Record(row, HIST_DRIFT, now - startedAt);
+            }
+        }
+    }
+
+private:
+    // Under m_rowMutex: moves the counts a freed row still holds into the
+    // retired cells. A write racing with this lands in one or the other.
+    void Retire(uint32_t row) {
+        StatsCells& retired = m_region->retired;
+        for (uint32_t slot = 0; slot < STATS_SLOTS; ++slot) {
+            StatsCells& cells = m_region->cells[slot][row];
+            for (uint32_t c = 0; c < STAT_COUNTER_COUNT; ++c) {
+                retired.counters[c].fetch_add(cells.counters[c].exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            for (uint32_t h = 0; h < HIST_COUNT; ++h) {
+                for (uint32_t b = 0; b < STATS_BUCKETS; ++b) {
+                    retired.histograms[h][b].fetch_add(cells.histograms[h][b].exchange(0, std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    StatsCells* Cells(uint32_t row) {
+        if (!m_region || row >= STATS_MAX_WINDOWS) {
+            return nullptr;
+        }
+
+        // Threads beyond STATS_SLOTS share slots; the adds stay atomic
+        static thread_local uint32_t slot = m_region->nextSlot.fetch_add(1, std::memory_order_relaxed) % STATS_SLOTS;
+        return &m_region->cells[slot][row];
+    }
+
+    uint32_t Bucket(uint64_t ticks) const {
+        uint64_t micros = ticks * 1000000 / static_cast<uint64_t>(m_region->ticksPerSecond);
+        uint32_t bucket = 0;
+        while (micros > 1 && bucket + 1 < STATS_BUCKETS) {
+            micros >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    StatsRegion* m_region = nullptr;
+    std::mutex m_rowMutex;
+    std::vector<uint32_t> m_freeRows;  // Released rows, reused before new ones
+};
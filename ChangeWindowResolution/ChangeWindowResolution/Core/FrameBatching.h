@@ -0,0 +1,246 @@
+﻿#pragma once
+
+#include "Enforcement.h"
+#include "EnforcementStats.h"
+#include "Platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Paces correction batches to the display
+class FrameClock {
+public:
+    virtual ~FrameClock() = default;
+    // Blocks until the next frame boundary
+    virtual void WaitForFrame() = 0;
+};
+
+// Fixed-period frames off the steady clock, for simulated desktops
+class SimulatedFrameClock : public FrameClock {
+public:
+    explicit SimulatedFrameClock(std::chrono::microseconds period = std::chrono::microseconds(16667))
+        : m_period(period), m_next(std::chrono::steady_clock::now()) {}
+
+    void WaitForFrame() override {
+        auto now = std::chrono::steady_clock::now();
+        while (m_next <= now) {
+            m_next += m_period;
+        }
+        std::this_thread::sleep_until(m_next);
+    }
+
+private:
+    std::chrono::microseconds m_period;
+    std::chrono::steady_clock::time_point m_next;
+};
+
+// Holds corrections back until the next frame boundary and applies them in
+// one batch, so a window gets at most one geometry change per displayed
+// frame however often its drift is noticed in between. Per window the last
+// correction wins. Bounds are always the window's real ones; HasPending
+// tells the engine a correction is already queued, so checks until it is
+// applied are absorbed into it. Not started, it passes every call straight
+// through.
+class FrameBatchingBackend : public WindowBackend {
+public:
+    // Batch sizes and coalesced checks also go to the stats, when given
+    explicit FrameBatchingBackend(WindowBackend& inner, EnforcementStats* stats = nullptr)
+        : m_inner(inner), m_stats(stats) {}
+
+    ~FrameBatchingBackend() { Stop(); }
+
+    bool Start(FrameClock& clock) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        m_clock = &clock;
+        m_running = true;
+        m_thread = std::thread(&FrameBatchingBackend::Run, this);
+        return true;
+    }
+
+    // Pending corrections are dropped; whoever stops batching restores the
+    // windows next
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_thread.joinable()) {
+                return;
+            }
+            m_running = false;
+            m_pending.clear();
+        }
+        m_wakeup.notify_all();
+        m_thread.join();
+    }
+
+    // Applies everything pending now; replays call this on their own clock
+    size_t Flush() {
+        std::lock_guard<std::mutex> flushing(m_flushMutex);
+        std::unordered_map<HWND, Pending> batch;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            batch.swap(m_pending);
+        }
+
+        uint32_t resized = 0;
+        for (const auto& pair : batch) {
+            const Pending& pending = pair.second;
+            if (pending.hasStyle) {
+                m_inner.ApplyStyle(pair.first, pending.style);
+            }
+            if (pending.resize) {
+                m_inner.ResizeWindow(pair.first, pending.current, pending.width, pending.height);
+                resized++;
+            }
+        }
+
+        if (resized) {
+            m_frames.fetch_add(1, std::memory_order_relaxed);
+            m_flushed.fetch_add(resized, std::memory_order_relaxed);
+            uint32_t largest = m_largestFrame.load(std::memory_order_relaxed);
+            while (resized > largest && !m_largestFrame.compare_exchange_weak(largest, resized, std::memory_order_relaxed)) {
+            }
+            if (m_stats) {
+                m_stats->FrameFlushed(resized);
+            }
+        }
+        return resized;
+    }
+
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        return m_inner.GetWindowBounds(hwnd, rect);
+    }
+
+    // A check that finds a correction queued is absorbed into it
+    bool HasPending(HWND hwnd) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_pending.find(hwnd);
+        if (it == m_pending.end() || !it->second.resize) {
+            return false;
+        }
+        CountCoalesced();
+        return true;
+    }
+
+    bool Exists(HWND hwnd) override {
+        return m_inner.Exists(hwnd);
+    }
+
+    void ApplyStyle(HWND hwnd, LONG style) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_running || m_manual) {
+                Pending& pending = m_pending[hwnd];
+                pending.style = style;
+                pending.hasStyle = true;
+                return;
+            }
+        }
+        m_inner.ApplyStyle(hwnd, style);
+    }
+
+    void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_running || m_manual) {
+                Pending& pending = m_pending[hwnd];
+                if (pending.resize) {
+                    CountCoalesced();
+                }
+                pending.current = current;
+                pending.width = width;
+                pending.height = height;
+                pending.resize = true;
+                m_wakeup.notify_one();
+                return;
+            }
+        }
+        m_inner.ResizeWindow(hwnd, current, width, height);
+    }
+
+    // Also waits out a batch being applied, so nothing lands on the window
+    // once this returns
+    void Cancel(HWND hwnd) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.erase(hwnd);
+        }
+        { std::lock_guard<std::mutex> flushing(m_flushMutex); }
+        m_inner.Cancel(hwnd);
+    }
+
+    std::chrono::steady_clock::time_point Now() override {
+        return m_inner.Now();
+    }
+
+    // Frames that applied at least one correction, corrections applied,
+    // checks and corrections absorbed by a pending one, largest batch
+    void Counters(uint64_t& frames, uint64_t& flushed, uint64_t& coalesced, uint32_t& largestFrame) const {
+        frames = m_frames.load(std::memory_order_relaxed);
+        flushed = m_flushed.load(std::memory_order_relaxed);
+        coalesced = m_coalesced.load(std::memory_order_relaxed);
+        largestFrame = m_largestFrame.load(std::memory_order_relaxed);
+    }
+
+    // Batches without the frame thread; the owner calls Flush on its own clock
+    void SetManual(bool manual) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_manual = manual;
+    }
+
+private:
+    struct Pending {
+        RECT current = { 0, 0, 0, 0 };
+        int width = 0;
+        int height = 0;
+        bool resize = false;
+        LONG style = 0;
+        bool hasStyle = false;
+    };
+
+    void CountCoalesced() {
+        m_coalesced.fetch_add(1, std::memory_order_relaxed);
+        if (m_stats) {
+            m_stats->Coalesced();
+        }
+    }
+
+    // Sleeps while nothing is pending, so an idle desktop costs no frames
+    void Run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_running) {
+            m_wakeup.wait(lock, [this]() { return !m_running || !m_pending.empty(); });
+            if (!m_running) {
+                break;
+            }
+
+            lock.unlock();
+            m_clock->WaitForFrame();
+            Flush();
+            lock.lock();
+        }
+    }
+
+    WindowBackend& m_inner;
+    EnforcementStats* m_stats;
+    FrameClock* m_clock = nullptr;
+    bool m_running = false;
+    bool m_manual = false;
+    std::mutex m_mutex;
+    std::mutex m_flushMutex;  // Held while a batch is applied
+    std::condition_variable m_wakeup;
+    std::thread m_thread;
+    std::unordered_map<HWND, Pending> m_pending;
+    std::atomic<uint64_t> m_frames{ 0 };
+    std::atomic<uint64_t> m_flushed{ 0 };
+    std::atomic<uint64_t> m_coalesced{ 0 };
+    std::atomic<uint32_t> m_largestFrame{ 0 };
+};
@@ -0,0 +1,121 @@
+﻿#pragma once
+
+// The few window system types and constants the portable core passes
+// around. On Windows they come from <windows.h>; the Linux benchmark,
+// replay and test builds only ever drive simulated window systems, so
+// value-compatible stand-ins are enough there.
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cstdint>
+#include <ctime>
+
+struct HWND__;
+using HWND = HWND__*;
+struct HDC__;
+using HDC = HDC__*;
+struct HBITMAP__;
+using HBITMAP = HBITMAP__*;
+using HGDIOBJ = void*;
+
+using BOOL = int;
+using LONG = int32_t;
+using DWORD = uint32_t;
+using UINT = uint32_t;
+using ULONGLONG = uint64_t;
+using WPARAM = uintptr_t;
+using LPARAM = intptr_t;
+using LRESULT = intptr_t;
+using WNDPROC = LRESULT (*)(HWND, UINT, WPARAM, LPARAM);
+
+struct POINT {
+    LONG x;
+    LONG y;
+};
+
+struct SIZE {
+    LONG cx;
+    LONG cy;
+};
+
+struct RECT {
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+};
+
+struct MINMAXINFO {
+    POINT ptReserved;
+    POINT ptMaxSize;
+    POINT ptMaxPosition;
+    POINT ptMinTrackSize;
+    POINT ptMaxTrackSize;
+};
+
+struct WINDOWPOS {
+    HWND hwnd;
+    HWND hwndInsertAfter;
+    int x;
+    int y;
+    int cx;
+    int cy;
+    UINT flags;
+};
+
+constexpr UINT SWP_NOSIZE = 0x0001;
+
+constexpr DWORD EVENT_OBJECT_DESTROY = 0x8001;
+constexpr DWORD EVENT_OBJECT_LOCATIONCHANGE = 0x800B;
+constexpr LONG OBJID_WINDOW = 0;
+constexpr LONG CHILDID_SELF = 0;
+
+constexpr UINT WM_SIZE = 0x0005;
+constexpr UINT WM_SETTEXT = 0x000C;
+constexpr UINT WM_PAINT = 0x000F;
+constexpr UINT WM_GETMINMAXINFO = 0x0024;
+constexpr UINT WM_WINDOWPOSCHANGING = 0x0046;
+constexpr UINT WM_WINDOWPOSCHANGED = 0x0047;
+constexpr UINT WM_NCDESTROY = 0x0082;
+constexpr UINT WM_NCCALCSIZE = 0x0083;
+constexpr UINT WM_NCHITTEST = 0x0084;
+constexpr UINT WM_NCPAINT = 0x0085;
+constexpr UINT WM_NCLBUTTONDOWN = 0x00A1;
+constexpr UINT WM_TIMER = 0x0113;
+constexpr UINT WM_MOUSEMOVE = 0x0200;
+constexpr UINT WM_LBUTTONUP = 0x0202;
+constexpr UINT WM_SIZING = 0x0214;
+constexpr UINT WM_DPICHANGED = 0x02E0;
+constexpr UINT WM_USER = 0x0400;
+
+constexpr LONG WS_OVERLAPPED = 0x00000000;
+constexpr LONG WS_CAPTION = 0x00C00000;
+constexpr LONG WS_SYSMENU = 0x00080000;
+constexpr LONG WS_THICKFRAME = 0x00040000;
+constexpr LONG WS_MINIMIZEBOX = 0x00020000;
+constexpr LONG WS_MAXIMIZEBOX = 0x00010000;
+constexpr LONG WS_OVERLAPPEDWINDOW = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_THICKFRAME | WS_MINIMIZEBOX | WS_MAXIMIZEBOX;
+#endif
+
+// Processor time used by this process so far, in microseconds
+inline uint64_t ProcessCpuMicros() {
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    auto value = [](const FILETIME& time) {
+        return (static_cast<ULONGLONG>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+    };
+    return (value(kernel) + value(user)) / 10;
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time) != 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(time.tv_sec) * 1000000 + static_cast<uint64_t>(time.tv_nsec) / 1000;
+#endif
+}
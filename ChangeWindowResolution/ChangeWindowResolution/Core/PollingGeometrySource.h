@@ -0,0 +1,280 @@
+﻿#pragma once
+
+#include "Enforcement.h"
+#include "Platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Polling period and the slowest interval a stable window backs off to
+constexpr int THREAD_REFRESH_MS = 5;
+constexpr int POLL_MAX_INTERVAL_MS = 1000;
+
+// Hierarchical timing wheel keyed by HWND. Level N slots span WHEEL_SLOTS^N
+// ticks; entries cascade to lower levels as their slot comes due.
+// Cancellation is lazy: stale entries are dropped by generation check. A
+// generation is a stamp from one counter of the wheel, so an entry left
+// behind by Cancel never matches a later Schedule of the same window.
+class TimingWheel {
+public:
+    static constexpr int WHEEL_LEVELS = 3;
+    static constexpr int WHEEL_SLOT_BITS = 6;
+    static constexpr uint64_t WHEEL_SLOTS = 1ull << WHEEL_SLOT_BITS;
+    static constexpr uint64_t WHEEL_SPAN = 1ull << (WHEEL_SLOT_BITS * WHEEL_LEVELS);
+
+    void Schedule(HWND hwnd, uint64_t dueTick) {
+        uint64_t generation = ++m_lastGeneration;
+        m_generations[hwnd] = generation;
+        Insert({ hwnd, std::max(dueTick, m_currentTick + 1), generation });
+    }
+
+    void Cancel(HWND hwnd) {
+        m_generations.erase(hwnd);
+    }
+
+    bool Empty() const {
+        return m_generations.empty();
+    }
+
+    // Moves the wheel forward to nowTick and collects the windows that came due
+    void Advance(uint64_t nowTick, std::vector<HWND>& due) {
+        if (m_generations.empty()) {
+            m_currentTick = std::max(m_currentTick, nowTick);
+            return;
+        }
+
+        while (m_currentTick < nowTick) {
+            ++m_currentTick;
+
+            for (int level = WHEEL_LEVELS - 1; level > 0; --level) {
+                if ((m_currentTick & (LevelSpan(level) - 1)) == 0) {
+                    Cascade(level);
+                }
+            }
+
+            auto& slot = m_slots[0][m_currentTick & (WHEEL_SLOTS - 1)];
+            for (const auto& entry : slot) {
+                if (IsLive(entry)) {
+                    m_generations.erase(entry.hwnd);
+                    due.push_back(entry.hwnd);
+                }
+            }
+            slot.clear();
+        }
+    }
+
+    // First tick at which Advance may produce work, or UINT64_MAX when idle:
+    // the next due level 0 slot or the next cascade of a higher level,
+    // whichever comes first
+    uint64_t NextDueTick() const {
+        if (m_generations.empty()) {
+            return UINT64_MAX;
+        }
+
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < WHEEL_LEVELS; ++level) {
+            uint64_t granularity = LevelSpan(level);
+            uint64_t base = m_currentTick / granularity;
+
+            for (uint64_t i = 1; i <= WHEEL_SLOTS && (base + i) * granularity < next; ++i) {
+                if (!m_slots[level][(base + i) & (WHEEL_SLOTS - 1)].empty()) {
+                    next = (base + i) * granularity;
+                    break;
+                }
+            }
+        }
+
+        return next != UINT64_MAX ? next : m_currentTick + WHEEL_SLOTS;
+    }
+
+private:
+    struct Entry {
+        HWND hwnd;
+        uint64_t dueTick;
+        uint64_t generation;
+    };
+
+    static constexpr uint64_t LevelSpan(int level) {
+        return 1ull << (WHEEL_SLOT_BITS * level);
+    }
+
+    bool IsLive(const Entry& entry) const {
+        auto it = m_generations.find(entry.hwnd);
+        return it != m_generations.end() && it->second == entry.generation;
+    }
+
+    void Insert(Entry entry) {
+        uint64_t delta = std::min(entry.dueTick - m_currentTick, WHEEL_SPAN - 1);
+        entry.dueTick = m_currentTick + delta;
+
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && delta >= LevelSpan(level + 1)) {
+            ++level;
+        }
+
+        uint64_t slot = (entry.dueTick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1);
+        m_slots[level][slot].push_back(entry);
+    }
+
+    void Cascade(int level) {
+        auto& slot = m_slots[level][(m_currentTick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+        std::vector<Entry> entries;
+        entries.swap(slot);
+
+        for (const auto& entry : entries) {
+            if (!IsLive(entry)) {
+                continue;
+            }
+            if (entry.dueTick <= m_currentTick) {
+                m_slots[0][m_currentTick & (WHEEL_SLOTS - 1)].push_back(entry);
+            }
+            else {
+                Insert(entry);
+            }
+        }
+    }
+
+    std::vector<Entry> m_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    std::unordered_map<HWND, uint64_t> m_generations;
+    uint64_t m_lastGeneration = 0;
+    uint64_t m_currentTick = 0;
+};
+
+// Polling fallback: one scheduler thread checks every watched window from a
+// timing wheel. Stable windows back off towards POLL_MAX_INTERVAL_MS,
+// windows that just drifted drop back to THREAD_REFRESH_MS.
+class PollingGeometrySource : public GeometryEventSource {
+public:
+    ~PollingGeometrySource() { Stop(); }
+
+    bool Start(GeometryEventSink* sink) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        m_sink = sink;
+        m_running = true;
+        m_epoch = std::chrono::steady_clock::now();
+        m_thread = std::thread(&PollingGeometrySource::Run, this);
+        return true;
+    }
+
+    void Stop() override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_thread.joinable()) {
+                return;
+            }
+            m_running = false;
+        }
+
+        m_wakeup.notify_all();
+        m_thread.join();
+
+        m_intervals.clear();
+        m_wheel = TimingWheel();
+    }
+
+    bool Watch(HWND hwnd) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running) {
+                return false;
+            }
+
+            m_intervals[hwnd] = 1;
+            m_wheel.Schedule(hwnd, CurrentTick() + 1);
+        }
+
+        m_wakeup.notify_one();
+        return true;
+    }
+
+    // Once this returns no check of the window is still running, so the
+    // caller may restore it. A check that unwatches its own window skips
+    // the wait.
+    void Unwatch(HWND hwnd) override {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_intervals.erase(hwnd);
+        m_wheel.Cancel(hwnd);
+
+        if (std::this_thread::get_id() != m_thread.get_id()) {
+            m_idle.wait(lock, [&]() {
+                return std::find(m_inFlight.begin(), m_inFlight.end(), hwnd) == m_inFlight.end();
+            });
+        }
+    }
+
+private:
+    static constexpr uint64_t MAX_INTERVAL_TICKS = POLL_MAX_INTERVAL_MS / THREAD_REFRESH_MS;
+
+    uint64_t CurrentTick() const {
+        auto elapsed = std::chrono::steady_clock::now() - m_epoch;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / THREAD_REFRESH_MS;
+    }
+
+    void Run() {
+        std::vector<HWND>& due = m_inFlight;
+        std::vector<GeometryCheck> results;
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        while (m_running) {
+            uint64_t now = CurrentTick();
+            m_wheel.Advance(now, due);
+
+            if (!due.empty()) {
+                // Corrections run unlocked so Watch never waits on SetWindowPos
+                lock.unlock();
+                results.clear();
+                for (HWND hwnd : due) {
+                    results.push_back(m_sink->OnGeometryChanged(hwnd));
+                }
+                lock.lock();
+
+                for (size_t i = 0; i < due.size(); ++i) {
+                    auto it = m_intervals.find(due[i]);
+                    if (it == m_intervals.end()) {
+                        continue;
+                    }
+                    if (results[i] == GeometryCheck::Gone) {
+                        m_intervals.erase(it);
+                        continue;
+                    }
+
+                    it->second = results[i] == GeometryCheck::Corrected ? 1 : std::min(it->second * 2, MAX_INTERVAL_TICKS);
+                    m_wheel.Schedule(due[i], now + it->second);
+                }
+
+                due.clear();
+                m_idle.notify_all();
+                continue;
+            }
+
+            uint64_t next = m_wheel.NextDueTick();
+            if (next == UINT64_MAX) {
+                m_wakeup.wait(lock);
+            }
+            else {
+                m_wakeup.wait_until(lock, m_epoch + std::chrono::milliseconds(next * THREAD_REFRESH_MS));
+            }
+        }
+    }
+
+    GeometryEventSink* m_sink = nullptr;
+    bool m_running = false;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_idle;
+    std::vector<HWND> m_inFlight;  // Windows being checked right now
+    std::thread m_thread;
+    std::chrono::steady_clock::time_point m_epoch;
+    std::unordered_map<HWND, uint64_t> m_intervals;
+    TimingWheel m_wheel;
+};
@@ -0,0 +1,36 @@
+﻿#pragma once
+
+#include "Platform.h"
+
+// Rewrites of size messages that pin a tracked window to its target size,
+// shared by the message hook and the subclass procedure. Each returns true
+// if it changed the message.
+
+// WM_GETMINMAXINFO: the window can be dragged to exactly one size
+inline bool ClampMinMaxInfo(MINMAXINFO& info, int width, int height) {
+    info.ptMinTrackSize.x = width;
+    info.ptMinTrackSize.y = height;
+    info.ptMaxTrackSize.x = width;
+    info.ptMaxTrackSize.y = height;
+    return true;
+}
+
+// WM_WINDOWPOSCHANGING: moves keep their position, resizes get the target
+inline bool ClampWindowPos(WINDOWPOS& pos, int width, int height) {
+    if (pos.flags & SWP_NOSIZE) {
+        return false;
+    }
+    pos.cx = width;
+    pos.cy = height;
+    return true;
+}
+
+// WM_NCCALCSIZE: the proposed client rectangle keeps its top-left corner
+inline bool ClampClientRect(RECT& rect, int width, int height) {
+    if (rect.right - rect.left == width && rect.bottom - rect.top == height) {
+        return false;
+    }
+    rect.right = rect.left + width;
+    rect.bottom = rect.top + height;
+    return true;
+}
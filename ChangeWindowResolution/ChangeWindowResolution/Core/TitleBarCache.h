@@ -0,0 +1,136 @@
+﻿#pragma once
+
+#include "Platform.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+struct TitleBarBitmap {
+    HDC dc = NULL;           // Memory DC with the bitmap selected
+    HBITMAP bitmap = NULL;
+    HGDIOBJ previous = NULL;
+};
+
+// Everything the title bar cache needs from the window system. Keeping it
+// behind an interface lets the cache run without GDI.
+class TitleBarPainter {
+public:
+    virtual ~TitleBarPainter() = default;
+    virtual std::wstring ReadTitle(HWND hwnd) = 0;
+    virtual int ReadWidth(HWND hwnd) = 0;
+    virtual UINT ReadDpi(HWND hwnd) = 0;
+    virtual TitleBarBitmap Render(int width, UINT dpi, const std::wstring& title) = 0;
+    virtual void Blit(HDC target, const TitleBarBitmap& bar, int width) = 0;
+    virtual void Release(TitleBarBitmap& bar) = 0;
+};
+
+// Pre-rendered title bar per window. A paint is a blit unless the width,
+// the title or the DPI changed since the last render; the title is re-read
+// only after WM_SETTEXT, the width is taken from WM_WINDOWPOSCHANGED and
+// the DPI from WM_DPICHANGED.
+class TitleBarCache {
+public:
+    explicit TitleBarCache(TitleBarPainter& painter) : m_painter(painter) {}
+
+    ~TitleBarCache() { Clear(); }
+
+    void Paint(HWND hwnd, HDC hdc) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Entry& entry = m_entries[hwnd];
+
+        if (entry.width <= 0) {
+            entry.width = m_painter.ReadWidth(hwnd);
+        }
+        if (entry.dpi == 0) {
+            entry.dpi = m_painter.ReadDpi(hwnd);
+        }
+        if (entry.titleStale) {
+            std::wstring title = m_painter.ReadTitle(hwnd);
+            if (title != entry.title) {
+                entry.title = std::move(title);
+                entry.renderedWidth = 0;
+            }
+            entry.titleStale = false;
+        }
+
+        if (!entry.bar.dc || entry.renderedWidth != entry.width || entry.renderedDpi != entry.dpi) {
+            m_painter.Release(entry.bar);
+            entry.bar = m_painter.Render(entry.width, entry.dpi, entry.title);
+            entry.renderedWidth = entry.width;
+            entry.renderedDpi = entry.dpi;
+            m_misses++;
+        }
+        else {
+            m_hits++;
+        }
+
+        if (entry.bar.dc) {
+            m_painter.Blit(hdc, entry.bar, entry.width);
+        }
+    }
+
+    void InvalidateTitle(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(hwnd);
+        if (it != m_entries.end()) {
+            it->second.titleStale = true;
+        }
+    }
+
+    void SetWidth(HWND hwnd, int width) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(hwnd);
+        if (it != m_entries.end()) {
+            it->second.width = width;
+        }
+    }
+
+    void SetDpi(HWND hwnd, UINT dpi) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(hwnd);
+        if (it != m_entries.end()) {
+            it->second.dpi = dpi;
+        }
+    }
+
+    void Forget(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(hwnd);
+        if (it != m_entries.end()) {
+            m_painter.Release(it->second.bar);
+            m_entries.erase(it);
+        }
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& pair : m_entries) {
+            m_painter.Release(pair.second.bar);
+        }
+        m_entries.clear();
+    }
+
+    uint64_t Hits() const { return m_hits; }
+    uint64_t Misses() const { return m_misses; }
+
+private:
+    struct Entry {
+        std::wstring title;
+        bool titleStale = true;
+        int width = 0;
+        int renderedWidth = 0;
+        UINT dpi = 0;
+        UINT renderedDpi = 0;
+        TitleBarBitmap bar;
+    };
+
+    TitleBarPainter& m_painter;
+    std::mutex m_mutex;
+    std::unordered_map<HWND, Entry> m_entries;
+    std::atomic<uint64_t> m_hits{ 0 };
+    std::atomic<uint64_t> m_misses{ 0 };
+};
@@ -0,0 +1,236 @@
+﻿#pragma once
+
+#include "Platform.h"
+#include "WindowSnapshot.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cwchar>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FRW_SSE2_SEARCH 1
+#else
+#define FRW_SSE2_SEARCH 0
+#endif
+
+#if FRW_SSE2_SEARCH && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Case folding for title search: ASCII, Latin-1 and Cyrillic letters fold
+// to lower case, and ё folds to е so either spelling finds the other
+constexpr wchar_t FoldCase(wchar_t c) {
+    if ((c >= L'A' && c <= L'Z') || (c >= 0x00C0 && c <= 0x00DE && c != 0x00D7) || (c >= 0x0410 && c <= 0x042F)) {
+        c = static_cast<wchar_t>(c + 0x20);
+    }
+    else if (c >= 0x0400 && c <= 0x040F) {
+        c = static_cast<wchar_t>(c + 0x50);
+    }
+    return c == 0x0451 ? static_cast<wchar_t>(0x0435) : c;
+}
+
+inline std::wstring FoldTitle(const std::wstring& text) {
+    std::wstring result(text);
+    for (auto& c : result) {
+        c = FoldCase(c);
+    }
+    return result;
+}
+
+// Returns the first position of pattern in text, or npos. With SSE2 each
+// step tests a register of candidate positions (8 for a 16-bit wchar_t, 4
+// for a 32-bit one) against the pattern's first and last characters and
+// only fully compares positions where both match.
+inline size_t FindSubstring(const wchar_t* text, size_t textLength, const wchar_t* pattern, size_t patternLength) {
+    if (patternLength == 0) {
+        return 0;
+    }
+    if (patternLength > textLength) {
+        return std::wstring::npos;
+    }
+
+    const size_t lastStart = textLength - patternLength;
+    size_t i = 0;
+
+#if FRW_SSE2_SEARCH
+    constexpr size_t LANES = 16 / sizeof(wchar_t);
+    auto broadcast = [](wchar_t c) {
+        if constexpr (sizeof(wchar_t) == 2) {
+            return _mm_set1_epi16(static_cast<short>(c));
+        }
+        else {
+            return _mm_set1_epi32(static_cast<int>(c));
+        }
+    };
+    auto equal = [](__m128i a, __m128i b) {
+        if constexpr (sizeof(wchar_t) == 2) {
+            return _mm_cmpeq_epi16(a, b);
+        }
+        else {
+            return _mm_cmpeq_epi32(a, b);
+        }
+    };
+    const __m128i first = broadcast(pattern[0]);
+    const __m128i last = broadcast(pattern[patternLength - 1]);
+
+    for (; i + LANES <= lastStart + 1; i += LANES) {
+        __m128i blockFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i blockLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + patternLength - 1));
+        __m128i hits = _mm_and_si128(equal(blockFirst, first), equal(blockLast, last));
+
+        // One mask bit per byte; keep the lowest of each lane
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits)) & (sizeof(wchar_t) == 2 ? 0x5555u : 0x1111u);
+        while (mask) {
+#if defined(_MSC_VER)
+            unsigned long bit;
+            _BitScanForward(&bit, mask);
+#else
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+            size_t candidate = i + bit / sizeof(wchar_t);
+            if (std::wmemcmp(text + candidate + 1, pattern + 1, patternLength - 1) == 0) {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= lastStart; ++i) {
+        if (text[i] == pattern[0] && std::wmemcmp(text + i, pattern, patternLength) == 0) {
+            return i;
+        }
+    }
+    return std::wstring::npos;
+}
+
+enum class TitleMatchKind {
+    Exact,
+    Prefix,
+    Substring,
+    Fuzzy  // Shares at least half of the query's trigrams
+};
+
+struct TitleMatch {
+    HWND hwnd;
+    TitleMatchKind kind;
+    size_t position;  // Match position for substring kinds
+    size_t score;     // Shared trigram count for fuzzy matches
+};
+
+// Trigram index over case-folded titles packed into one arena. Queries of
+// three or more characters only verify windows that contain every trigram
+// of the query; shorter queries scan the arena.
+class TitleIndex {
+public:
+    explicit TitleIndex(const InventorySnapshot& snapshot) : m_version(snapshot.version) {
+        const WindowSnapshot& windows = snapshot.windows;
+        m_arena.reserve(windows.TitleChars());
+        m_entries.reserve(windows.Size());
+
+        for (size_t i = 0; i < windows.Size(); ++i) {
+            std::wstring_view title = windows.Title(i);
+            Entry entry = { windows.Hwnd(i), static_cast<uint32_t>(m_arena.size()), static_cast<uint32_t>(title.size()) };
+            for (wchar_t c : title) {
+                m_arena.push_back(FoldCase(c));
+            }
+
+            uint32_t id = static_cast<uint32_t>(m_entries.size());
+            for (uint32_t i = 0; i + 3 <= entry.length; ++i) {
+                auto& postings = m_trigrams[Trigram(&m_arena[entry.offset + i])];
+                if (postings.empty() || postings.back() != id) {
+                    postings.push_back(id);
+                }
+            }
+            m_entries.push_back(entry);
+        }
+    }
+
+    uint64_t Version() const { return m_version; }
+
+    // All matching windows, best first: exact, prefix, substring, fuzzy
+    std::vector<TitleMatch> Search(const std::wstring& query) const {
+        std::vector<TitleMatch> result;
+        std::wstring folded = FoldTitle(query);
+        if (folded.empty()) {
+            return result;
+        }
+
+        if (folded.size() < 3) {
+            for (uint32_t id = 0; id < m_entries.size(); ++id) {
+                Verify(id, folded, result);
+            }
+        }
+        else {
+            std::vector<uint64_t> trigrams;
+            for (size_t i = 0; i + 3 <= folded.size(); ++i) {
+                trigrams.push_back(Trigram(&folded[i]));
+            }
+            std::sort(trigrams.begin(), trigrams.end());
+            trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+            std::vector<uint16_t> shared(m_entries.size(), 0);
+            for (uint64_t trigram : trigrams) {
+                auto it = m_trigrams.find(trigram);
+                if (it != m_trigrams.end()) {
+                    for (uint32_t id : it->second) {
+                        shared[id]++;
+                    }
+                }
+            }
+
+            for (uint32_t id = 0; id < m_entries.size(); ++id) {
+                if (shared[id] == trigrams.size() && Verify(id, folded, result)) {
+                    continue;
+                }
+                if (shared[id] * 2 >= trigrams.size()) {
+                    result.push_back({ m_entries[id].hwnd, TitleMatchKind::Fuzzy, 0, shared[id] });
+                }
+            }
+        }
+
+        std::stable_sort(result.begin(), result.end(), [](const TitleMatch& a, const TitleMatch& b) {
+            if (a.kind != b.kind) {
+                return a.kind < b.kind;
+            }
+            return a.kind == TitleMatchKind::Fuzzy ? a.score > b.score : a.position < b.position;
+        });
+        return result;
+    }
+
+private:
+    struct Entry {
+        HWND hwnd;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    static uint64_t Trigram(const wchar_t* text) {
+        return (static_cast<uint64_t>(static_cast<uint16_t>(text[0])) << 32) |
+            (static_cast<uint64_t>(static_cast<uint16_t>(text[1])) << 16) |
+            static_cast<uint64_t>(static_cast<uint16_t>(text[2]));
+    }
+
+    bool Verify(uint32_t id, const std::wstring& folded, std::vector<TitleMatch>& result) const {
+        const Entry& entry = m_entries[id];
+        size_t position = FindSubstring(m_arena.data() + entry.offset, entry.length, folded.data(), folded.size());
+        if (position == std::wstring::npos) {
+            return false;
+        }
+
+        TitleMatchKind kind = position != 0 ? TitleMatchKind::Substring
+            : entry.length == folded.size() ? TitleMatchKind::Exact
+            : TitleMatchKind::Prefix;
+        result.push_back({ entry.hwnd, kind, position, 0 });
+        return true;
+    }
+
+    uint64_t m_version;
+    std::vector<wchar_t> m_arena;
+    std::vector<Entry> m_entries;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> m_trigrams;
+};
@@ -0,0 +1,331 @@
+﻿#pragma once
+
+#include "DesktopBenchmark.h"
+#include "Enforcement.h"
+#include "EnforcementStats.h"
+#include "FrameBatching.h"
+#include "Platform.h"
+#include "WindowRegistry.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Geometry trace. "--trace" records what FRW sees and does for tracked
+// windows: hook messages, geometry checks, corrections, deferrals and style
+// changes. Records are a type byte, the microseconds since the previous
+// record, the window and the record's values, all as varints (values
+// zigzag-encoded), so a long resize fight stays small. "--replay" feeds a
+// trace back into the enforcement engine.
+enum TraceEvent : uint8_t {
+    TRACE_TRACK,       // width, height: tracking started or retargeted
+    TRACE_MESSAGE,     // message: seen by a hook procedure
+    TRACE_CHECK,       // width, height: size found by a geometry check
+    TRACE_CORRECTION,  // width, height: SetWindowPos issued
+    TRACE_DEFERRED,    // Correction held back by damping
+    TRACE_STYLE,       // style: enforced style set again
+    TRACE_RELEASE,     // Released by the user, original style restored
+    TRACE_GONE,        // Window destroyed
+    TRACE_EVENT_COUNT
+};
+
+constexpr uint8_t TRACE_VALUE_COUNTS[TRACE_EVENT_COUNT] = { 2, 1, 2, 2, 0, 1, 0, 0 };
+constexpr uint32_t TRACE_FILE_MAGIC = 0x54575246;  // "FRWT"
+constexpr uint32_t TRACE_FILE_VERSION = 1;
+
+inline void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline bool GetVarint(const uint8_t*& data, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; data < end && shift < 64; shift += 7) {
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline uint64_t ZigZag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Window system driven by a trace: geometry checks report the sizes that
+// were recorded, time is the recorded time, and what the engine does about
+// it is counted instead of applied to real windows
+class ReplayBackend : public WindowBackend {
+public:
+    // Starts well past the clock's epoch, which the damper treats as "never"
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::time_point(std::chrono::hours(1));
+    uint64_t corrections = 0;
+    uint64_t styleReapplies = 0;
+    std::vector<double> latencies;  // From drift seen to correction, ms
+
+    void SetSize(HWND hwnd, int width, int height) {
+        RECT& rect = m_windows[hwnd];
+        rect.right = rect.left + width;
+        rect.bottom = rect.top + height;
+    }
+
+    void Remove(HWND hwnd) {
+        m_windows.erase(hwnd);
+        m_driftSeen.erase(hwnd);
+    }
+
+    void DriftSeen(HWND hwnd) {
+        m_driftSeen.emplace(hwnd, now);
+    }
+
+    void DriftEnded(HWND hwnd) {
+        m_driftSeen.erase(hwnd);
+    }
+
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        auto it = m_windows.find(hwnd);
+        if (it == m_windows.end()) {
+            return false;
+        }
+        rect = it->second;
+        return true;
+    }
+
+    bool Exists(HWND hwnd) override {
+        return m_windows.count(hwnd) != 0;
+    }
+
+    void ApplyStyle(HWND, LONG) override {
+        styleReapplies++;
+    }
+
+    void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) override {
+        m_windows[hwnd] = { current.left, current.top, current.left + width, current.top + height };
+        corrections++;
+
+        auto drift = m_driftSeen.find(hwnd);
+        if (drift != m_driftSeen.end()) {
+            latencies.push_back(std::chrono::duration<double, std::milli>(now - drift->second).count());
+            m_driftSeen.erase(drift);
+        }
+    }
+
+    std::chrono::steady_clock::time_point Now() override {
+        return now;
+    }
+
+private:
+    std::unordered_map<HWND, RECT> m_windows;
+    std::unordered_map<HWND, std::chrono::steady_clock::time_point> m_driftSeen;
+};
+
+// "--replay": runs a trace through this build's enforcement engine on one
+// thread with the recorded clock, so the result depends only on the trace.
+// Reports what the recording build did next to what this build does, in the
+// "metric<TAB>value<TAB>unit" form of --bench. Returns false if the data is
+// not a trace.
+inline bool ReplayTrace(const std::vector<uint8_t>& trace, std::wstring& report) {
+    uint32_t header[2] = {};
+    if (trace.size() < sizeof(header) || (memcpy(header, trace.data(), sizeof(header)), header[0] != TRACE_FILE_MAGIC) ||
+        header[1] != TRACE_FILE_VERSION) {
+        return false;
+    }
+
+    // Corrections are batched per 60 Hz frame of the recorded clock, as
+    // the live build batches them per compositor frame
+    constexpr auto FRAME = std::chrono::microseconds(16667);
+    ReplayBackend backend;
+    FrameBatchingBackend batching(backend);
+    batching.SetManual(true);
+    WindowRegistry registry;
+    EnforcementStats stats;
+
+    // Only what the damping defers, as the recording counted it; a check
+    // absorbed by a correction queued for the frame is not a deferral
+    class DeferralCounter : public EnforcementListener {
+    public:
+        uint64_t deferred = 0;
+        void OnDeferred(HWND) override { deferred++; }
+    } deferrals;
+    EnforcementEngine engine(registry, stats, batching, &deferrals);
+
+    struct Recorded {
+        int width = 0;
+        int height = 0;
+        bool driftSeen = false;
+        std::chrono::steady_clock::time_point driftSeenAt;
+    };
+    std::unordered_map<HWND, Recorded> windows;
+    std::map<UINT, uint64_t> messages;
+    std::vector<double> recordedLatencies;
+    uint64_t records = 0;
+    uint64_t checks = 0;
+    uint64_t recordedCorrections = 0;
+    uint64_t recordedDeferred = 0;
+    uint64_t recordedStyles = 0;
+    auto start = backend.now;
+    auto nextFrame = start + FRAME;
+
+    const uint8_t* data = trace.data() + sizeof(header);
+    const uint8_t* end = trace.data() + trace.size();
+    while (data < end) {
+        // A record cut short by a crash ends the trace
+        TraceEvent event = static_cast<TraceEvent>(*data++);
+        uint64_t delta;
+        uint64_t window;
+        int64_t values[2] = {};
+        if (event >= TRACE_EVENT_COUNT || !GetVarint(data, end, delta) || !GetVarint(data, end, window)) {
+            break;
+        }
+        bool complete = true;
+        for (uint8_t i = 0; i < TRACE_VALUE_COUNTS[event] && complete; ++i) {
+            uint64_t value;
+            complete = GetVarint(data, end, value);
+            values[i] = UnZigZag(value);
+        }
+        if (!complete) {
+            break;
+        }
+
+        records++;
+        auto recordedAt = backend.now + std::chrono::microseconds(delta);
+        for (; nextFrame <= recordedAt; nextFrame += FRAME) {
+            backend.now = nextFrame;
+            batching.Flush();
+        }
+        backend.now = recordedAt;
+        HWND hwnd = reinterpret_cast<HWND>(static_cast<uintptr_t>(window));
+        int width = static_cast<int>(values[0]);
+        int height = static_cast<int>(values[1]);
+        Recorded& recorded = windows[hwnd];
+
+        switch (event) {
+        case TRACE_TRACK: {
+            WindowState state;
+            if (!registry.Find(hwnd, state) || !state.tracked) {
+                backend.SetSize(hwnd, width, height);
+                engine.Track(hwnd, width, height, 0, 0, 0);
+            }
+            else {
+                engine.Retarget(hwnd, width, height);
+            }
+            recorded = { width, height, false, {} };
+            backend.DriftEnded(hwnd);
+            break;
+        }
+
+        case TRACE_MESSAGE:
+            messages[static_cast<UINT>(values[0])]++;
+            break;
+
+        case TRACE_CHECK: {
+            checks++;
+            bool drifted = width != recorded.width || height != recorded.height;
+            if (drifted && !recorded.driftSeen) {
+                recorded.driftSeen = true;
+                recorded.driftSeenAt = backend.now;
+            }
+
+            backend.SetSize(hwnd, width, height);
+            if (drifted) {
+                backend.DriftSeen(hwnd);
+            }
+            else {
+                backend.DriftEnded(hwnd);
+            }
+            engine.OnGeometryChanged(hwnd);
+            break;
+        }
+
+        case TRACE_CORRECTION:
+            recordedCorrections++;
+            if (recorded.driftSeen) {
+                recordedLatencies.push_back(std::chrono::duration<double, std::milli>(backend.now - recorded.driftSeenAt).count());
+                recorded.driftSeen = false;
+            }
+            break;
+
+        case TRACE_DEFERRED:
+            recordedDeferred++;
+            break;
+
+        case TRACE_STYLE:
+            recordedStyles++;
+            break;
+
+        case TRACE_RELEASE:
+            engine.Untrack(hwnd);
+            registry.Remove(hwnd);
+            backend.Remove(hwnd);
+            windows.erase(hwnd);
+            break;
+
+        case TRACE_GONE:
+            engine.OnWindowDestroyed(hwnd);
+            backend.Remove(hwnd);
+            windows.erase(hwnd);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    backend.now = nextFrame;
+    batching.Flush();
+    registry.Clear();
+
+    report.clear();
+    auto add = [&](const std::wstring& metric, double value, const wchar_t* unit) {
+        wchar_t line[256];
+        swprintf(line, std::size(line), L"%ls\t%.3f\t%ls\n", metric.c_str(), value, unit);
+        report += line;
+    };
+
+    add(L"trace.records", static_cast<double>(records), L"count");
+    add(L"trace.seconds", std::chrono::duration<double>(backend.now - start).count(), L"s");
+    add(L"trace.checks", static_cast<double>(checks), L"count");
+    for (const auto& message : messages) {
+        wchar_t metric[64];
+        swprintf(metric, std::size(metric), L"trace.message.0x%04x", message.first);
+        add(metric, static_cast<double>(message.second), L"count");
+    }
+
+    add(L"recorded.corrections", static_cast<double>(recordedCorrections), L"count");
+    add(L"recorded.deferred", static_cast<double>(recordedDeferred), L"count");
+    add(L"recorded.style_reapplies", static_cast<double>(recordedStyles), L"count");
+    add(L"recorded.p50", Percentile(recordedLatencies, 0.50), L"ms");
+    add(L"recorded.p99", Percentile(recordedLatencies, 0.99), L"ms");
+    add(L"recorded.max", Percentile(recordedLatencies, 1.0), L"ms");
+
+    add(L"replay.corrections", static_cast<double>(backend.corrections), L"count");
+    add(L"replay.deferred", static_cast<double>(deferrals.deferred), L"count");
+    add(L"replay.style_reapplies", static_cast<double>(backend.styleReapplies), L"count");
+    add(L"replay.p50", Percentile(backend.latencies, 0.50), L"ms");
+    add(L"replay.p99", Percentile(backend.latencies, 0.99), L"ms");
+    add(L"replay.max", Percentile(backend.latencies, 1.0), L"ms");
+
+    uint64_t frames, flushed, coalesced;
+    uint32_t largestFrame;
+    batching.Counters(frames, flushed, coalesced, largestFrame);
+    add(L"replay.frames", static_cast<double>(frames), L"count");
+    add(L"replay.coalesced", static_cast<double>(coalesced), L"count");
+    add(L"replay.largest_frame", largestFrame, L"windows");
+
+    return true;
+}
@@ -0,0 +1,60 @@
+﻿#pragma once
+
+// UTF-8 conversion for the Linux build, where wchar_t holds whole code
+// points; the Windows build converts UTF-16 with WideCharToMultiByte
+#ifndef _WIN32
+#include <cstdint>
+#include <string>
+
+inline std::string WideToUtf8(const std::wstring& text) {
+    std::string utf8;
+    utf8.reserve(text.size());
+    for (wchar_t ch : text) {
+        uint32_t code = static_cast<uint32_t>(ch);
+        if (code < 0x80) {
+            utf8 += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            utf8 += static_cast<char>(0xC0 | (code >> 6));
+            utf8 += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            utf8 += static_cast<char>(0xE0 | (code >> 12));
+            utf8 += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            utf8 += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            utf8 += static_cast<char>(0xF0 | (code >> 18));
+            utf8 += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            utf8 += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            utf8 += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+    return utf8;
+}
+
+// Malformed sequences become U+FFFD
+inline std::wstring Utf8ToWide(const std::string& text) {
+    std::wstring result;
+    for (size_t i = 0; i < text.size();) {
+        uint8_t lead = static_cast<uint8_t>(text[i]);
+        size_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+        if (length == 0 || i + length > text.size()) {
+            result += L'\xFFFD';
+            i++;
+            continue;
+        }
+
+        uint32_t code = length == 1 ? lead : lead & (0x7F >> length);
+        bool valid = true;
+        for (size_t k = 1; k < length; ++k) {
+            uint8_t next = static_cast<uint8_t>(text[i + k]);
+            valid = valid && (next & 0xC0) == 0x80;
+            code = (code << 6) | (next & 0x3F);
+        }
+        result += valid ? static_cast<wchar_t>(code) : L'\xFFFD';
+        i += valid ? length : 1;
+    }
+    return result;
+}
+#endif
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include "Enforcement.h"
+#include "Platform.h"
+
+#include <map>
+
+// What the event-driven source does with one WinEvent, apart from the hook
+// installation, so it can be driven without a desktop. Not synchronized:
+// the owner calls it from the hook thread only.
+class WinEventRouter {
+public:
+    enum class Outcome {
+        Ignored,  // Not a watched top-level window
+        Checked,  // Handed to the sink as a geometry change
+        Released  // Destroyed or gone; the owner unwatches it
+    };
+
+    explicit WinEventRouter(GeometryEventSink* sink = nullptr) : m_sink(sink) {}
+
+    void SetSink(GeometryEventSink* sink) { m_sink = sink; }
+
+    bool IsWatched(HWND hwnd) const { return m_watched.count(hwnd) != 0; }
+
+    // Remembers the UI thread whose hooks report the window
+    void Watch(HWND hwnd, DWORD threadId) { m_watched[hwnd] = threadId; }
+
+    bool Unwatch(HWND hwnd, DWORD& threadId) {
+        auto it = m_watched.find(hwnd);
+        if (it == m_watched.end()) {
+            return false;
+        }
+        threadId = it->second;
+        m_watched.erase(it);
+        return true;
+    }
+
+    void Clear() { m_watched.clear(); }
+
+    Outcome Dispatch(DWORD event, HWND hwnd, LONG idObject, LONG idChild) {
+        if (idObject != OBJID_WINDOW || idChild != CHILDID_SELF || !m_sink || !IsWatched(hwnd)) {
+            return Outcome::Ignored;
+        }
+
+        if (event == EVENT_OBJECT_DESTROY) {
+            m_sink->OnWindowDestroyed(hwnd);
+            return Outcome::Released;
+        }
+        if (m_sink->OnGeometryChanged(hwnd) == GeometryCheck::Gone) {
+            return Outcome::Released;
+        }
+        return Outcome::Checked;
+    }
+
+private:
+    GeometryEventSink* m_sink;
+    std::map<HWND, DWORD> m_watched;
+};
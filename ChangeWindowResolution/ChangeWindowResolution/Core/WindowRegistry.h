@@ -0,0 +1,318 @@
+﻿#pragma once
+
+#include "EnforcementStats.h"
+#include "Platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct ResizeData {
+    int width;
+    int height;
+    bool keepForcing;
+    LONG originalStyle;
+    LONG originalExStyle;
+    LONG enforcedStyle;
+};
+
+// What CustomWindowProc needs of a window, handed to it as subclass
+// reference data so a message costs no registry lookup. Written only inside
+// registry mutators; the size is packed so a retarget is never seen half
+// applied.
+struct WindowContext {
+    std::atomic<uint64_t> target{ 0 };  // width << 32 | height, 0 while not tracked
+    std::atomic<uint32_t> statsRow{ STATS_NO_ROW };
+
+    void SetTarget(int width, int height) {
+        target.store((static_cast<uint64_t>(static_cast<uint32_t>(width)) << 32) | static_cast<uint32_t>(height),
+            std::memory_order_release);
+    }
+
+    bool Target(int& width, int& height) const {
+        uint64_t value = target.load(std::memory_order_acquire);
+        width = static_cast<int>(value >> 32);
+        height = static_cast<int>(value & 0xFFFFFFFFu);
+        return value != 0;
+    }
+};
+
+// Per-window state shared by the hook procedures and the enforcement engine
+struct WindowState {
+    WNDPROC originalProc = nullptr;    // Procedure the window had before ours, for the journal
+    WindowContext* context = nullptr;  // Set while the window is subclassed
+    bool tracked = false;            // Set once a target size is enforced
+    ResizeData size = {};
+    uint32_t statsRow = STATS_NO_ROW;
+};
+
+// Concurrent HWND -> WindowState map for the message path.
+// Open addressing with linear probing; each slot publishes an immutable
+// WindowState, so a lookup is a bounded probe plus a copy and never blocks.
+// Writers are serialized, replace states copy-on-write and free the old
+// ones after a grace period in which every in-flight reader has finished.
+class WindowRegistry {
+public:
+    WindowRegistry() : m_table(new Table(MIN_CAPACITY)) {}
+
+    ~WindowRegistry() {
+        Table* table = m_table.load();
+        for (size_t i = 0; i <= table->mask; ++i) {
+            delete table->slots[i].state.load();
+        }
+        delete table;
+    }
+
+    WindowRegistry(const WindowRegistry&) = delete;
+    WindowRegistry& operator=(const WindowRegistry&) = delete;
+
+    // Wait-free lookup, safe from any thread including window procedures
+    bool Find(HWND hwnd, WindowState& state) const {
+        ReadGuard guard(*this);
+        const Table* table = m_table.load(std::memory_order_acquire);
+
+        size_t index = Hash(hwnd) & table->mask;
+        for (size_t probe = 0; probe <= table->mask; ++probe, index = (index + 1) & table->mask) {
+            HWND key = table->slots[index].key.load(std::memory_order_acquire);
+            if (key == hwnd) {
+                const WindowState* current = table->slots[index].state.load(std::memory_order_acquire);
+                if (!current) {
+                    return false;
+                }
+                state = *current;
+                return true;
+            }
+            if (!key) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Copies the current state (or a default one), lets the caller modify it
+    // and publishes the result
+    template <typename Mutator>
+    void Update(HWND hwnd, Mutator mutate) {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+
+        Slot& slot = AcquireSlot(hwnd);
+        const WindowState* previous = slot.state.load(std::memory_order_relaxed);
+
+        auto next = previous ? new WindowState(*previous) : new WindowState();
+        mutate(*next);
+        slot.state.store(next, std::memory_order_release);
+
+        if (previous) {
+            Synchronize();
+            delete previous;
+        }
+    }
+
+    // Like Update, but leaves windows without state alone. Returns false
+    // if there was nothing to update.
+    template <typename Mutator>
+    bool UpdateIfPresent(HWND hwnd, Mutator mutate) {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+
+        Slot* slot = FindSlot(*m_table.load(std::memory_order_relaxed), hwnd);
+        const WindowState* previous = slot ? slot->state.load(std::memory_order_relaxed) : nullptr;
+        if (!previous) {
+            return false;
+        }
+
+        auto next = new WindowState(*previous);
+        mutate(*next);
+        slot->state.store(next, std::memory_order_release);
+
+        Synchronize();
+        delete previous;
+        return true;
+    }
+
+    void Remove(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+
+        Table* table = m_table.load(std::memory_order_relaxed);
+        Slot* slot = FindSlot(*table, hwnd);
+        if (!slot) {
+            return;
+        }
+
+        const WindowState* previous = slot->state.exchange(nullptr, std::memory_order_acq_rel);
+        if (previous) {
+            m_liveCount--;
+            Synchronize();
+            delete previous;
+        }
+    }
+
+    std::vector<std::pair<HWND, WindowState>> Snapshot() const {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+
+        std::vector<std::pair<HWND, WindowState>> result;
+        const Table* table = m_table.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= table->mask; ++i) {
+            const WindowState* state = table->slots[i].state.load(std::memory_order_relaxed);
+            if (state) {
+                result.emplace_back(table->slots[i].key.load(std::memory_order_relaxed), *state);
+            }
+        }
+        return result;
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+
+        Table* previous = m_table.exchange(new Table(MIN_CAPACITY), std::memory_order_acq_rel);
+        m_liveCount = 0;
+        Synchronize();
+
+        for (size_t i = 0; i <= previous->mask; ++i) {
+            delete previous->slots[i].state.load(std::memory_order_relaxed);
+        }
+        delete previous;
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 64;
+    static constexpr size_t READER_STRIPES = 16;
+
+    struct Slot {
+        std::atomic<HWND> key{ nullptr };
+        std::atomic<const WindowState*> state{ nullptr };
+    };
+
+    struct Table {
+        explicit Table(size_t capacity) : mask(capacity - 1), slots(new Slot[capacity]) {}
+        size_t mask;
+        size_t usedSlots = 0;  // Including removed keys, which keep their slot until rehash
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    struct alignas(64) ReaderCount {
+        std::atomic<long> value{ 0 };
+    };
+
+    // Marks a reader as in flight on one of the two reader-count generations
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const WindowRegistry& registry)
+            : m_count(registry.m_readers[registry.m_epoch.load() & 1][ReaderStripe()].value) {
+            m_count.fetch_add(1);
+        }
+        ~ReadGuard() { m_count.fetch_sub(1); }
+
+    private:
+        std::atomic<long>& m_count;
+    };
+
+    static size_t Hash(HWND hwnd) {
+        uint64_t value = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(hwnd));
+        return static_cast<size_t>((value * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    static size_t ReaderStripe() {
+        static std::atomic<size_t> nextStripe{ 0 };
+        thread_local size_t stripe = nextStripe++ % READER_STRIPES;
+        return stripe;
+    }
+
+    static Slot* FindSlot(Table& table, HWND hwnd) {
+        size_t index = Hash(hwnd) & table.mask;
+        for (size_t probe = 0; probe <= table.mask; ++probe, index = (index + 1) & table.mask) {
+            HWND key = table.slots[index].key.load(std::memory_order_relaxed);
+            if (key == hwnd) {
+                return &table.slots[index];
+            }
+            if (!key) {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns the slot for hwnd, claiming an empty one (and growing) if needed
+    Slot& AcquireSlot(HWND hwnd) {
+        Table* table = m_table.load(std::memory_order_relaxed);
+        if (Slot* slot = FindSlot(*table, hwnd)) {
+            if (!slot->state.load(std::memory_order_relaxed)) {
+                m_liveCount++;
+            }
+            return *slot;
+        }
+
+        // Keep the load factor at or below one half so probes stay short
+        if ((table->usedSlots + 1) * 2 > table->mask + 1) {
+            table = Rehash(std::max(MIN_CAPACITY, NextPowerOfTwo((m_liveCount + 1) * 4)));
+        }
+
+        size_t index = Hash(hwnd) & table->mask;
+        while (table->slots[index].key.load(std::memory_order_relaxed)) {
+            index = (index + 1) & table->mask;
+        }
+
+        table->usedSlots++;
+        m_liveCount++;
+        table->slots[index].key.store(hwnd, std::memory_order_release);
+        return table->slots[index];
+    }
+
+    Table* Rehash(size_t capacity) {
+        Table* previous = m_table.load(std::memory_order_relaxed);
+        Table* next = new Table(capacity);
+
+        for (size_t i = 0; i <= previous->mask; ++i) {
+            const WindowState* state = previous->slots[i].state.load(std::memory_order_relaxed);
+            if (!state) {
+                continue;
+            }
+
+            HWND key = previous->slots[i].key.load(std::memory_order_relaxed);
+            size_t index = Hash(key) & next->mask;
+            while (next->slots[index].key.load(std::memory_order_relaxed)) {
+                index = (index + 1) & next->mask;
+            }
+            next->slots[index].state.store(state, std::memory_order_relaxed);
+            next->slots[index].key.store(key, std::memory_order_relaxed);
+            next->usedSlots++;
+        }
+
+        // States moved to the new table; only the old slot array is retired
+        m_table.store(next, std::memory_order_release);
+        Synchronize();
+        delete previous;
+        return next;
+    }
+
+    // Waits until every reader that could still see retired data has left.
+    // Flipping the epoch sends new readers to the other counter generation,
+    // so each drain only waits for readers already in flight.
+    void Synchronize() const {
+        for (int pass = 0; pass < 2; ++pass) {
+            unsigned drained = m_epoch.fetch_add(1) & 1;
+            for (auto& count : m_readers[drained]) {
+                while (count.value.load() != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    static size_t NextPowerOfTwo(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    std::atomic<Table*> m_table;
+    mutable std::mutex m_writeMutex;
+    size_t m_liveCount = 0;
+    mutable std::atomic<unsigned> m_epoch{ 0 };
+    mutable ReaderCount m_readers[2][READER_STRIPES];
+};
@@ -0,0 +1,121 @@
+﻿#pragma once
+
+#include "Platform.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct WindowInfo {
+    HWND hwnd;
+    std::wstring title;
+    DWORD processId;
+};
+
+enum WindowFlags : uint32_t {
+    WINDOW_VISIBLE = 1u << 0,
+    WINDOW_CHILD = 1u << 1,
+    WINDOW_REMOVED = 1u << 2
+};
+
+// Window list stored as structure-of-arrays. Titles are packed into one
+// arena and read into it directly, without a length limit. Clear() keeps
+// the capacity of every buffer, so refilling a snapshot of similar size
+// does not touch the heap.
+class WindowSnapshot {
+public:
+    void Clear() {
+        m_hwnds.clear();
+        m_processIds.clear();
+        m_flags.clear();
+        m_titleOffsets.clear();
+        m_titleLengths.clear();
+        m_titles.clear();
+    }
+
+    size_t Size() const { return m_hwnds.size(); }
+    bool Empty() const { return m_hwnds.empty(); }
+    size_t TitleChars() const { return m_titles.size(); }
+
+    HWND Hwnd(size_t i) const { return m_hwnds[i]; }
+    DWORD ProcessId(size_t i) const { return m_processIds[i]; }
+    uint32_t Flags(size_t i) const { return m_flags[i]; }
+
+    std::wstring_view Title(size_t i) const {
+        return std::wstring_view(m_titles.data() + m_titleOffsets[i], m_titleLengths[i]);
+    }
+
+    WindowInfo Info(size_t i) const {
+        return { m_hwnds[i], std::wstring(Title(i)), m_processIds[i] };
+    }
+
+    const std::vector<HWND>& Hwnds() const { return m_hwnds; }
+    const std::vector<DWORD>& ProcessIds() const { return m_processIds; }
+
+    void Append(HWND hwnd, DWORD processId, uint32_t flags, std::wstring_view title) {
+        m_hwnds.push_back(hwnd);
+        m_processIds.push_back(processId);
+        m_flags.push_back(flags);
+        m_titleOffsets.push_back(static_cast<uint32_t>(m_titles.size()));
+        m_titleLengths.push_back(static_cast<uint32_t>(title.size()));
+        m_titles.insert(m_titles.end(), title.begin(), title.end());
+    }
+
+    // Appends a window whose title readTitle(buffer, capacity) reads straight
+    // into the arena, returning the characters read; length is the title
+    // length expected. Returns false, appending nothing, if nothing was read.
+    template <typename ReadTitle>
+    bool AppendTitled(HWND hwnd, DWORD processId, uint32_t flags, size_t length, ReadTitle readTitle) {
+        size_t offset = m_titles.size();
+        m_titles.resize(offset + length + 1);
+        int copied = readTitle(&m_titles[offset], length + 1);
+        m_titles.resize(offset + std::max(copied, 0));
+        if (copied <= 0) {
+            return false;
+        }
+
+        m_hwnds.push_back(hwnd);
+        m_processIds.push_back(processId);
+        m_flags.push_back(flags);
+        m_titleOffsets.push_back(static_cast<uint32_t>(offset));
+        m_titleLengths.push_back(static_cast<uint32_t>(copied));
+        return true;
+    }
+
+    // The previous title stays in the arena until the next CopyLiveTo
+    void Update(size_t i, DWORD processId, std::wstring_view title) {
+        m_processIds[i] = processId;
+        m_titleOffsets[i] = static_cast<uint32_t>(m_titles.size());
+        m_titleLengths[i] = static_cast<uint32_t>(title.size());
+        m_titles.insert(m_titles.end(), title.begin(), title.end());
+    }
+
+    void MarkRemoved(size_t i) {
+        m_flags[i] |= WINDOW_REMOVED;
+    }
+
+    // Copies the entries not marked removed into target, reusing its buffers
+    void CopyLiveTo(WindowSnapshot& target) const {
+        target.Clear();
+        for (size_t i = 0; i < m_hwnds.size(); ++i) {
+            if (!(m_flags[i] & WINDOW_REMOVED)) {
+                target.Append(m_hwnds[i], m_processIds[i], m_flags[i], Title(i));
+            }
+        }
+    }
+
+private:
+    std::vector<HWND> m_hwnds;
+    std::vector<DWORD> m_processIds;
+    std::vector<uint32_t> m_flags;
+    std::vector<uint32_t> m_titleOffsets;
+    std::vector<uint32_t> m_titleLengths;
+    std::vector<wchar_t> m_titles;
+};
+
+struct InventorySnapshot {
+    uint64_t version;
+    WindowSnapshot windows;
+};
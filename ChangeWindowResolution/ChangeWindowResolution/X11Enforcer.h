@@ -0,0 +1,564 @@
+﻿#pragma once
+
+// X11 connection and the enforcement of the Linux port: the portable
+// engine in Core/ driven through XCB; the front end is
+// ChangeWindowResolutionX11.cpp
+#include <xcb/xcb.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Core/Enforcement.h"
+#include "Core/EnforcementStats.h"
+#include "Core/PollingGeometrySource.h"
+#include "Core/WindowRegistry.h"
+
+// Constants
+constexpr int TITLE_MAX_BYTES = 1024;
+
+// WM_NORMAL_HINTS (ICCCM 4.1.2.3): 18 CARD32 fields
+constexpr uint32_t SIZE_HINTS_FIELDS = 18;
+constexpr uint32_t SIZE_HINT_P_MIN_SIZE = 1u << 4;
+constexpr uint32_t SIZE_HINT_P_MAX_SIZE = 1u << 5;
+constexpr uint32_t SIZE_HINT_MIN_WIDTH = 5;
+constexpr uint32_t SIZE_HINT_MIN_HEIGHT = 6;
+constexpr uint32_t SIZE_HINT_MAX_WIDTH = 7;
+constexpr uint32_t SIZE_HINT_MAX_HEIGHT = 8;
+
+struct X11WindowInfo {
+    xcb_window_t window;
+    uint32_t processId;  // 0 if the client does not set _NET_WM_PID
+    std::string title;
+    std::string className;
+};
+
+struct X11SizeRequest {
+    xcb_window_t window;
+    int width;
+    int height;
+};
+
+// Connection to the X server, shared by enumeration and enforcement. XCB
+// is thread-safe: replies go to whoever holds the cookie, events to the
+// event thread.
+class X11Connection {
+public:
+    ~X11Connection() { Close(); }
+
+    bool Open() {
+        int screenNumber = 0;
+        m_connection = xcb_connect(nullptr, &screenNumber);
+        if (xcb_connection_has_error(m_connection)) {
+            Close();
+            return false;
+        }
+
+        xcb_screen_iterator_t screens = xcb_setup_roots_iterator(xcb_get_setup(m_connection));
+        for (int i = 0; i < screenNumber && screens.rem; ++i) {
+            xcb_screen_next(&screens);
+        }
+        if (!screens.rem) {
+            Close();
+            return false;
+        }
+        m_screen = screens.data;
+
+        // Every atom in one round trip
+        const char* const NAMES[] = { "_NET_CLIENT_LIST", "_NET_WM_PID", "_NET_WM_NAME", "UTF8_STRING", "FRW_WAKEUP" };
+        xcb_intern_atom_cookie_t cookies[std::size(NAMES)];
+        for (size_t i = 0; i < std::size(NAMES); ++i) {
+            cookies[i] = xcb_intern_atom(m_connection, 0, static_cast<uint16_t>(strlen(NAMES[i])), NAMES[i]);
+        }
+        xcb_atom_t* atoms[] = { &m_netClientList, &m_netWmPid, &m_netWmName, &m_utf8String, &m_wakeup };
+        for (size_t i = 0; i < std::size(NAMES); ++i) {
+            xcb_intern_atom_reply_t* reply = xcb_intern_atom_reply(m_connection, cookies[i], nullptr);
+            *atoms[i] = reply ? reply->atom : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+            free(reply);
+        }
+        return true;
+    }
+
+    void Close() {
+        if (m_connection) {
+            xcb_disconnect(m_connection);
+            m_connection = nullptr;
+        }
+    }
+
+    xcb_connection_t* Get() const { return m_connection; }
+    xcb_screen_t* Screen() const { return m_screen; }
+    xcb_atom_t WakeupAtom() const { return m_wakeup; }
+
+    // Managed top-level windows in the window manager's order
+    std::vector<X11WindowInfo> EnumerateWindows() {
+        std::vector<X11WindowInfo> result;
+        std::vector<uint32_t> clients = PropertyValues(m_screen->root, m_netClientList, XCB_ATOM_WINDOW);
+        if (clients.empty()) {
+            return result;
+        }
+
+        // Send every query first, then collect the replies
+        struct Pending {
+            xcb_get_property_cookie_t pid;
+            xcb_get_property_cookie_t netName;
+            xcb_get_property_cookie_t name;
+            xcb_get_property_cookie_t className;
+        };
+        std::vector<Pending> pending;
+        pending.reserve(clients.size());
+        for (xcb_window_t window : clients) {
+            pending.push_back({
+                xcb_get_property(m_connection, 0, window, m_netWmPid, XCB_ATOM_CARDINAL, 0, 1),
+                xcb_get_property(m_connection, 0, window, m_netWmName, m_utf8String, 0, TITLE_MAX_BYTES / 4),
+                xcb_get_property(m_connection, 0, window, XCB_ATOM_WM_NAME, XCB_ATOM_ANY, 0, TITLE_MAX_BYTES / 4),
+                xcb_get_property(m_connection, 0, window, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, TITLE_MAX_BYTES / 4)
+            });
+        }
+
+        result.reserve(clients.size());
+        for (size_t i = 0; i < clients.size(); ++i) {
+            X11WindowInfo info = { clients[i], 0, {}, {} };
+
+            std::string pid = PropertyReply(pending[i].pid);
+            if (pid.size() >= sizeof(uint32_t)) {
+                memcpy(&info.processId, pid.data(), sizeof(uint32_t));
+            }
+
+            // Legacy clients only set WM_NAME
+            info.title = PropertyReply(pending[i].netName);
+            std::string legacyName = PropertyReply(pending[i].name);
+            if (info.title.empty()) {
+                info.title = std::move(legacyName);
+            }
+
+            // WM_CLASS is "instance\0class\0"; the class is what users know
+            std::string className = PropertyReply(pending[i].className);
+            size_t separator = className.find('\0');
+            info.className = separator == std::string::npos ? className : className.substr(separator + 1);
+            info.className.erase(std::find(info.className.begin(), info.className.end(), '\0'), info.className.end());
+
+            result.push_back(std::move(info));
+        }
+        return result;
+    }
+
+    std::vector<X11WindowInfo> FindWindowsForProcess(uint32_t processId) {
+        auto windows = EnumerateWindows();
+        windows.erase(std::remove_if(windows.begin(), windows.end(),
+            [processId](const X11WindowInfo& window) { return window.processId != processId; }), windows.end());
+        return windows;
+    }
+
+    // 32-bit property values; empty if the property is missing
+    std::vector<uint32_t> PropertyValues(xcb_window_t window, xcb_atom_t property, xcb_atom_t type) {
+        std::vector<uint32_t> values;
+        xcb_get_property_reply_t* reply = xcb_get_property_reply(m_connection,
+            xcb_get_property(m_connection, 0, window, property, type, 0, UINT32_MAX / 4), nullptr);
+        if (reply && reply->format == 32) {
+            auto data = static_cast<const uint32_t*>(xcb_get_property_value(reply));
+            values.assign(data, data + xcb_get_property_value_length(reply) / 4);
+        }
+        free(reply);
+        return values;
+    }
+
+    std::string PropertyReply(xcb_get_property_cookie_t cookie) {
+        std::string value;
+        xcb_get_property_reply_t* reply = xcb_get_property_reply(m_connection, cookie, nullptr);
+        if (reply) {
+            value.assign(static_cast<const char*>(xcb_get_property_value(reply)), xcb_get_property_value_length(reply));
+            free(reply);
+        }
+        return value;
+    }
+
+private:
+    xcb_connection_t* m_connection = nullptr;
+    xcb_screen_t* m_screen = nullptr;
+    xcb_atom_t m_netClientList = XCB_ATOM_NONE;
+    xcb_atom_t m_netWmPid = XCB_ATOM_NONE;
+    xcb_atom_t m_netWmName = XCB_ATOM_NONE;
+    xcb_atom_t m_utf8String = XCB_ATOM_NONE;
+    xcb_atom_t m_wakeup = XCB_ATOM_NONE;
+};
+
+struct X11EnforcementCounters {
+    uint64_t checks = 0;       // ConfigureNotify events and retries for tracked windows
+    uint64_t corrections = 0;  // ConfigureWindow requests sent to undo a drift
+    uint64_t deferred = 0;     // Drifts left to backoff or the size hints during a fight
+};
+
+// The engine names windows by HWND; an X11 window id fits in one
+inline HWND ToHwnd(xcb_window_t window) {
+    return reinterpret_cast<HWND>(static_cast<uintptr_t>(window));
+}
+
+inline xcb_window_t ToX11Window(HWND hwnd) {
+    return static_cast<xcb_window_t>(reinterpret_cast<uintptr_t>(hwnd));
+}
+
+// Window system calls of the engine over XCB. Min = max size hints take
+// the place of the enforced style and are set again with every correction.
+// Geometry comes from the last ConfigureNotify, so a check costs no round
+// trip; a correction drops it until the echo arrives.
+class X11Backend : public WindowBackend {
+public:
+    explicit X11Backend(X11Connection& connection) : m_connection(connection) {}
+
+    // Remembers the size hints the window had before it was enforced; a
+    // window enforced again keeps the ones saved the first time
+    void Enforce(HWND hwnd, std::vector<uint32_t> originalHints) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_originalHints.emplace(hwnd, std::move(originalHints));
+    }
+
+    // Puts the original size hints back; false if the window was not enforced
+    bool Restore(HWND hwnd) {
+        std::vector<uint32_t> hints;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_originalHints.find(hwnd);
+            if (it == m_originalHints.end()) {
+                return false;
+            }
+            hints = std::move(it->second);
+            m_originalHints.erase(it);
+            m_bounds.erase(hwnd);
+        }
+
+        xcb_connection_t* c = m_connection.Get();
+        if (hints.empty()) {
+            xcb_delete_property(c, ToX11Window(hwnd), XCB_ATOM_WM_NORMAL_HINTS);
+        }
+        else {
+            xcb_change_property(c, XCB_PROP_MODE_REPLACE, ToX11Window(hwnd), XCB_ATOM_WM_NORMAL_HINTS,
+                XCB_ATOM_WM_SIZE_HINTS, 32, static_cast<uint32_t>(hints.size()), hints.data());
+        }
+        return true;
+    }
+
+    // The window is gone; nothing to restore
+    void Forget(HWND hwnd) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_originalHints.erase(hwnd);
+        m_bounds.erase(hwnd);
+    }
+
+    void SetBounds(HWND hwnd, int x, int y, int width, int height) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_originalHints.count(hwnd)) {
+            m_bounds[hwnd] = { x, y, x + width, y + height };
+        }
+    }
+
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto it = m_bounds.find(hwnd);
+            if (it != m_bounds.end()) {
+                rect = it->second;
+                return true;
+            }
+        }
+
+        xcb_connection_t* c = m_connection.Get();
+        xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(c, xcb_get_geometry(c, ToX11Window(hwnd)), nullptr);
+        if (!geometry) {
+            return false;
+        }
+        rect = { geometry->x, geometry->y, geometry->x + geometry->width, geometry->y + geometry->height };
+        free(geometry);
+        return true;
+    }
+
+    // Only asked once the geometry query has failed
+    bool Exists(HWND hwnd) override {
+        RECT rect;
+        return GetWindowBounds(hwnd, rect);
+    }
+
+    // X11 has no window styles; the size hints go with the size
+    void ApplyStyle(HWND, LONG) override {}
+
+    void ResizeWindow(HWND hwnd, const RECT&, int width, int height) override {
+        QueueResize(hwnd, width, height);
+        xcb_flush(m_connection.Get());
+    }
+
+    // Size hints and geometry, sent with the next flush
+    void QueueResize(HWND hwnd, int width, int height) {
+        // A check still running when the window is released must not put
+        // the hints back
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_originalHints.find(hwnd);
+        if (it == m_originalHints.end()) {
+            return;
+        }
+        m_bounds.erase(hwnd);
+
+        xcb_connection_t* c = m_connection.Get();
+        xcb_window_t window = ToX11Window(hwnd);
+        uint32_t hints[SIZE_HINTS_FIELDS] = {};
+        std::copy(it->second.begin(), it->second.end(), hints);
+        hints[0] |= SIZE_HINT_P_MIN_SIZE | SIZE_HINT_P_MAX_SIZE;
+        hints[SIZE_HINT_MIN_WIDTH] = hints[SIZE_HINT_MAX_WIDTH] = static_cast<uint32_t>(width);
+        hints[SIZE_HINT_MIN_HEIGHT] = hints[SIZE_HINT_MAX_HEIGHT] = static_cast<uint32_t>(height);
+        xcb_change_property(c, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS,
+            32, SIZE_HINTS_FIELDS, hints);
+
+        uint32_t values[2] = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+        xcb_configure_window(c, window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+    }
+
+private:
+    X11Connection& m_connection;
+    std::mutex m_mutex;
+    std::unordered_map<HWND, std::vector<uint32_t>> m_originalHints;  // Empty if the window had none
+    std::unordered_map<HWND, RECT> m_bounds;
+};
+
+// Geometry events from ConfigureNotify: one thread reads every event of
+// the connection and hands drifts and destroyed windows to the engine
+class X11GeometrySource : public GeometryEventSource {
+public:
+    X11GeometrySource(X11Connection& connection, X11Backend& backend) : m_connection(connection), m_backend(backend) {}
+
+    ~X11GeometrySource() { Stop(); }
+
+    bool Start(GeometryEventSink* sink) override {
+        if (m_thread.joinable()) {
+            return true;
+        }
+
+        // Unmapped window of our own; a message to it wakes the event thread
+        xcb_connection_t* c = m_connection.Get();
+        m_sink = sink;
+        m_wakeupWindow = xcb_generate_id(c);
+        xcb_create_window(c, XCB_COPY_FROM_PARENT, m_wakeupWindow, m_connection.Screen()->root,
+            0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0, nullptr);
+        xcb_flush(c);
+
+        m_thread = std::thread(&X11GeometrySource::Run, this);
+        return true;
+    }
+
+    void Stop() override {
+        if (!m_thread.joinable()) {
+            return;
+        }
+
+        xcb_client_message_event_t message = {};
+        message.response_type = XCB_CLIENT_MESSAGE;
+        message.format = 32;
+        message.window = m_wakeupWindow;
+        message.type = m_connection.WakeupAtom();
+        xcb_send_event(m_connection.Get(), 0, m_wakeupWindow, XCB_EVENT_MASK_NO_EVENT, reinterpret_cast<const char*>(&message));
+        xcb_flush(m_connection.Get());
+        m_thread.join();
+
+        xcb_destroy_window(m_connection.Get(), m_wakeupWindow);
+        xcb_flush(m_connection.Get());
+    }
+
+    // Sent with the next flush
+    bool Watch(HWND hwnd) override {
+        uint32_t eventMask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+        xcb_change_window_attributes(m_connection.Get(), ToX11Window(hwnd), XCB_CW_EVENT_MASK, &eventMask);
+        return true;
+    }
+
+    // Event masks are per client; this only drops ours
+    void Unwatch(HWND hwnd) override {
+        uint32_t eventMask = XCB_EVENT_MASK_NO_EVENT;
+        xcb_change_window_attributes(m_connection.Get(), ToX11Window(hwnd), XCB_CW_EVENT_MASK, &eventMask);
+    }
+
+private:
+    void Run() {
+        xcb_connection_t* c = m_connection.Get();
+        while (xcb_generic_event_t* event = xcb_wait_for_event(c)) {
+            uint8_t type = event->response_type & ~0x80;
+            bool stop = false;
+
+            if (type == 0) {
+                // Errors of unchecked requests; a bad window is one that went away
+                auto error = reinterpret_cast<xcb_generic_error_t*>(event);
+                if (error->error_code == XCB_WINDOW) {
+                    OnDestroyed(ToHwnd(error->resource_id));
+                }
+            }
+            else if (type == XCB_CONFIGURE_NOTIFY) {
+                auto configure = reinterpret_cast<xcb_configure_notify_event_t*>(event);
+                if (configure->window == configure->event) {
+                    HWND hwnd = ToHwnd(configure->window);
+                    m_backend.SetBounds(hwnd, configure->x, configure->y, configure->width, configure->height);
+                    m_sink->OnGeometryChanged(hwnd);
+                }
+            }
+            else if (type == XCB_DESTROY_NOTIFY) {
+                OnDestroyed(ToHwnd(reinterpret_cast<xcb_destroy_notify_event_t*>(event)->window));
+            }
+            else if (type == XCB_CLIENT_MESSAGE) {
+                auto message = reinterpret_cast<xcb_client_message_event_t*>(event);
+                stop = message->window == m_wakeupWindow && message->type == m_connection.WakeupAtom();
+            }
+
+            free(event);
+            if (stop) {
+                break;
+            }
+        }
+    }
+
+    void OnDestroyed(HWND hwnd) {
+        m_backend.Forget(hwnd);
+        m_sink->OnWindowDestroyed(hwnd);
+    }
+
+    X11Connection& m_connection;
+    X11Backend& m_backend;
+    GeometryEventSink* m_sink = nullptr;
+    xcb_window_t m_wakeupWindow = XCB_WINDOW_NONE;
+    std::thread m_thread;
+};
+
+// Event-driven enforcement ("drifted -> correct") by the engine of the
+// Windows build: ConfigureNotify reports drifts, the damping decides
+// between correcting, backing off and leaving a fighting window to the
+// size hints, and the polling source re-checks windows whose correction
+// was deferred. Changing size hints and geometry needs no reply, so a
+// batch is queued and flushed without waiting for the server.
+class X11Enforcer : private EnforcementListener {
+public:
+    explicit X11Enforcer(X11Connection& connection)
+        : m_connection(connection), m_backend(connection), m_source(connection, m_backend),
+          m_engine(m_registry, m_stats, m_backend, this) {
+        m_engine.SetRetrySource(&m_retrySource);
+    }
+
+    ~X11Enforcer() { Stop(); }
+
+    bool Start() {
+        return m_source.Start(&m_engine) && m_retrySource.Start(&m_engine);
+    }
+
+    // Releases every window, then stops the event thread
+    void Stop() {
+        ReleaseAll();
+        m_retrySource.Stop();
+        m_source.Stop();
+    }
+
+    // Starts enforcing a batch: one round trip for the original size hints
+    // of all windows, then every change in a single flush
+    size_t Force(const std::vector<X11SizeRequest>& requests) {
+        xcb_connection_t* c = m_connection.Get();
+
+        std::vector<xcb_get_property_cookie_t> cookies;
+        cookies.reserve(requests.size());
+        for (const auto& request : requests) {
+            cookies.push_back(xcb_get_property(c, 0, request.window, XCB_ATOM_WM_NORMAL_HINTS,
+                XCB_ATOM_WM_SIZE_HINTS, 0, SIZE_HINTS_FIELDS));
+        }
+
+        size_t forced = 0;
+        for (size_t i = 0; i < requests.size(); ++i) {
+            const X11SizeRequest& request = requests[i];
+            xcb_generic_error_t* error = nullptr;
+            xcb_get_property_reply_t* reply = xcb_get_property_reply(c, cookies[i], &error);
+            if (error) {
+                // Most likely the window is already gone
+                free(error);
+                continue;
+            }
+
+            std::vector<uint32_t> originalHints;
+            if (reply && reply->format == 32 && xcb_get_property_value_length(reply) > 0) {
+                auto data = static_cast<const uint32_t*>(xcb_get_property_value(reply));
+                size_t count = std::min<size_t>(SIZE_HINTS_FIELDS, xcb_get_property_value_length(reply) / 4);
+                originalHints.assign(data, data + count);
+            }
+            free(reply);
+
+            HWND hwnd = ToHwnd(request.window);
+            m_backend.Enforce(hwnd, std::move(originalHints));
+            m_engine.Track(hwnd, request.width, request.height, 0, 0, 0);
+            m_source.Watch(hwnd);
+            m_backend.QueueResize(hwnd, request.width, request.height);
+            forced++;
+        }
+
+        xcb_flush(c);
+        return forced;
+    }
+
+    // Restores the original size hints and stops listening to the window
+    bool Release(xcb_window_t window) {
+        HWND hwnd = ToHwnd(window);
+        WindowState state;
+        if (!m_registry.Find(hwnd, state) || !state.tracked) {
+            return false;
+        }
+
+        m_engine.Untrack(hwnd);
+        m_engine.FreeStatsRow(hwnd);
+        m_registry.Remove(hwnd);
+        m_source.Unwatch(hwnd);
+        m_backend.Restore(hwnd);
+        xcb_flush(m_connection.Get());
+        return true;
+    }
+
+    size_t ReleaseAll() {
+        size_t released = 0;
+        for (const auto& pair : m_registry.Snapshot()) {
+            released += Release(ToX11Window(pair.first)) ? 1 : 0;
+        }
+        return released;
+    }
+
+    size_t TrackedCount() {
+        size_t count = 0;
+        for (const auto& pair : m_registry.Snapshot()) {
+            count += pair.second.tracked ? 1 : 0;
+        }
+        return count;
+    }
+
+    X11EnforcementCounters Counters() {
+        X11EnforcementCounters counters;
+        counters.checks = m_checks.load(std::memory_order_relaxed);
+        counters.corrections = m_corrections.load(std::memory_order_relaxed);
+        counters.deferred = m_deferred.load(std::memory_order_relaxed);
+        return counters;
+    }
+
+private:
+    // Counted here rather than in EnforcementStats, which only has rows
+    // for the first STATS_MAX_WINDOWS windows and is not published here
+    void OnChecked(HWND, int, int) override { m_checks.fetch_add(1, std::memory_order_relaxed); }
+    void OnDeferred(HWND) override { m_deferred.fetch_add(1, std::memory_order_relaxed); }
+    void OnCorrected(HWND, LONG, int, int) override { m_corrections.fetch_add(1, std::memory_order_relaxed); }
+
+    // Found gone by a check rather than by DestroyNotify
+    void OnDestroyed(HWND hwnd) override { m_backend.Forget(hwnd); }
+
+    X11Connection& m_connection;
+    X11Backend m_backend;
+    X11GeometrySource m_source;
+    PollingGeometrySource m_retrySource;
+    WindowRegistry m_registry;
+    EnforcementStats m_stats;
+    EnforcementEngine m_engine;
+    std::atomic<uint64_t> m_checks{ 0 };
+    std::atomic<uint64_t> m_corrections{ 0 };
+    std::atomic<uint64_t> m_deferred{ 0 };
+};
@@ -0,0 +1,50 @@
+﻿#pragma once
+
+// Minimal test runner: a test is a function registered with TEST, a failed
+// CHECK reports the expression and marks the run as failed
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+struct TestCase {
+    const char* name;
+    std::function<void()> body;
+};
+
+inline std::vector<TestCase>& Tests() {
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+inline int& Failures() {
+    static int failures = 0;
+    return failures;
+}
+
+struct TestRegistration {
+    TestRegistration(const char* name, std::function<void()> body) {
+        Tests().push_back({ name, std::move(body) });
+    }
+};
+
+#define TEST(name) \
+    void name(); \
+    static TestRegistration name##Registration(#name, name); \
+    void name()
+
+#define CHECK(expression) \
+    do { \
+        if (!(expression)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expression); \
+            Failures()++; \
+        } \
+    } while (0)
+
+inline int RunTests() {
+    for (const TestCase& test : Tests()) {
+        int before = Failures();
+        test.body();
+        printf("%s %s\n", Failures() == before ? "ok  " : "FAIL", test.name);
+    }
+    return Failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,204 @@
+﻿// The control protocol over the Unix socket transport, acting on the
+// enforcement engine and a simulated desktop
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "FakeDesktop.h"
+#include "Core/ControlSocket.h"
+#include "Core/Enforcement.h"
+#include "Core/EnforcementStats.h"
+#include "Core/WindowRegistry.h"
+
+namespace {
+
+// The daemon's operations on the engine, as the Windows build does them
+class SimulatedTarget : public ControlTarget, public EngineHarness {
+public:
+    EnforcementEngine engine{ registry, stats, desktop };
+    std::map<unsigned long, std::vector<HWND>> processes;
+    int batches = 0;
+    bool shutdown = false;
+
+    std::vector<HWND> Resolve(const std::wstring& target) override {
+        if (target.compare(0, 4, L"pid=") == 0) {
+            auto it = processes.find(wcstoul(target.c_str() + 4, nullptr, 10));
+            return it != processes.end() ? it->second : std::vector<HWND>();
+        }
+        HWND hwnd = ParseControlWindow(target);
+        return hwnd && desktop.Exists(hwnd) ? std::vector<HWND>{ hwnd } : std::vector<HWND>();
+    }
+
+    void Force(const std::vector<ControlForce>& windows) override {
+        batches++;
+        for (const auto& window : windows) {
+            engine.Track(window.hwnd, window.width, window.height, WS_OVERLAPPEDWINDOW, 0, ENFORCED_STYLE);
+            engine.OnGeometryChanged(window.hwnd);
+        }
+    }
+
+    bool Resize(HWND hwnd, int width, int height) override {
+        if (!engine.Retarget(hwnd, width, height)) {
+            return false;
+        }
+        engine.OnGeometryChanged(hwnd);
+        return true;
+    }
+
+    bool Release(HWND hwnd) override {
+        WindowState state;
+        if (!registry.Find(hwnd, state) || !state.tracked) {
+            return false;
+        }
+        engine.Untrack(hwnd);
+        engine.FreeStatsRow(hwnd);
+        registry.Remove(hwnd);
+        return true;
+    }
+
+    size_t ReleaseAll() override {
+        size_t released = 0;
+        for (const auto& pair : registry.Snapshot()) {
+            released += Release(pair.first) ? 1 : 0;
+        }
+        return released;
+    }
+
+    std::vector<std::wstring> List() override {
+        std::vector<std::wstring> lines;
+        for (const auto& pair : registry.Snapshot()) {
+            if (pair.second.tracked) {
+                lines.push_back(FormatControlWindow(pair.first) + L" " + std::to_wstring(pair.second.size.width) + L"x" +
+                    std::to_wstring(pair.second.size.height));
+            }
+        }
+        return lines;
+    }
+
+    const EnforcementStats& Stats() const override {
+        return stats;
+    }
+
+    void Shutdown() override {
+        shutdown = true;
+    }
+};
+
+// A daemon listening on a socket of its own
+struct Fixture {
+    SimulatedTarget target;
+    UnixControlServer server{ target };
+    std::string path = "/tmp/frw-control-test." + std::to_string(getpid()) + ".sock";
+
+    Fixture() {
+        target.desktop.Create(Window(0x10), 640, 480);
+        target.desktop.Create(Window(0x20), 640, 480);
+        target.desktop.Create(Window(0x30), 640, 480);
+        target.processes[42] = { Window(0x20), Window(0x30) };
+        CHECK(server.Start(path));
+    }
+
+    std::wstring Send(const std::wstring& request) {
+        std::wstring reply;
+        CHECK(ExchangeUnixControlRequest(path, request, reply));
+        return reply;
+    }
+};
+
+}  // namespace
+
+TEST(ForceResizeAndReleaseOverTheSocket) {
+    Fixture f;
+
+    CHECK(f.Send(L"force 0x10 800 600") == L"ok 1\n");
+    CHECK(f.target.desktop.resizes.size() == 1);
+    CHECK(f.target.desktop.resizes[0].width == 800 && f.target.desktop.resizes[0].height == 600);
+
+    CHECK(f.Send(L"resize 0x10 1024 768") == L"ok\n");
+    CHECK(f.target.desktop.resizes.size() == 2);
+    CHECK(f.target.desktop.resizes[1].width == 1024 && f.target.desktop.resizes[1].height == 768);
+
+    CHECK(f.Send(L"list") == L"ok 1\n0x10 1024x768\n");
+    CHECK(f.Send(L"release 0x10") == L"ok 1\n");
+    CHECK(f.Send(L"list") == L"ok 0\n");
+}
+
+TEST(ConsecutiveForcesAreOneBatch) {
+    Fixture f;
+
+    CHECK(f.Send(L"force 0x10 800 600; force pid=42 800 600\nlist").compare(0, 15, L"ok 1\nok 2\nok 3\n") == 0);
+    CHECK(f.target.batches == 1);
+    CHECK(f.target.desktop.resizes.size() == 3);
+    CHECK(f.Send(L"release all") == L"ok 3\n");
+}
+
+TEST(ErrorsAreReportedPerCommand) {
+    Fixture f;
+
+    CHECK(f.Send(L"force 0x99 800 600") == L"error окно не найдено\n");
+    CHECK(f.Send(L"force 0x10 0 600") == L"error недопустимый размер\n");
+    CHECK(f.Send(L"resize 0x10 800 600") == L"error окно не отслеживается\n");
+    CHECK(f.Send(L"release 0x10\nbogus") == L"error окно не отслеживается\nerror неизвестная команда: bogus\n");
+    CHECK(f.target.desktop.resizes.empty());
+}
+
+TEST(StatsAndShutdown) {
+    Fixture f;
+
+    f.Send(L"force 0x10 800 600");
+    std::wstring stats = f.Send(L"stats");
+    CHECK(stats.compare(0, 3, L"ok ") == 0);
+    CHECK(stats.find(L"corrections=1 ") != std::wstring::npos);
+
+    CHECK(f.Send(L"shutdown") == L"ok\n");
+    CHECK(f.target.shutdown);
+}
+
+TEST(ManyRequestsStayInOrder) {
+    Fixture f;
+
+    f.Send(L"force 0x10 800 600");
+    for (int i = 1; i <= 200; ++i) {
+        CHECK(f.Send(L"resize 0x10 " + std::to_wstring(800 + i) + L" 600") == L"ok\n");
+    }
+    CHECK(f.Send(L"list") == L"ok 1\n0x10 1000x600\n");
+}
+
+TEST(LongRequestsAndRepliesArriveWhole) {
+    Fixture f;
+
+    // A list far past the size of one default socket buffer read
+    std::vector<HWND>& many = f.target.processes[7];
+    for (uintptr_t id = 0x1000; id < 0x1000 + 8000; ++id) {
+        f.target.desktop.Create(Window(id), 640, 480);
+        many.push_back(Window(id));
+    }
+    CHECK(f.Send(L"force pid=7 800 600") == L"ok 8000\n");
+
+    std::wstring list = f.Send(L"list");
+    CHECK(list.size() > 64 * 1024);
+    CHECK(list.compare(0, 8, L"ok 8000\n") == 0);
+    CHECK(std::count(list.begin(), list.end(), L'\n') == 8001);
+
+    std::wstring request;
+    std::wstring expected;
+    for (int i = 0; i < 5000; ++i) {
+        request += L"resize 0x1000 " + std::to_wstring(801 + i % 100) + L" 600\n";
+        expected += L"ok\n";
+    }
+    CHECK(request.size() > 64 * 1024);
+    CHECK(f.Send(request) == expected);
+}
+
+TEST(NoServerIsReported) {
+    std::wstring reply;
+    CHECK(!ExchangeUnixControlRequest("/tmp/frw-control-test.missing.sock", L"list", reply));
+}
+
+int main() {
+    return RunTests();
+}
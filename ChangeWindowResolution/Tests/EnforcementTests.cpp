@@ -0,0 +1,342 @@
+﻿// The enforcement engine and the WinEvent dispatch driven by simulated
+// events: corrections, echoes of FRW's own corrections, damping and the
+// size clamps of the message hooks
+#include <chrono>
+#include <vector>
+
+#include "Check.h"
+#include "FakeDesktop.h"
+#include "Core/Enforcement.h"
+#include "Core/FrameBatching.h"
+#include "Core/SizeClamps.h"
+#include "Core/WinEventRouter.h"
+
+namespace {
+
+class RecordingListener : public EnforcementListener {
+public:
+    std::vector<DampingMode> modes;
+    std::vector<HWND> destroyed;
+    int deferred = 0;
+
+    void OnDeferred(HWND) override { deferred++; }
+    void OnModeChanged(HWND, DampingMode mode) override { modes.push_back(mode); }
+    void OnDestroyed(HWND hwnd) override { destroyed.push_back(hwnd); }
+};
+
+// The engine straight over the desktop, fed by the WinEvent router
+struct Fixture : EngineHarness {
+    RecordingListener listener;
+    EnforcementEngine engine{ registry, stats, desktop, &listener };
+    WinEventRouter router{ &engine };
+
+    void Track(HWND hwnd, int width, int height) {
+        desktop.Create(hwnd, width, height);
+        engine.Track(hwnd, width, height, WS_OVERLAPPEDWINDOW, 0, ENFORCED_STYLE);
+        router.Watch(hwnd, 1);
+    }
+
+    WinEventRouter::Outcome LocationChanged(HWND hwnd) {
+        return router.Dispatch(EVENT_OBJECT_LOCATIONCHANGE, hwnd, OBJID_WINDOW, CHILDID_SELF);
+    }
+};
+
+// Corrections held until the test flushes a frame
+struct BatchingFixture : EngineHarness {
+    FrameBatchingBackend batching{ desktop, &stats };
+    EnforcementEngine engine{ registry, stats, batching };
+
+    BatchingFixture() {
+        batching.SetManual(true);
+    }
+
+    void Track(HWND hwnd, int width, int height) {
+        desktop.Create(hwnd, width, height);
+        engine.Track(hwnd, width, height, WS_OVERLAPPEDWINDOW, 0, ENFORCED_STYLE);
+    }
+};
+
+}  // namespace
+
+TEST(DriftIsCorrectedToTheTargetSize) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    CHECK(f.LocationChanged(Window(0x10)) == WinEventRouter::Outcome::Checked);
+
+    CHECK(f.desktop.resizes.size() == 1);
+    CHECK(f.desktop.resizes[0].hwnd == Window(0x10));
+    CHECK(f.desktop.resizes[0].width == 800);
+    CHECK(f.desktop.resizes[0].height == 600);
+    CHECK(f.desktop.styles.size() == 1 && f.desktop.styles[0] == ENFORCED_STYLE);
+    CHECK(f.Total(STAT_CORRECTIONS) == 1);
+    CHECK(f.Total(STAT_CHECKS) == 1);
+}
+
+TEST(WindowAtSizeIsLeftAlone) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    CHECK(f.LocationChanged(Window(0x10)) == WinEventRouter::Outcome::Checked);
+    CHECK(f.desktop.resizes.empty());
+    CHECK(f.Total(STAT_CORRECTIONS) == 0);
+    CHECK(f.Total(STAT_ECHOES) == 0);
+}
+
+TEST(OwnCorrectionIsRecognizedAsAnEcho) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.LocationChanged(Window(0x10));
+    // The notification the correction itself produces
+    f.desktop.Advance(std::chrono::milliseconds(5));
+    f.LocationChanged(Window(0x10));
+
+    CHECK(f.desktop.resizes.size() == 1);
+    CHECK(f.Total(STAT_ECHOES) == 1);
+
+    // Only the first notification after a correction is its echo
+    f.desktop.Advance(std::chrono::milliseconds(5));
+    f.LocationChanged(Window(0x10));
+    CHECK(f.Total(STAT_ECHOES) == 1);
+}
+
+TEST(LateNotificationIsNotAnEcho) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.LocationChanged(Window(0x10));
+    f.desktop.Advance(std::chrono::milliseconds(500));
+    f.LocationChanged(Window(0x10));
+
+    CHECK(f.Total(STAT_ECHOES) == 0);
+}
+
+TEST(RepeatedFightsBackOffAndThenClampOnly) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    // The application undoes every correction right away
+    int drifts = 0;
+    while (drifts < 10000 && (f.listener.modes.empty() || f.listener.modes.back() != DampingMode::ClampOnly)) {
+        f.desktop.Drift(Window(0x10), 640, 480);
+        f.LocationChanged(Window(0x10));
+        f.desktop.Advance(std::chrono::milliseconds(10));
+        drifts++;
+    }
+
+    CHECK(f.listener.modes.size() == 2);
+    CHECK(f.listener.modes.size() == 2 && f.listener.modes[0] == DampingMode::Backoff);
+    CHECK(f.listener.modes.size() == 2 && f.listener.modes[1] == DampingMode::ClampOnly);
+    CHECK(f.desktop.resizes.size() < static_cast<size_t>(drifts) / 10);
+    CHECK(f.listener.deferred > 0);
+    CHECK(f.Total(STAT_DEFERRED) == static_cast<uint64_t>(f.listener.deferred));
+    CHECK(f.region->windows[0].dampingMode.load() == static_cast<uint32_t>(DampingMode::ClampOnly));
+
+    // Clamp-only issues no corrections at all
+    size_t clamped = f.desktop.resizes.size();
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.LocationChanged(Window(0x10));
+    CHECK(f.desktop.resizes.size() == clamped);
+
+    // The application gives up; a calm period brings immediate corrections back
+    f.desktop.Drift(Window(0x10), 800, 600);
+    f.desktop.Advance(std::chrono::seconds(4));
+    f.LocationChanged(Window(0x10));
+    CHECK(f.listener.modes.back() == DampingMode::Immediate);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.LocationChanged(Window(0x10));
+    CHECK(f.desktop.resizes.size() == clamped + 1);
+}
+
+TEST(RetargetResizesToTheNewSize) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    CHECK(f.engine.Retarget(Window(0x10), 1024, 768));
+    f.LocationChanged(Window(0x10));
+    CHECK(f.desktop.resizes.size() == 1);
+    CHECK(f.desktop.resizes.size() == 1 && f.desktop.resizes[0].width == 1024 && f.desktop.resizes[0].height == 768);
+    CHECK(!f.engine.Retarget(Window(0x20), 1024, 768));
+}
+
+TEST(ForcingAgainKeepsTheOriginalStyles) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    // The second force sees the enforced style as the window's style
+    f.engine.Track(Window(0x10), 1024, 768, ENFORCED_STYLE, 0, ENFORCED_STYLE);
+
+    WindowState state;
+    CHECK(f.registry.Find(Window(0x10), state));
+    CHECK(state.size.originalStyle == WS_OVERLAPPEDWINDOW);
+    CHECK(state.size.enforcedStyle == ENFORCED_STYLE);
+    CHECK(state.size.width == 1024 && state.size.height == 768);
+
+    f.LocationChanged(Window(0x10));
+    CHECK(f.desktop.resizes.size() == 1 && f.desktop.resizes[0].width == 1024);
+}
+
+TEST(RouterIgnoresChildObjectsAndUnwatchedWindows) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+    f.desktop.Drift(Window(0x10), 640, 480);
+
+    CHECK(f.router.Dispatch(EVENT_OBJECT_LOCATIONCHANGE, Window(0x10), OBJID_WINDOW + 1, CHILDID_SELF) ==
+        WinEventRouter::Outcome::Ignored);
+    CHECK(f.router.Dispatch(EVENT_OBJECT_LOCATIONCHANGE, Window(0x10), OBJID_WINDOW, CHILDID_SELF + 1) ==
+        WinEventRouter::Outcome::Ignored);
+    CHECK(f.LocationChanged(Window(0x20)) == WinEventRouter::Outcome::Ignored);
+    CHECK(f.desktop.resizes.empty());
+
+    DWORD threadId = 0;
+    CHECK(f.router.Unwatch(Window(0x10), threadId) && threadId == 1);
+    CHECK(f.LocationChanged(Window(0x10)) == WinEventRouter::Outcome::Ignored);
+    CHECK(f.desktop.resizes.empty());
+}
+
+TEST(DestroyedWindowIsReleased) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+    f.desktop.Destroy(Window(0x10));
+
+    CHECK(f.router.Dispatch(EVENT_OBJECT_DESTROY, Window(0x10), OBJID_WINDOW, CHILDID_SELF) ==
+        WinEventRouter::Outcome::Released);
+    CHECK(f.listener.destroyed.size() == 1 && f.listener.destroyed[0] == Window(0x10));
+
+    WindowState state;
+    CHECK(!f.registry.Find(Window(0x10), state));
+}
+
+TEST(VanishedWindowIsReleasedOnTheNextCheck) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+    f.desktop.Destroy(Window(0x10));
+
+    // Destruction went unreported; the check finds the window gone
+    CHECK(f.LocationChanged(Window(0x10)) == WinEventRouter::Outcome::Released);
+    CHECK(f.listener.destroyed.size() == 1);
+    WindowState state;
+    CHECK(!f.registry.Find(Window(0x10), state));
+}
+
+TEST(QueuedCorrectionAbsorbsChecksUntilItsFrame) {
+    BatchingFixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    CHECK(f.engine.OnGeometryChanged(Window(0x10)) == GeometryCheck::Corrected);
+    CHECK(f.desktop.resizes.empty());
+    CHECK(f.batching.HasPending(Window(0x10)));
+
+    // The bounds stay the real ones while the correction waits
+    RECT rect;
+    CHECK(f.batching.GetWindowBounds(Window(0x10), rect) && rect.right - rect.left == 640);
+
+    // Checks before the frame neither queue it again nor count as its echo
+    f.desktop.Advance(std::chrono::milliseconds(5));
+    CHECK(f.engine.OnGeometryChanged(Window(0x10)) == GeometryCheck::AtSize);
+    CHECK(f.Total(STAT_CORRECTIONS) == 1);
+    CHECK(f.Total(STAT_ECHOES) == 0);
+
+    CHECK(f.batching.Flush() == 1);
+    CHECK(f.desktop.resizes.size() == 1);
+    CHECK(f.desktop.resizes[0].width == 800 && f.desktop.resizes[0].height == 600);
+
+    // The notification the applied correction produces is its echo
+    f.desktop.Advance(std::chrono::milliseconds(5));
+    CHECK(f.engine.OnGeometryChanged(Window(0x10)) == GeometryCheck::AtSize);
+    CHECK(f.Total(STAT_ECHOES) == 1);
+}
+
+TEST(CancelDropsTheQueuedCorrection) {
+    BatchingFixture f;
+    f.Track(Window(0x10), 800, 600);
+
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.engine.OnGeometryChanged(Window(0x10));
+    f.batching.Cancel(Window(0x10));
+
+    CHECK(!f.batching.HasPending(Window(0x10)));
+    CHECK(f.batching.Flush() == 0);
+    CHECK(f.desktop.resizes.empty());
+}
+
+TEST(RowOfAReleasedWindowIsReusedAndItsCountsKept) {
+    Fixture f;
+    f.Track(Window(0x10), 800, 600);
+    f.desktop.Drift(Window(0x10), 640, 480);
+    f.LocationChanged(Window(0x10));
+    WindowState first;
+    CHECK(f.registry.Find(Window(0x10), first) && first.statsRow == 0);
+
+    f.desktop.Destroy(Window(0x10));
+    f.router.Dispatch(EVENT_OBJECT_DESTROY, Window(0x10), OBJID_WINDOW, CHILDID_SELF);
+    CHECK(f.region->windows[0].hwnd == 0);
+
+    f.Track(Window(0x20), 800, 600);
+    WindowState second;
+    CHECK(f.registry.Find(Window(0x20), second) && second.statsRow == 0);
+    CHECK(f.region->windowCount.load() == 1);
+    CHECK(f.region->windows[0].hwnd == reinterpret_cast<uint64_t>(Window(0x20)));
+
+    // The first window's counts moved to the retired cells
+    CHECK(f.Total(STAT_CORRECTIONS) == 1);
+    CHECK(f.region->retired.counters[STAT_CORRECTIONS].load() == 1);
+    uint64_t rowCorrections = 0;
+    for (uint32_t slot = 0; slot < STATS_SLOTS; ++slot) {
+        rowCorrections += f.region->cells[slot][0].counters[STAT_CORRECTIONS].load();
+    }
+    CHECK(rowCorrections == 0);
+}
+
+TEST(MinMaxInfoAllowsOnlyTheTargetSize) {
+    MINMAXINFO info = {};
+    info.ptMinTrackSize = { 100, 100 };
+    info.ptMaxTrackSize = { 4000, 3000 };
+
+    CHECK(ClampMinMaxInfo(info, 800, 600));
+    CHECK(info.ptMinTrackSize.x == 800 && info.ptMinTrackSize.y == 600);
+    CHECK(info.ptMaxTrackSize.x == 800 && info.ptMaxTrackSize.y == 600);
+}
+
+TEST(WindowPosClampKeepsMovesAndPinsResizes) {
+    WINDOWPOS move = {};
+    move.x = 10;
+    move.cx = 1;
+    move.cy = 2;
+    move.flags = SWP_NOSIZE;
+    CHECK(!ClampWindowPos(move, 800, 600));
+    CHECK(move.x == 10 && move.cx == 1 && move.cy == 2);
+
+    WINDOWPOS resize = {};
+    resize.cx = 1024;
+    resize.cy = 768;
+    CHECK(ClampWindowPos(resize, 800, 600));
+    CHECK(resize.cx == 800 && resize.cy == 600);
+}
+
+TEST(ClientRectClampKeepsTheTopLeftCorner) {
+    RECT atSize = { 10, 20, 810, 620 };
+    CHECK(!ClampClientRect(atSize, 800, 600));
+
+    RECT drifted = { 10, 20, 500, 400 };
+    CHECK(ClampClientRect(drifted, 800, 600));
+    CHECK(drifted.left == 10 && drifted.top == 20 && drifted.right == 810 && drifted.bottom == 620);
+}
+
+TEST(MessageClassesSelectOnlySizeMessages) {
+    CHECK(IsMessageOfClass(WM_GETMINMAXINFO, MESSAGE_HOOK));
+    CHECK(IsMessageOfClass(WM_WINDOWPOSCHANGING, MESSAGE_HOOK));
+    CHECK(!IsMessageOfClass(WM_MOUSEMOVE, MESSAGE_HOOK));
+    CHECK(IsMessageOfClass(WM_NCPAINT, MESSAGE_SUBCLASS));
+    CHECK(!IsMessageOfClass(WM_USER + 1, MESSAGE_SUBCLASS));
+}
+
+int main() {
+    return RunTests();
+}
@@ -0,0 +1,103 @@
+﻿#pragma once
+
+// Simulated window system for the engine tests
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "Core/Enforcement.h"
+#include "Core/EnforcementStats.h"
+#include "Core/WindowRegistry.h"
+
+constexpr LONG ENFORCED_STYLE = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU;
+
+inline HWND Window(uintptr_t id) {
+    return reinterpret_cast<HWND>(id);
+}
+
+// Windows kept in memory, with a clock the test moves by hand
+class FakeDesktop : public WindowBackend {
+public:
+    struct Resize {
+        HWND hwnd;
+        int width;
+        int height;
+    };
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::time_point(std::chrono::hours(1));
+    std::vector<Resize> resizes;
+    std::vector<LONG> styles;
+
+    void Create(HWND hwnd, int width, int height) {
+        m_windows[hwnd] = { 100, 100, 100 + width, 100 + height };
+    }
+
+    void Destroy(HWND hwnd) {
+        m_windows.erase(hwnd);
+    }
+
+    // The application resizes its own window
+    void Drift(HWND hwnd, int width, int height) {
+        RECT& rect = m_windows[hwnd];
+        rect.right = rect.left + width;
+        rect.bottom = rect.top + height;
+    }
+
+    void Advance(std::chrono::milliseconds elapsed) {
+        now += elapsed;
+    }
+
+    bool GetWindowBounds(HWND hwnd, RECT& rect) override {
+        auto it = m_windows.find(hwnd);
+        if (it == m_windows.end()) {
+            return false;
+        }
+        rect = it->second;
+        return true;
+    }
+
+    bool Exists(HWND hwnd) override {
+        return m_windows.count(hwnd) != 0;
+    }
+
+    void ApplyStyle(HWND, LONG style) override {
+        styles.push_back(style);
+    }
+
+    void ResizeWindow(HWND hwnd, const RECT& current, int width, int height) override {
+        m_windows[hwnd] = { current.left, current.top, current.left + width, current.top + height };
+        resizes.push_back({ hwnd, width, height });
+    }
+
+    std::chrono::steady_clock::time_point Now() override {
+        return now;
+    }
+
+private:
+    std::unordered_map<HWND, RECT> m_windows;
+};
+
+// Registry, stats and desktop wired as in the Windows build; tests add the
+// engine over the desktop or a backend wrapping it
+struct EngineHarness {
+    std::unique_ptr<StatsRegion> region{ new StatsRegion() };
+    WindowRegistry registry;
+    EnforcementStats stats;
+    FakeDesktop desktop;
+
+    EngineHarness() {
+        stats.Attach(region.get(), 1);
+    }
+
+    ~EngineHarness() {
+        stats.Detach();
+    }
+
+    uint64_t Total(StatCounter counter) const {
+        uint64_t totals[STAT_COUNTER_COUNT] = {};
+        stats.Totals(totals);
+        return totals[counter];
+    }
+};
@@ -0,0 +1,122 @@
+﻿// Trace encoding and "--replay" on traces built in memory
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "Core/Trace.h"
+
+namespace {
+
+// Builds a trace the way TraceRecorder writes one
+class TraceWriter {
+public:
+    TraceWriter() {
+        uint32_t header[2] = { TRACE_FILE_MAGIC, TRACE_FILE_VERSION };
+        m_data.resize(sizeof(header));
+        memcpy(m_data.data(), header, sizeof(header));
+    }
+
+    TraceWriter& Add(TraceEvent event, uint64_t deltaMicros, uintptr_t window, std::initializer_list<int64_t> values = {}) {
+        m_data.push_back(event);
+        PutVarint(m_data, deltaMicros);
+        PutVarint(m_data, window);
+        for (int64_t value : values) {
+            PutVarint(m_data, ZigZag(value));
+        }
+        return *this;
+    }
+
+    const std::vector<uint8_t>& Data() const { return m_data; }
+
+private:
+    std::vector<uint8_t> m_data;
+};
+
+bool HasLine(const std::wstring& report, const std::wstring& line) {
+    return report.find(line + L"\n") != std::wstring::npos;
+}
+
+}  // namespace
+
+TEST(VarintsRoundTrip) {
+    std::vector<uint8_t> data;
+    const int64_t values[] = { 0, 1, -1, 63, -64, 800, -800, INT64_MAX, INT64_MIN };
+    for (int64_t value : values) {
+        PutVarint(data, ZigZag(value));
+    }
+
+    const uint8_t* position = data.data();
+    const uint8_t* end = data.data() + data.size();
+    for (int64_t value : values) {
+        uint64_t encoded;
+        CHECK(GetVarint(position, end, encoded));
+        CHECK(UnZigZag(encoded) == value);
+    }
+    CHECK(position == end);
+
+    uint64_t cut;
+    const uint8_t truncated[] = { 0x80, 0x80 };
+    const uint8_t* start = truncated;
+    CHECK(!GetVarint(start, truncated + sizeof(truncated), cut));
+}
+
+TEST(RejectsDataThatIsNotATrace) {
+    std::wstring report;
+    CHECK(!ReplayTrace({}, report));
+    CHECK(!ReplayTrace({ 'n', 'o', 't', ' ', 'a', ' ', 't', 'r', 'a', 'c', 'e' }, report));
+}
+
+TEST(ReplayCorrectsRecordedDrift) {
+    const uintptr_t window = 0x1000;
+    TraceWriter trace;
+    trace.Add(TRACE_TRACK, 0, window, { 800, 600 })
+        .Add(TRACE_MESSAGE, 100, window, { WM_SIZE })
+        .Add(TRACE_CHECK, 0, window, { 640, 600 })
+        .Add(TRACE_STYLE, 10, window, { 0 })
+        .Add(TRACE_CORRECTION, 0, window, { 800, 600 })
+        .Add(TRACE_CHECK, 20000, window, { 800, 600 })
+        .Add(TRACE_GONE, 1000, window);
+
+    std::wstring report;
+    CHECK(ReplayTrace(trace.Data(), report));
+    CHECK(HasLine(report, L"trace.records\t7.000\tcount"));
+    CHECK(HasLine(report, L"trace.checks\t2.000\tcount"));
+    CHECK(HasLine(report, L"trace.message.0x0005\t1.000\tcount"));
+    CHECK(HasLine(report, L"recorded.corrections\t1.000\tcount"));
+    CHECK(HasLine(report, L"replay.corrections\t1.000\tcount"));
+    CHECK(HasLine(report, L"replay.deferred\t0.000\tcount"));
+}
+
+TEST(ChecksAbsorbedByAQueuedCorrectionAreNotDeferrals) {
+    const uintptr_t window = 0x1000;
+    TraceWriter trace;
+    trace.Add(TRACE_TRACK, 0, window, { 800, 600 })
+        .Add(TRACE_CHECK, 100, window, { 640, 600 })
+        .Add(TRACE_CHECK, 100, window, { 640, 600 })
+        .Add(TRACE_CHECK, 100, window, { 640, 600 })
+        .Add(TRACE_CORRECTION, 0, window, { 800, 600 })
+        .Add(TRACE_CHECK, 20000, window, { 800, 600 });
+
+    std::wstring report;
+    CHECK(ReplayTrace(trace.Data(), report));
+    CHECK(HasLine(report, L"replay.corrections\t1.000\tcount"));
+    CHECK(HasLine(report, L"replay.deferred\t0.000\tcount"));
+}
+
+TEST(ReplayStopsAtATruncatedRecord) {
+    TraceWriter trace;
+    trace.Add(TRACE_TRACK, 0, 0x1000, { 800, 600 });
+    std::vector<uint8_t> data = trace.Data();
+    data.push_back(TRACE_CHECK);
+    data.push_back(0x80);
+
+    std::wstring report;
+    CHECK(ReplayTrace(data, report));
+    CHECK(HasLine(report, L"trace.records\t1.000\tcount"));
+}
+
+int main() {
+    return RunTests();
+}
@@ -0,0 +1,134 @@
+﻿// Timing wheel of the polling fallback, driven tick by tick
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "Check.h"
+#include "Core/PollingGeometrySource.h"
+
+namespace {
+
+HWND Window(uintptr_t id) {
+    return reinterpret_cast<HWND>(id);
+}
+
+// Advances to tick and returns what came due
+std::vector<HWND> AdvanceTo(TimingWheel& wheel, uint64_t tick) {
+    std::vector<HWND> due;
+    wheel.Advance(tick, due);
+    return due;
+}
+
+}  // namespace
+
+TEST(EntriesFireAtTheirTick) {
+    TimingWheel wheel;
+    wheel.Schedule(Window(1), 5);
+    wheel.Schedule(Window(2), 63);
+
+    CHECK(wheel.NextDueTick() == 5);
+    CHECK(AdvanceTo(wheel, 4).empty());
+    CHECK(AdvanceTo(wheel, 5) == std::vector<HWND>{ Window(1) });
+    CHECK(wheel.NextDueTick() == 63);
+    CHECK(AdvanceTo(wheel, 63) == std::vector<HWND>{ Window(2) });
+    CHECK(wheel.Empty());
+    CHECK(wheel.NextDueTick() == UINT64_MAX);
+}
+
+TEST(DistantEntriesCascadeToTheirTick) {
+    TimingWheel wheel;
+    wheel.Schedule(Window(1), 70);
+    wheel.Schedule(Window(2), 5000);
+
+    CHECK(AdvanceTo(wheel, 69).empty());
+    CHECK(AdvanceTo(wheel, 70) == std::vector<HWND>{ Window(1) });
+    CHECK(AdvanceTo(wheel, 4999).empty());
+    CHECK(AdvanceTo(wheel, 5000) == std::vector<HWND>{ Window(2) });
+}
+
+TEST(CancelledEntryStaysCancelledAfterAWatchAgain) {
+    TimingWheel wheel;
+    wheel.Schedule(Window(1), 1000);
+    wheel.Cancel(Window(1));
+    wheel.Schedule(Window(1), 2000);
+
+    CHECK(AdvanceTo(wheel, 1500).empty());
+    CHECK(AdvanceTo(wheel, 2500) == std::vector<HWND>{ Window(1) });
+}
+
+TEST(FiredEntryDoesNotReviveAnOlderOne) {
+    TimingWheel wheel;
+    wheel.Schedule(Window(1), 10);
+    wheel.Schedule(Window(1), 300);  // Replaces the entry at 10
+    CHECK(AdvanceTo(wheel, 10).empty());
+    CHECK(AdvanceTo(wheel, 300) == std::vector<HWND>{ Window(1) });
+
+    wheel.Schedule(Window(1), 320);
+    CHECK(AdvanceTo(wheel, 400) == std::vector<HWND>{ Window(1) });
+}
+
+TEST(NextDueTickSeesHigherLevels) {
+    TimingWheel wheel;
+    wheel.Schedule(Window(1), 70);
+    AdvanceTo(wheel, 60);
+    wheel.Schedule(Window(2), 100);
+
+    // Window 1 waits in level 1 until the cascade at 64
+    CHECK(wheel.NextDueTick() <= 70);
+    CHECK(AdvanceTo(wheel, wheel.NextDueTick()).empty());
+    CHECK(wheel.NextDueTick() == 70);
+    CHECK(AdvanceTo(wheel, 70) == std::vector<HWND>{ Window(1) });
+    CHECK(wheel.NextDueTick() == 100);
+}
+
+// Random schedules and cancels against a plain map: nothing fires early or
+// late, and the wheel never sleeps past a due entry
+TEST(MatchesAReferenceSchedule) {
+    std::mt19937 random(7);
+    TimingWheel wheel;
+    std::map<HWND, uint64_t> expected;
+    uint64_t now = 0;
+
+    for (int step = 0; step < 20000; ++step) {
+        HWND hwnd = Window(1 + random() % 32);
+        switch (random() % 4) {
+        case 0:
+            wheel.Cancel(hwnd);
+            expected.erase(hwnd);
+            break;
+        case 1:
+        case 2: {
+            uint64_t due = now + 1 + random() % (random() % 2 ? 100 : 5000);
+            wheel.Schedule(hwnd, due);
+            expected[hwnd] = due;
+            break;
+        }
+        default: {
+            uint64_t earliest = UINT64_MAX;
+            for (const auto& pair : expected) {
+                earliest = std::min(earliest, pair.second);
+            }
+            uint64_t next = wheel.NextDueTick();
+            CHECK(next <= earliest);
+
+            // Sleep as the scheduler does, up to the next due tick
+            now = std::max(now + 1, std::min(next, now + 200));
+            std::vector<HWND> due = AdvanceTo(wheel, now);
+            for (HWND fired : due) {
+                auto it = expected.find(fired);
+                CHECK(it != expected.end() && it->second == now);
+                expected.erase(fired);
+            }
+            for (const auto& pair : expected) {
+                CHECK(pair.second > now);
+            }
+            break;
+        }
+        }
+    }
+}
+
+int main() {
+    return RunTests();
+}
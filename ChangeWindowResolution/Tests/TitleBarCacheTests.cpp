@@ -0,0 +1,212 @@
+﻿// Title bar cache against a painter that records instead of drawing
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Check.h"
+#include "Core/TitleBarCache.h"
+
+namespace {
+
+HWND Window(uintptr_t id) {
+    return reinterpret_cast<HWND>(id);
+}
+
+// Window properties come from maps the test edits; every render hands out
+// a new fake bitmap so blits show which render they used
+class RecordingPainter : public TitleBarPainter {
+public:
+    struct Render {
+        int width;
+        UINT dpi;
+        std::wstring title;
+    };
+
+    std::unordered_map<HWND, std::wstring> titles;
+    std::unordered_map<HWND, int> widths;
+    std::unordered_map<HWND, UINT> dpis;
+    std::vector<Render> renders;
+    std::vector<HDC> blits;
+    int titleReads = 0;
+    int released = 0;
+    bool failRenders = false;
+
+    std::wstring ReadTitle(HWND hwnd) override {
+        titleReads++;
+        return titles[hwnd];
+    }
+
+    int ReadWidth(HWND hwnd) override {
+        return widths[hwnd];
+    }
+
+    UINT ReadDpi(HWND hwnd) override {
+        return dpis.count(hwnd) ? dpis[hwnd] : 96;
+    }
+
+    TitleBarBitmap Render(int width, UINT dpi, const std::wstring& title) override {
+        renders.push_back({ width, dpi, title });
+        TitleBarBitmap bar;
+        if (!failRenders) {
+            bar.dc = reinterpret_cast<HDC>(static_cast<uintptr_t>(renders.size()));
+            bar.bitmap = reinterpret_cast<HBITMAP>(static_cast<uintptr_t>(renders.size()));
+        }
+        return bar;
+    }
+
+    void Blit(HDC, const TitleBarBitmap& bar, int) override {
+        blits.push_back(bar.dc);
+    }
+
+    void Release(TitleBarBitmap& bar) override {
+        if (bar.dc) {
+            released++;
+        }
+        bar = TitleBarBitmap();
+    }
+};
+
+const HDC TARGET = reinterpret_cast<HDC>(static_cast<uintptr_t>(0x100));
+
+struct Fixture {
+    RecordingPainter painter;
+    TitleBarCache cache{ painter };
+
+    Fixture() {
+        painter.titles[Window(1)] = L"Блокнот";
+        painter.widths[Window(1)] = 800;
+    }
+};
+
+}  // namespace
+
+TEST(FirstPaintRenders) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 1 && f.cache.Hits() == 0);
+    CHECK(f.painter.renders.size() == 1);
+    CHECK(f.painter.renders[0].width == 800 && f.painter.renders[0].dpi == 96 && f.painter.renders[0].title == L"Блокнот");
+    CHECK(f.painter.blits.size() == 1);
+}
+
+TEST(UnchangedWindowIsAHit) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 1 && f.cache.Hits() == 2);
+    CHECK(f.painter.renders.size() == 1);
+    CHECK(f.painter.blits.size() == 3 && f.painter.blits[2] == f.painter.blits[0]);
+    CHECK(f.painter.titleReads == 1);
+}
+
+TEST(SetTextWithTheSameTitleIsAHit) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.InvalidateTitle(Window(1));
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.painter.titleReads == 2);
+    CHECK(f.cache.Misses() == 1 && f.cache.Hits() == 1);
+}
+
+TEST(SameWidthOrDpiIsAHit) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.SetWidth(Window(1), 800);
+    f.cache.SetDpi(Window(1), 96);
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 1 && f.cache.Hits() == 1);
+}
+
+TEST(TitleChangeIsAMiss) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.painter.titles[Window(1)] = L"Блокнот - изменён";
+    f.cache.InvalidateTitle(Window(1));
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 2 && f.cache.Hits() == 0);
+    CHECK(f.painter.renders.size() == 2 && f.painter.renders[1].title == L"Блокнот - изменён");
+    CHECK(f.painter.released == 1);
+}
+
+TEST(TitleIsNotReadAgainWithoutSetText) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.painter.titles[Window(1)] = L"Другой заголовок";
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Hits() == 1);
+    CHECK(f.painter.renders.size() == 1);
+}
+
+TEST(SizeChangeIsAMiss) {
+    Fixture f;
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.SetWidth(Window(1), 1024);
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 2);
+    CHECK(f.painter.renders.size() == 2 && f.painter.renders[1].width == 1024);
+}
+
+TEST(DpiChangeIsAMiss) {
+    Fixture f;
+    f.painter.dpis[Window(1)] = 120;
+    f.cache.Paint(Window(1), TARGET);
+    CHECK(f.painter.renders.size() == 1 && f.painter.renders[0].dpi == 120);
+
+    f.cache.SetDpi(Window(1), 144);
+    f.cache.Paint(Window(1), TARGET);
+
+    CHECK(f.cache.Misses() == 2 && f.cache.Hits() == 0);
+    CHECK(f.painter.renders.size() == 2 && f.painter.renders[1].dpi == 144);
+}
+
+TEST(UpdatesForUnknownWindowsAreIgnored) {
+    Fixture f;
+    f.cache.SetWidth(Window(2), 640);
+    f.cache.SetDpi(Window(2), 144);
+    f.cache.InvalidateTitle(Window(2));
+    f.cache.Forget(Window(2));
+
+    CHECK(f.painter.renders.empty() && f.painter.released == 0);
+}
+
+TEST(FailedRenderIsRetried) {
+    Fixture f;
+    f.painter.failRenders = true;
+    f.cache.Paint(Window(1), TARGET);
+    CHECK(f.painter.blits.empty());
+
+    f.painter.failRenders = false;
+    f.cache.Paint(Window(1), TARGET);
+    CHECK(f.cache.Misses() == 2);
+    CHECK(f.painter.blits.size() == 1);
+}
+
+TEST(ForgetAndClearReleaseBitmaps) {
+    Fixture f;
+    f.painter.titles[Window(2)] = L"Telegram";
+    f.painter.widths[Window(2)] = 640;
+    f.cache.Paint(Window(1), TARGET);
+    f.cache.Paint(Window(2), TARGET);
+
+    f.cache.Forget(Window(1));
+    CHECK(f.painter.released == 1);
+    f.cache.Clear();
+    CHECK(f.painter.released == 2);
+
+    // A forgotten window starts over
+    f.cache.Paint(Window(1), TARGET);
+    CHECK(f.painter.renders.size() == 3);
+}
+
+int main() {
+    return RunTests();
+}
@@ -0,0 +1,148 @@
+﻿// Title search: case folding, match ranking and the vectorized substring scan
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Check.h"
+#include "Core/TitleIndex.h"
+
+namespace {
+
+HWND Window(uintptr_t id) {
+    return reinterpret_cast<HWND>(id);
+}
+
+// Window n + 1 gets titles[n]
+InventorySnapshot Inventory(const std::vector<std::wstring>& titles) {
+    InventorySnapshot snapshot = { 1 };
+    for (size_t i = 0; i < titles.size(); ++i) {
+        snapshot.windows.Append(Window(i + 1), 100, 0, titles[i]);
+    }
+    return snapshot;
+}
+
+std::vector<HWND> Windows(const std::vector<TitleMatch>& matches) {
+    std::vector<HWND> result;
+    for (const auto& match : matches) {
+        result.push_back(match.hwnd);
+    }
+    return result;
+}
+
+size_t Find(const std::wstring& text, const std::wstring& pattern) {
+    return FindSubstring(text.data(), text.size(), pattern.data(), pattern.size());
+}
+
+}  // namespace
+
+TEST(CyrillicFoldsToLowerCaseAndYoToYe) {
+    CHECK(FoldCase(L'Q') == L'q');
+    CHECK(FoldCase(L'À') == L'à');
+    CHECK(FoldCase(L'×') == L'×');  // Not a letter
+    CHECK(FoldCase(L'Ж') == L'ж');
+    CHECK(FoldCase(L'Я') == L'я');
+    CHECK(FoldCase(L'Ђ') == L'ђ');
+    CHECK(FoldCase(L'Ё') == L'е');
+    CHECK(FoldCase(L'ё') == L'е');
+    CHECK(FoldCase(L'1') == L'1');
+    CHECK(FoldTitle(L"Ёлка ПРИВЕТ, Мир") == L"елка привет, мир");
+}
+
+TEST(QueriesFindEitherSpellingOfYo) {
+    InventorySnapshot snapshot = Inventory({ L"Новогодняя ёлка", L"Елка" });
+    TitleIndex index(snapshot);
+
+    CHECK(Windows(index.Search(L"ЁЛКА")) == (std::vector<HWND>{ Window(2), Window(1) }));
+    CHECK(Windows(index.Search(L"ёл")) == (std::vector<HWND>{ Window(2), Window(1) }));
+}
+
+TEST(MatchesRankExactPrefixSubstringFuzzy) {
+    InventorySnapshot snapshot = Inventory({
+        L"Блокада",            // Two of five trigrams: no match
+        L"Мой блокнот",        // Substring at 4
+        L"Блокнод",            // Four of five trigrams
+        L"Блокнот — заметки",  // Prefix
+        L"Старый блокнот",     // Substring at 7
+        L"БЛОКНОТ",            // Exact
+    });
+    TitleIndex index(snapshot);
+
+    std::vector<TitleMatch> matches = index.Search(L"блокнот");
+    CHECK(Windows(matches) == (std::vector<HWND>{ Window(6), Window(4), Window(2), Window(5), Window(3) }));
+    CHECK(matches[0].kind == TitleMatchKind::Exact);
+    CHECK(matches[1].kind == TitleMatchKind::Prefix);
+    CHECK(matches[2].kind == TitleMatchKind::Substring && matches[2].position == 4);
+    CHECK(matches[3].kind == TitleMatchKind::Substring && matches[3].position == 7);
+    CHECK(matches[4].kind == TitleMatchKind::Fuzzy && matches[4].score == 4);
+}
+
+TEST(FuzzyMatchesRankBySharedTrigrams) {
+    InventorySnapshot snapshot = Inventory({ L"calculatrix", L"calcolator" });
+    TitleIndex index(snapshot);
+
+    // calculator: cal alc lcu cul ula lat ato tor
+    std::vector<TitleMatch> matches = index.Search(L"calculator");
+    CHECK(Windows(matches) == (std::vector<HWND>{ Window(1), Window(2) }));
+    CHECK(matches[0].kind == TitleMatchKind::Fuzzy && matches[0].score == 6);
+    CHECK(matches[1].kind == TitleMatchKind::Fuzzy && matches[1].score == 5);
+}
+
+TEST(ShortTitlesAndLongQueries) {
+    InventorySnapshot snapshot = Inventory({ L"Ok", L"A", L"", L"Okay" });
+    TitleIndex index(snapshot);
+
+    // Shorter than a trigram: scanned rather than looked up
+    std::vector<TitleMatch> matches = index.Search(L"OK");
+    CHECK(Windows(matches) == (std::vector<HWND>{ Window(1), Window(4) }));
+    CHECK(matches[0].kind == TitleMatchKind::Exact);
+    CHECK(matches[1].kind == TitleMatchKind::Prefix);
+
+    // Longer than the titles it would have to fit in
+    CHECK(Windows(index.Search(L"okay")) == std::vector<HWND>{ Window(4) });
+    CHECK(index.Search(L"okay, fine").empty());
+    CHECK(index.Search(L"ab").empty());
+    CHECK(index.Search(L"").empty());
+}
+
+TEST(MatchAtTheBlockBoundaryIsFound) {
+    // Positions around both register widths: 4 and 8 characters
+    for (size_t position : { 3, 4, 5, 7, 8, 9, 15, 16, 17 }) {
+        std::wstring text(24, L'x');
+        text.replace(position, 3, L"abc");
+        CHECK(Find(text, L"abc") == position);
+
+        // First and last characters match, the middle does not
+        text.replace(position, 3, L"aXc");
+        CHECK(Find(text, L"abc") == std::wstring::npos);
+    }
+
+    // A match ending on the last character, after a full block
+    CHECK(Find(L"xxxxxxxxxxxxxabc", L"abc") == 13);
+    CHECK(Find(L"xxxxxxxxabc", L"abc") == 8);
+    CHECK(Find(L"abc", L"abcd") == std::wstring::npos);
+    CHECK(Find(L"abc", L"") == 0);
+    CHECK(Find(L"", L"a") == std::wstring::npos);
+}
+
+TEST(SubstringScanAgreesWithStringFind) {
+    std::mt19937 random(7);
+    const std::wstring alphabet = L"abЖж";
+    auto text = [&](size_t length) {
+        std::wstring result;
+        for (size_t i = 0; i < length; ++i) {
+            result += alphabet[random() % alphabet.size()];
+        }
+        return result;
+    };
+
+    for (int round = 0; round < 20000; ++round) {
+        std::wstring haystack = text(random() % 40);
+        std::wstring needle = text(1 + random() % 6);
+        CHECK(Find(haystack, needle) == haystack.find(needle));
+    }
+}
+
+int main() {
+    return RunTests();
+}
@@ -0,0 +1,197 @@
+﻿// The X11 enforcer against a real X server: an Xvfb started for the run.
+// Without Xvfb the run is skipped (exit code 77).
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "Check.h"
+#include "X11Enforcer.h"
+
+namespace {
+
+constexpr int SKIP_RETURN_CODE = 77;
+
+// Xvfb on a display number of its own choosing
+class VirtualDisplay {
+public:
+    ~VirtualDisplay() {
+        if (m_pid > 0) {
+            kill(m_pid, SIGTERM);
+            waitpid(m_pid, nullptr, 0);
+        }
+    }
+
+    // False when Xvfb is missing or did not come up
+    bool Start() {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return false;
+        }
+
+        m_pid = fork();
+        if (m_pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (m_pid == 0) {
+            close(fds[0]);
+            std::string fd = std::to_string(fds[1]);
+            execlp("Xvfb", "Xvfb", "-displayfd", fd.c_str(), "-nolisten", "tcp", "-screen", "0", "1280x1024x24",
+                static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        close(fds[1]);
+
+        // Xvfb writes the display number once it accepts connections
+        std::string number;
+        char c;
+        while (read(fds[0], &c, 1) == 1 && c != '\n') {
+            number += c;
+        }
+        close(fds[0]);
+        if (number.empty()) {
+            return false;
+        }
+
+        setenv("DISPLAY", (":" + number).c_str(), 1);
+        return true;
+    }
+
+private:
+    pid_t m_pid = -1;
+};
+
+// A client of its own, resizing its window as an application would
+class Application {
+public:
+    X11Connection connection;
+    xcb_window_t window = XCB_WINDOW_NONE;
+
+    bool Open() {
+        if (!connection.Open()) {
+            return false;
+        }
+
+        xcb_connection_t* c = connection.Get();
+        uint32_t eventMask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+        window = xcb_generate_id(c);
+        xcb_create_window(c, XCB_COPY_FROM_PARENT, window, connection.Screen()->root, 0, 0, 640, 480, 0,
+            XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, XCB_CW_EVENT_MASK, &eventMask);
+        xcb_map_window(c, window);
+        Sync();
+        return true;
+    }
+
+    void Resize(int width, int height) {
+        uint32_t size[2] = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+        xcb_configure_window(connection.Get(), window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, size);
+        Sync();
+    }
+
+    // A round trip, so everything sent so far has reached the server
+    void Sync() {
+        xcb_connection_t* c = connection.Get();
+        free(xcb_get_input_focus_reply(c, xcb_get_input_focus(c), nullptr));
+    }
+
+    // Polls the window until it has the size or the timeout runs out
+    bool WaitForSize(int width, int height, std::chrono::milliseconds timeout = std::chrono::milliseconds(2000)) {
+        xcb_connection_t* c = connection.Get();
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        do {
+            while (xcb_generic_event_t* event = xcb_poll_for_event(c)) {
+                free(event);
+            }
+            xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(c, xcb_get_geometry(c, window), nullptr);
+            bool atSize = geometry && geometry->width == width && geometry->height == height;
+            free(geometry);
+            if (atSize) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        } while (std::chrono::steady_clock::now() < deadline);
+        return false;
+    }
+};
+
+VirtualDisplay g_display;
+
+}  // namespace
+
+TEST(DriftFromAnotherClientIsCorrected) {
+    Application application;
+    CHECK(application.Open());
+
+    X11Connection connection;
+    CHECK(connection.Open());
+    X11Enforcer enforcer(connection);
+    CHECK(enforcer.Start());
+
+    CHECK(enforcer.Force({ { application.window, 400, 300 } }) == 1);
+    CHECK(application.WaitForSize(400, 300));
+
+    application.Resize(640, 480);
+    CHECK(application.WaitForSize(400, 300));
+    CHECK(enforcer.Counters().corrections >= 1);
+
+    enforcer.Stop();
+}
+
+TEST(FightingWindowIsBackedOff) {
+    Application application;
+    CHECK(application.Open());
+
+    X11Connection connection;
+    CHECK(connection.Open());
+    X11Enforcer enforcer(connection);
+    CHECK(enforcer.Start());
+
+    CHECK(enforcer.Force({ { application.window, 400, 300 } }) == 1);
+    CHECK(application.WaitForSize(400, 300));
+
+    // Every resize lands right after the last correction, so each is a
+    // fight; after a few the engine defers and retries later
+    for (int i = 0; i < 10; ++i) {
+        application.Resize(640, 480);
+        CHECK(application.WaitForSize(400, 300));
+    }
+    CHECK(enforcer.Counters().deferred >= 1);
+
+    enforcer.Stop();
+}
+
+TEST(ReleasedWindowKeepsItsNewSize) {
+    Application application;
+    CHECK(application.Open());
+
+    X11Connection connection;
+    CHECK(connection.Open());
+    X11Enforcer enforcer(connection);
+    CHECK(enforcer.Start());
+
+    CHECK(enforcer.Force({ { application.window, 400, 300 } }) == 1);
+    CHECK(application.WaitForSize(400, 300));
+    CHECK(enforcer.Release(application.window));
+    CHECK(enforcer.TrackedCount() == 0);
+
+    // Nothing undoes a resize once the window is released
+    application.Resize(500, 500);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(application.WaitForSize(500, 500, std::chrono::milliseconds(0)));
+
+    enforcer.Stop();
+}
+
+int main() {
+    if (!g_display.Start()) {
+        std::printf("Xvfb is not available, skipping\n");
+        return SKIP_RETURN_CODE;
+    }
+    return RunTests();
+}